@@ -10,6 +10,11 @@ CFLAGS += -O2 -DNDEBUG
 CPPFLAGS += -O2 -g
 endif
 
+ifeq ($(TRACE), 0)
+CFLAGS += -DLOG_MAX_LEVEL=LOG_INFO
+CPPFLAGS += -DLOG_MAX_LEVEL=LOG_INFO
+endif
+
 # tool chain
 CPP = $(CROSS)g++
 CC = $(CROSS)gcc
@@ -0,0 +1,202 @@
+#include "dns_cache.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/file.h>
+#include <arpa/inet.h>
+
+typedef struct {
+    char host[256];
+    char ip[DNS_CACHE_IP_SIZE];
+    int64_t expire;
+} DnsCacheEntry;
+
+// one entry per line, "host ip expire"
+static int dns_cache_load(const char *file, DnsCacheEntry *entries, int max)
+{
+    char line[512];
+    int n = 0;
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    while (n < max && fgets(line, sizeof(line), fp)) {
+        long long expire = 0;
+        if (sscanf(line, "%255s %15s %lld", entries[n].host, entries[n].ip, &expire) != 3) {
+            continue;
+        }
+        entries[n].expire = expire;
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+/**
+ * the entries expired and of skip_host are dropped, the file is renamed
+ * from a temporary one, so the readers get a complete file.
+ */
+static int dns_cache_save(const char *file, const DnsCacheEntry *entries, int n, const char *skip_host)
+{
+    char tmp[1024];
+    int64_t now = time(NULL);
+    int i;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        logger(LOG_ERROR, "open dns cache[%s] failed, errno %d.", tmp, errno);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (entries[i].expire <= now || (skip_host && !strcmp(entries[i].host, skip_host))) {
+            continue;
+        }
+        fprintf(fp, "%s %s %lld\n", entries[i].host, entries[i].ip, (long long)entries[i].expire);
+    }
+
+    if (fclose(fp) != 0) {
+        logger(LOG_ERROR, "write dns cache[%s] failed, errno %d.", tmp, errno);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, file) != 0) {
+        logger(LOG_ERROR, "rename dns cache[%s] to [%s] failed, errno %d.", tmp, file, errno);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * the processes sharing file update it one at a time, so no entry is
+ * lost between load and save. return the lock fd, or -1.
+ */
+static int dns_cache_lock(const char *file)
+{
+    char lock_file[1024];
+    int fd;
+
+    snprintf(lock_file, sizeof(lock_file), "%s.lock", file);
+    fd = open(lock_file, O_CREAT|O_RDWR, 0644);
+    if (fd < 0) {
+        logger(LOG_ERROR, "open dns cache lock[%s] failed, errno %d.", lock_file, errno);
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) < 0 && errno == EINTR);
+    return fd;
+}
+
+static void dns_cache_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static int dns_resolve(const char *host, char *ip, int size)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    ret = getaddrinfo(host, NULL, &hints, &res);
+    if (ret != 0 || !res) {
+        logger(LOG_ERROR, "resolve %s failed, %s", host, gai_strerror(ret));
+        return -1;
+    }
+
+    if (!inet_ntop(AF_INET, &((struct sockaddr_in *)res->ai_addr)->sin_addr, ip, size)) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    return 0;
+}
+
+int dns_cache_resolve(const char *file, const char *host, int ttl, char *ip, int size)
+{
+    DnsCacheEntry entries[DNS_CACHE_MAX_ENTRIES];
+    int64_t now = time(NULL);
+    struct in_addr addr;
+    int n, i;
+    int fd;
+
+    // an address already
+    if (inet_pton(AF_INET, host, &addr) == 1) {
+        snprintf(ip, size, "%s", host);
+        return 0;
+    }
+
+    n = dns_cache_load(file, entries, DNS_CACHE_MAX_ENTRIES);
+    for (i = 0; i < n; i++) {
+        if (!strcmp(entries[i].host, host) && entries[i].expire > now) {
+            snprintf(ip, size, "%s", entries[i].ip);
+            return 1;
+        }
+    }
+
+    if (dns_resolve(host, ip, size) < 0) {
+        return -1;
+    }
+
+    // the file is read again under the lock, others may have saved since
+    fd = dns_cache_lock(file);
+    if (fd < 0) {
+        return 0;
+    }
+    n = dns_cache_load(file, entries, DNS_CACHE_MAX_ENTRIES);
+
+    // replace the entry of host, or the oldest one when full
+    for (i = 0; i < n; i++) {
+        if (!strcmp(entries[i].host, host)) {
+            break;
+        }
+    }
+    if (i == DNS_CACHE_MAX_ENTRIES) {
+        int j;
+        for (i = 0, j = 1; j < n; j++) {
+            if (entries[j].expire < entries[i].expire) {
+                i = j;
+            }
+        }
+    } else if (i == n) {
+        n++;
+    }
+    snprintf(entries[i].host, sizeof(entries[i].host), "%s", host);
+    snprintf(entries[i].ip, sizeof(entries[i].ip), "%s", ip);
+    entries[i].expire = now + ttl;
+
+    dns_cache_save(file, entries, n, NULL);
+    dns_cache_unlock(fd);
+    return 0;
+}
+
+int dns_cache_invalidate(const char *file, const char *host)
+{
+    DnsCacheEntry entries[DNS_CACHE_MAX_ENTRIES];
+    int fd = dns_cache_lock(file);
+    int n;
+    int ret;
+
+    if (fd < 0) {
+        return -1;
+    }
+    n = dns_cache_load(file, entries, DNS_CACHE_MAX_ENTRIES);
+    ret = dns_cache_save(file, entries, n, host);
+    dns_cache_unlock(fd);
+    return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef DNS_CACHE_H_
+#define DNS_CACHE_H_
+
+// seconds a resolved address is reused
+#define DNS_CACHE_TTL 300
+#define DNS_CACHE_MAX_ENTRIES 64
+#define DNS_CACHE_IP_SIZE 16
+
+/**
+ * resolve host to an ipv4 address, from file when cached within ttl seconds,
+ * otherwise by the resolver and saved to file, which is shared by the
+ * processes restarted.
+ * return 1 when cached, 0 when resolved, -1 on error.
+ */
+int dns_cache_resolve(const char *file, const char *host, int ttl, char *ip, int size);
+
+/**
+ * drop host from file, for example the cached address does not connect.
+ */
+int dns_cache_invalidate(const char *file, const char *host);
+
+#endif
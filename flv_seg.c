@@ -1,4 +1,11 @@
 #include "srs_librtmp.h"
+#include "rtmp_client.h"
+#include "dns_cache.h"
+#include "http_flv.h"
+#include "standby_input.h"
+#include "stage_hist.h"
+#include "metrics.h"
+#include "packet_trace.h"
 #include "seg.h"
 #include "seg_common.h"
 #include "flv_seg.h"
@@ -12,6 +19,7 @@ static char *FLV_FILE_FORMAT = "%s-%u.flv";
 static char *HDS_FILE_FORMAT = "%sSeg1-Frag%d";
 static char *HDS_ABST_FORMAT = "%s_%d.abst";
 static char *RPTP_FILE_FORMAT = "%s-%u.rpts";
+static char *TS_FILE_FORMAT = "%s-%u.ts";
 
 static int interrupt_callback(void *p)
 {
@@ -123,47 +131,170 @@ static int hds_read_8bytes_file(FILE *pf, int32_t *res) {
     p += 8; \
     } while(0)
 
-// init an rtmp handle
-static srs_rtmp_t rtmp_init(const char *url)
+// host of rtmp://host[:port]/app/stream or http://host[:port]/path
+static int input_url_host(const char *url, char *host, int size)
 {
-    int res = 0;
+    const char *end;
+
+    if (strncmp(url, "rtmp://", 7) && strncmp(url, "http://", 7)) {
+        return -1;
+    }
+    url += 7;
+    end = url + strcspn(url, ":/?");
+    if (end == url || end - url >= size) {
+        return -1;
+    }
+    snprintf(host, size, "%.*s", (int)(end - url), url);
+    return 0;
+}
+
+/**
+ * resolve host of the input through the dns cache, which is dropped first
+ * when stale, for example its address does not connect. time taken is added
+ * to cache_us. return as dns_cache_resolve.
+ */
+static int input_dns_resolve(SegHandler *sh, const char *host, int stale, char *ip, int size, int64_t *cache_us)
+{
+    const char *file = sh->params.rtmp_dns_cache;
+    int64_t t = av_gettime_relative();
+    int ret;
+
+    if (stale) {
+        dns_cache_invalidate(file, host);
+    }
+    ret = dns_cache_resolve(file, host, DNS_CACHE_TTL, ip, size);
+    *cache_us += av_gettime_relative() - t;
+    return ret;
+}
+
+/**
+ * connect to ip, which is resolved from the url if NULL, and play
+ * through the rtmp client.
+ */
+static RtmpClient *rtmp_connect(SegHandler *sh, const char *ip)
+{
+    const SegParams *params = &sh->params;
+    const char *url = params->url;
 
-    srs_rtmp_t r = srs_rtmp_create(url);
-    if (r == NULL) {
+    RtmpClient *c = rtmp_client_create(url, NULL, NULL, NULL);
+    if (c == NULL) {
         logger(LOG_ERROR, "create rtmp handle fail");
         return NULL;
     }
 
-    srs_rtmp_set_timeout(r, 5000, 5000);
+    rtmp_client_set_timeout(c, RTMP_CLIENT_TIMEOUT_MS);
+    rtmp_client_set_recv_buffer(c, params->rtmp_recv_buffer);
+    rtmp_client_set_merge_read(c, params->rtmp_merge_read_ms);
+    rtmp_client_set_pipeline(c, params->rtmp_pipeline);
+    rtmp_client_set_interrupt(c, interrupt_callback, sh);
+    if (ip) {
+        rtmp_client_set_server_ip(c, ip);
+    }
 
-    res = srs_rtmp_handshake(r);
-    if (res != 0) {
-        logger(LOG_ERROR, "rtmp handshake fail %s %d", url, res);
-        srs_rtmp_destroy(r);
+    if (rtmp_client_play(c) != 0) {
+        logger(LOG_ERROR, "rtmp play fail %s %s", url, rtmp_client_server_ip(c));
+        rtmp_client_destroy(c);
         return NULL;
     }
+    return c;
+}
 
-    res = srs_rtmp_connect_app(r);
-    if (res != 0) {
-        logger(LOG_ERROR, "rtmp connect app fail %s %d", url, res);
-        srs_rtmp_destroy(r);
+// init an rtmp handle
+static RtmpClient *rtmp_init(SegHandler *sh)
+{
+    const SegParams *params = &sh->params;
+    SegStartup *st = &sh->statis.startup;
+    const RtmpClientStartup *cs;
+    char host[256];
+    char ip[DNS_CACHE_IP_SIZE];
+    int cached = -1;
+    int64_t cache_us = 0;
+    RtmpClient *c;
+
+    memset(st, 0, sizeof(*st));
+    if (params->rtmp_dns_cache && input_url_host(params->url, host, sizeof(host)) == 0) {
+        cached = input_dns_resolve(sh, host, 0, ip, sizeof(ip), &cache_us);
+    }
+
+    c = rtmp_connect(sh, cached >= 0 ? ip : NULL);
+    if (c == NULL && cached > 0) {
+        logger(LOG_WARN, "rtmp connect cached %s of %s fail, resolve again", ip, host);
+        cached = input_dns_resolve(sh, host, 1, ip, sizeof(ip), &cache_us);
+        c = rtmp_connect(sh, cached >= 0 ? ip : NULL);
+    }
+    if (c == NULL) {
         return NULL;
     }
 
-    res = srs_rtmp_play_stream(r);
-    if (res != 0) {
-        logger(LOG_ERROR, "rtmp play stream fail %s %d", url, res);
-        srs_rtmp_destroy(r);
+    cs = rtmp_client_startup(c);
+    st->dns_us = cache_us + cs->dns_us;
+    st->connect_us = cs->connect_us;
+    st->handshake_us = cs->handshake_us;
+    st->connect_app_us = cs->connect_app_us;
+    st->play_us = cs->play_us;
+    logger(LOG_INFO, "rtmp startup %s, dns %.1fms%s, connect %.1fms, handshake %.1fms, connect app %.1fms, play %.1fms%s",
+        rtmp_client_server_ip(c), st->dns_us / 1000.0, cached > 0 ? " cached" : "",
+        st->connect_us / 1000.0, st->handshake_us / 1000.0, st->connect_app_us / 1000.0,
+        st->play_us / 1000.0, params->rtmp_pipeline ? " pipelined" : "");
+
+    return c;
+}
+
+// init an http-flv handle, as rtmp_init
+static HttpFlv *http_init(SegHandler *sh)
+{
+    const SegParams *params = &sh->params;
+    SegStartup *st = &sh->statis.startup;
+    const HttpFlvStartup *hs;
+    char host[256];
+    char ip[DNS_CACHE_IP_SIZE];
+    int cached = -1;
+    int64_t cache_us = 0;
+    HttpFlv *h;
+
+    memset(st, 0, sizeof(*st));
+    if (params->rtmp_dns_cache && input_url_host(params->url, host, sizeof(host)) == 0) {
+        cached = input_dns_resolve(sh, host, 0, ip, sizeof(ip), &cache_us);
+    }
+
+    h = http_flv_open(params->url, cached >= 0 ? ip : NULL, HTTP_FLV_TIMEOUT_MS, interrupt_callback, sh);
+    if (h == NULL && cached > 0) {
+        logger(LOG_WARN, "http-flv open cached %s of %s fail, resolve again", ip, host);
+        cached = input_dns_resolve(sh, host, 1, ip, sizeof(ip), &cache_us);
+        h = http_flv_open(params->url, cached >= 0 ? ip : NULL, HTTP_FLV_TIMEOUT_MS, interrupt_callback, sh);
+    }
+    if (h == NULL) {
         return NULL;
     }
 
-    return r;
+    // no handshake, the request is the play
+    hs = http_flv_startup(h);
+    st->dns_us = cache_us + hs->dns_us;
+    st->connect_us = hs->connect_us;
+    st->play_us = hs->request_us;
+    logger(LOG_INFO, "http-flv startup %s, dns %.1fms%s, connect %.1fms, request %.1fms",
+        http_flv_server_ip(h), st->dns_us / 1000.0, cached > 0 ? " cached" : "",
+        st->connect_us / 1000.0, st->play_us / 1000.0);
+
+    return h;
+}
+
+// read syscalls per MB and bytes moved in the recv buffer
+static void rtmp_log_recv_stats(RtmpClient *c)
+{
+    RtmpClientRecvStats stats;
+
+    rtmp_client_recv_stats(c, &stats);
+    logger(LOG_INFO, "rtmp recv %lld bytes in %lld reads, %.1f reads/MB, %lld bytes moved, buffer %d",
+        (long long)stats.nb_bytes, (long long)stats.nb_reads,
+        stats.nb_bytes > 0 ? stats.nb_reads * 1048576.0 / stats.nb_bytes : 0.0,
+        (long long)stats.nb_moved, stats.buffer_size);
 }
 
-static int hds_update_frag(flv_context_t *fc, SegHandler *sh) 
+static int hds_update_frag(flv_sink_t *sink, u_int32_t end_time) 
 {
     int count = 0;
-    frag_info *last_p = fc->frag_list;
+    frag_info *last_p = sink->frag_list;
     frag_info *new_p;
 
     while (last_p != NULL) {
@@ -178,40 +309,40 @@ static int hds_update_frag(flv_context_t *fc, SegHandler *sh)
 
     // avoid duplicate sequence number
     if (last_p != NULL) {
-        if (last_p->index == fc->hds_frag_count) {
-            last_p->duration = fc->curr_pkt.packet_time - fc->start_time;
-            last_p->start_time = fc->start_time;
+        if (last_p->index == sink->hds_frag_count) {
+            last_p->duration = end_time - sink->start_time;
+            last_p->start_time = sink->start_time;
 
             return 0;
         }
     }
 
     new_p = (frag_info *)malloc(sizeof(frag_info));
-    if (sh->duration != 0) {
-        new_p->duration = sh->duration / 1000;
-    } else if (fc->curr_pkt.packet_time != 0) {
-        new_p->duration = fc->curr_pkt.packet_time - fc->start_time;
+    if (sink->sh.duration != 0) {
+        new_p->duration = sink->sh.duration / 1000;
+    } else if (end_time != 0) {
+        new_p->duration = end_time - sink->start_time;
     } else {
         new_p->duration = 0;
     }
-    new_p->index = fc->hds_frag_count;
+    new_p->index = sink->hds_frag_count;
     new_p->next = NULL;
-    new_p->start_time = fc->start_time;
+    new_p->start_time = sink->start_time;
 
     if (count == 0) {
-        fc->frag_list = new_p;
+        sink->frag_list = new_p;
     } else {
         last_p->next = new_p;
 
         if (count > HDS_FRAG_WINDOW_SIZE) {
-            last_p = fc->frag_list->next;
-            free(fc->frag_list);
-            fc->frag_list = last_p;
+            last_p = sink->frag_list->next;
+            free(sink->frag_list);
+            sink->frag_list = last_p;
         }
     }
 
     // just for print log
-    last_p = fc->frag_list;
+    last_p = sink->frag_list;
     while(last_p != NULL) {
         logger(LOG_INFO, "hds fater update frag [start:%ld] [duration:%d] [index:%d]",
             last_p->start_time, last_p->duration, last_p->index);
@@ -223,27 +354,100 @@ static int hds_update_frag(flv_context_t *fc, SegHandler *sh)
     return 0;
 }
 
+// stream of the stage latency histograms
+static int flv_stage_stream(char type)
+{
+    if (type == SRS_RTMP_TYPE_VIDEO) {
+        return STAGE_STREAM_VIDEO;
+    } else if (type == SRS_RTMP_TYPE_AUDIO) {
+        return STAGE_STREAM_AUDIO;
+    }
+    return STAGE_STREAM_OTHER;
+}
+
+/**
+ * record what became of the tag, sh is the segment it went to, NULL for none.
+ * flv keeps the input timestamps, pts are not parsed.
+ */
+static void flv_trace_packet(SegHandler *sh, const flv_referenced_packet *pkt, int event, int flags)
+{
+    PktTraceRecord *r = pkt_trace_alloc();
+
+    if (!r) {
+        return;
+    }
+    r->in_dts = (int64_t)pkt->packet_time * 1000;
+    r->in_pts = PKT_TRACE_NOTS;
+    r->out_dts = event == PKT_TRACE_WRITE || event == PKT_TRACE_FAIL ? r->in_dts : PKT_TRACE_NOTS;
+    r->out_pts = PKT_TRACE_NOTS;
+    r->size = pkt->packet_size;
+    r->seg_index = sh ? sh->index : -1;
+    r->chunk_index = 0;
+    r->seg_flags = sh ? sh->flags : 0;
+    r->stream = pkt->packet_type;
+    if (pkt->packet_type == SRS_RTMP_TYPE_VIDEO) {
+        r->type = PKT_TRACE_TYPE_VIDEO;
+        if (pkt->packet_buf && srs_flv_is_keyframe(pkt->packet_buf, pkt->packet_size)) {
+            flags |= PKT_TRACE_FLAG_KEY;
+        }
+    } else if (pkt->packet_type == SRS_RTMP_TYPE_AUDIO) {
+        r->type = PKT_TRACE_TYPE_AUDIO;
+    } else {
+        r->type = PKT_TRACE_TYPE_OTHER;
+    }
+    r->event = event;
+    r->flags = flags | (pkt->is_seq_header ? PKT_TRACE_FLAG_SEQ_HEADER : 0);
+    r->reserved = 0;
+    pkt_trace_commit(r);
+}
+
+/**
+ * write one tag to the segment file of sink, in native ts mode the handle
+ * is a srs_ts_t and the tag is muxed to mpegts directly.
+ */
+static int flv_seg_write_tag(flv_sink_t *sink, char type, u_int32_t time, char *data, int size)
+{
+    uint64_t stage_start = stage_hist_begin();
+    int res;
+
+    if (sink->type == FLV_SINK_TS) {
+        res = srs_ts_write_tag((srs_ts_t)sink->out, type, time, data, size);
+    } else {
+        res = srs_flv_write_tag(sink->out, type, time, data, size);
+    }
+    stage_hist_end(stage_start, STAGE_WRITE, flv_stage_stream(type));
+    return res;
+}
+
 /**
  * generate new segment file
  * 
  */
-static int flv_seg_file_begin(SegHandler *sh, srs_flv_t *flv, flv_context_t *fc)
+static int flv_seg_file_begin(flv_sink_t *sink)
 {
+    SegHandler *sh = &sink->sh;
+
     if (sh->params.is_hds) {
         snprintf(sh->file, sizeof(sh->file), HDS_FILE_FORMAT, sh->params.name, sh->index);
         snprintf(sh->hds_abst_file, sizeof(sh->hds_abst_file), HDS_ABST_FORMAT, sh->params.name, sh->index);
     } else if (sh->params.is_rptp) {
         snprintf(sh->file, sizeof(sh->file), RPTP_FILE_FORMAT, sh->params.name, sh->index);
+    } else if (sh->params.is_native_ts) {
+        snprintf(sh->file, sizeof(sh->file), TS_FILE_FORMAT, sh->params.name, sh->index);
     } else {
         snprintf(sh->file, sizeof(sh->file), FLV_FILE_FORMAT, sh->params.name, sh->index);
     }
 
     logger(LOG_INFO, "start a new segment %s", sh->file);
 
-    *flv = srs_flv_open_write(sh->file);
+    if (sh->params.is_native_ts) {
+        sink->out = srs_ts_open_write(sh->file);
+    } else {
+        sink->out = srs_flv_open_write(sh->file);
+    }
 
-    if (*flv == NULL) {
-        logger(LOG_ERROR, "open flv fail");
+    if (sink->out == NULL) {
+        logger(LOG_ERROR, "open %s fail", sh->params.is_native_ts ? "ts" : "flv");
         return EC_OPEN_FAIL;
     }
 
@@ -264,7 +468,7 @@ static void update_box(char *start, int size)
     start[3] = p_size[0];
 }
 
-static int parse_abst(SegHandler *sh, flv_context_t *fc, const char *path)
+static int parse_abst(flv_sink_t *sink, const char *path)
 {
     int ret = 0;
 
@@ -319,26 +523,34 @@ static int parse_abst(SegHandler *sh, flv_context_t *fc, const char *path)
             return ret;
         }
 
-        // update fc
+        // update sink
         logger(LOG_INFO, "get continue abst info [start:%ld] [duration:%d] [index:%d]",
             frag_starttime, frag_duration, frag_index);
-        fc->start_time = frag_starttime;
-        fc->curr_pkt.packet_time = frag_starttime + frag_duration;
-        fc->hds_frag_count = frag_index;
-        hds_update_frag(fc, sh);
+        sink->start_time = frag_starttime;
+        sink->hds_frag_count = frag_index;
+        hds_update_frag(sink, frag_starttime + frag_duration);
+
+        // next frag starts at the end of this one
+        sink->start_time = frag_starttime + frag_duration;
+    }
+
+    // keep the continued start time from the first frame
+    if (frag_count > 0) {
+        sink->met_first_frame = 1;
     }
 
     // start from next index
-    fc->hds_frag_count++;
-    sh->index = fc->hds_frag_count;
+    sink->hds_frag_count++;
+    sink->sh.index = sink->hds_frag_count;
 
     fclose(pf);
     return ret;
 }
 
-static int flush_hds_abst(SegHandler *sh, flv_context_t *fc) 
+static int flush_hds_abst(flv_sink_t *sink) 
 {
     char abst_data[1024*100], *cur, *start_asrt, *start_afrt;
+    SegHandler *sh = &sink->sh;
 
     memset(abst_data, 0, 1024*100);
     cur = abst_data;
@@ -352,12 +564,12 @@ static int flush_hds_abst(SegHandler *sh, flv_context_t *fc)
     *cur = 't'; cur++;
 
     cur += 4;
-    HDS_WRITE_4(cur, fc->hds_frag_count);
+    HDS_WRITE_4(cur, sink->hds_frag_count);
     *cur = 0x20; cur++;
     HDS_WRITE_4(cur, 1000);
 
     // write last frag ts
-    HDS_WRITE_8(cur, fc->start_time);
+    HDS_WRITE_8(cur, sink->start_time);
     cur += 8+5;
     *cur = 1; cur++;
 
@@ -373,7 +585,7 @@ static int flush_hds_abst(SegHandler *sh, flv_context_t *fc)
     cur += 5;
     HDS_WRITE_4(cur, 1);
     HDS_WRITE_4(cur, 1);
-    HDS_WRITE_4(cur, fc->hds_frag_count);
+    HDS_WRITE_4(cur, sink->hds_frag_count);
 
     update_box(start_asrt, cur - start_asrt);
 
@@ -396,7 +608,7 @@ static int flush_hds_abst(SegHandler *sh, flv_context_t *fc)
     int32_t frags_count = 0;
     cur += 4;
 
-    frag_info *tmp_p = fc->frag_list;
+    frag_info *tmp_p = sink->frag_list;
     while(tmp_p != NULL) {
         HDS_WRITE_4(cur, tmp_p->index);
         HDS_WRITE_8(cur, tmp_p->start_time);
@@ -424,11 +636,14 @@ static int flush_hds_abst(SegHandler *sh, flv_context_t *fc)
     return 0;
 }
 
-static void update_duration_on_valid(flv_context_t *fc, SegHandler *sh, int *no_seg);
+static void update_duration_on_valid(flv_sink_t *sink, flv_context_t *fc, int *no_seg);
 static void flv_context_clear_packet(flv_context_t *fc);
 static int try_get_interleaved_packet(SegHandler *sh, flv_context_t *fc, int force);
-static void flush_interleaved_packet(SegHandler *sh, srs_flv_t flv, flv_context_t *fc) {
+static void flush_interleaved_packet(SegHandler *sh, flv_context_t *fc, flv_sink_t *sinks, int nb_sinks,
+                                     int playlist_sink) {
     int n_flush = 0;
+    int i;
+    int trace_event;
     logger(LOG_INFO, "do flush interleaved packets on %s", __FUNCTION__);
     while(1) {
         int ret = try_get_interleaved_packet(sh, fc, 1);
@@ -442,46 +657,67 @@ static void flush_interleaved_packet(SegHandler *sh, srs_flv_t flv, flv_context_
 
         n_flush ++;
 
-        update_duration_on_valid(fc, sh, NULL);
+        trace_event = PKT_TRACE_WRITE;
+        for (i = 0; i < nb_sinks; i++) {
+            flv_sink_t *sink = &sinks[i];
+
+            if (sink->dead) {
+                continue;
+            }
+            update_duration_on_valid(sink, fc, NULL);
 
-        // TODO(mt): test on interrupted condition no mem leak;
-        // on no flv, where program is interrupted, do pop but no write.
-        if (flv) {
-            u_int32_t revised_packet_time = fc->curr_pkt.packet_time;
+            // TODO(mt): test on interrupted condition no mem leak;
+            // on no output, where program is interrupted, do pop but no write.
+            if (sink->out) {
+                u_int32_t revised_packet_time = fc->curr_pkt.packet_time;
 
-            if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
-                if (revised_packet_time < fc->start_time) {
-                    // seq_header or metadata
-                    revised_packet_time = 0;
+                if (sink->sh.params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
+                    if (revised_packet_time < sink->start_time) {
+                        // seq_header or metadata
+                        revised_packet_time = 0;
+                    } else {
+                        revised_packet_time = revised_packet_time - sink->start_time;
+                    }
+                }
+                ret = flv_seg_write_tag(sink, fc->curr_pkt.packet_type, revised_packet_time,
+                                        fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size);
+                if (ret != 0) {
+                    logger(LOG_ERROR, "write flv tag fail %d on %s", ret, __FUNCTION__);
+                    sink->sh.flags |= NF_WRITE_ERROR;
+                    metrics_add(&g_metrics.write_errors, 1);
+                    trace_event = PKT_TRACE_FAIL;
                 } else {
-                    revised_packet_time = revised_packet_time - fc->start_time;
+                    latency_on_write(&sink->sh, fc->curr_pkt.arrival_time);
                 }
             }
-            ret = srs_flv_write_tag(flv, fc->curr_pkt.packet_type, revised_packet_time,
-                                    fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size);
-            if (ret != 0) {
-                logger(LOG_ERROR, "write flv tag fail %d on %s", ret, __FUNCTION__);
-                sh->flags |= NF_WRITE_ERROR;
-            }
         }
+        flv_trace_packet(&sinks[playlist_sink].sh, &fc->curr_pkt, trace_event, 0);
         flv_context_clear_packet(fc);
     }
     logger(LOG_INFO, "flush interleaved packets done, n_flush = %d", n_flush);
 }
 
 
-static int flv_seg_file_end(SegHandler *sh, srs_flv_t flv, flv_context_t *fc, int last)
+/**
+ * close current segment of sink and notify it,
+ * end_time is the timestamp where the segment stops.
+ */
+static int flv_seg_file_end(flv_sink_t *sink, u_int32_t end_time, int last)
 {
-    if (last && sh->params.flv_seg_flags & FLV_SEG_FLAGS_INTERLEAVE_PKTS) {
-        flush_interleaved_packet(sh, flv, fc);
-    }
+    SegHandler *sh = &sink->sh;
+    uint64_t stage_start = stage_hist_begin();
 
-    if (flv != NULL) {
+    if (sink->out != NULL) {
         logger(LOG_INFO, "finish segment %s", sh->file);
-        srs_flv_close(flv);
+        if (sh->params.is_native_ts) {
+            srs_ts_close((srs_ts_t)sink->out);
+        } else {
+            srs_flv_close(sink->out);
+        }
+        sink->out = NULL;
 
         if (sh->params.is_hds) {
-            flv = srs_flv_open_overwrite(sh->file);
+            srs_flv_t flv = srs_flv_open_overwrite(sh->file);
             char *value = (char *)HDS_HEADER;
 
             //get size from real file size
@@ -495,21 +731,35 @@ static int flv_seg_file_end(SegHandler *sh, srs_flv_t flv, flv_context_t *fc, in
 
             srs_flv_close(flv);
 
-            hds_update_frag(fc, sh);
+            hds_update_frag(sink, end_time);
 
-            flush_hds_abst(sh, fc);
+            flush_hds_abst(sink);
 
-            fc->hds_frag_count = sh->index;
+            sink->hds_frag_count = sh->index;
         }
 
+        if (sh->input_reconnected) {
+            sh->discontinuity_before = 1;
+            sh->input_reconnected = 0;
+        }
+        // every sink cuts, the metrics are of the playlist one
+        latency_on_publish(&sh->seg_data.latency, sh->params.no_playlist ? NULL : &g_metrics.segment_latency);
+        uint64_t notify_start = stage_hist_begin();
+        int64_t notify_time = av_gettime_relative();
         sh->params.notify(sh, last);
+        stage_hist_end(notify_start, STAGE_NOTIFY, STAGE_STREAM_OTHER);
+        if (!sh->params.no_playlist) {
+            metrics_set(&g_metrics.notify_latency_us, av_gettime_relative() - notify_time);
+            metrics_add(&g_metrics.segments, 1);
+        }
+        sh->discontinuity_before = 0;
 
         // if sequence number sync, the number should be decided by check_align
         if (!sh->params.seq_sync) {
             sh->index++;
         }
+        stage_hist_end(stage_start, STAGE_FILE_END, STAGE_STREAM_OTHER);
     }
-    flv = NULL;
     return 0;
 }
 
@@ -556,9 +806,8 @@ static void flv_packet_unref(flv_referenced_packet *pkt)
         }
         if (pkt->internal->reference == 0) {
             free(pkt->internal);
-            if(pkt->packet_buf) {
-                free(pkt->packet_buf);
-            }
+            // packets are from the payload pool of srs_librtmp
+            srs_rtmp_free_packet(pkt->packet_buf);
         }
     }
     pkt->internal = NULL;
@@ -617,6 +866,7 @@ static void flv_context_update(flv_context_t *fc, SegHandler *sh)
         if (sh->is_base_missing) {
             logger(LOG_WARN, "base stream is back");
             sh->is_base_missing = 0;
+            metrics_set(&g_metrics.base_missing, 0);
         }
     } else {
         sh->nonbase_count ++;
@@ -624,6 +874,7 @@ static void flv_context_update(flv_context_t *fc, SegHandler *sh)
             if (!sh->is_base_missing) {
                 logger(LOG_WARN, "base stream is missing");
                 sh->is_base_missing = 1;
+                metrics_set(&g_metrics.base_missing, 1);
             }
         }
     }
@@ -661,6 +912,43 @@ static void flv_context_update(flv_context_t *fc, SegHandler *sh)
     return ;
 }
 
+// the codecs SrsTsEncoder muxes, h.264 and aac or mp3
+static int native_ts_supports(const flv_referenced_packet *pkt)
+{
+    const uint8_t *buf = (const uint8_t *) pkt->packet_buf;
+
+    if (pkt->packet_size <= 0) {
+        return 1;
+    }
+    if (pkt->packet_type == SRS_RTMP_TYPE_VIDEO) {
+        return (buf[0] & 0x0f) == 7;
+    }
+    if (pkt->packet_type == SRS_RTMP_TYPE_AUDIO) {
+        return (buf[0] >> 4) == 10 || (buf[0] >> 4) == 2;
+    }
+    return 1;
+}
+
+// codec tags of the sequence headers for master playlist
+static void update_rendition_codec(flv_context_t *fc, SegHandler *sh)
+{
+    SegRendition *rendition = &sh->statis.rendition;
+    const uint8_t *buf = (const uint8_t *) fc->curr_pkt.packet_buf;
+    int size = fc->curr_pkt.packet_size;
+
+    if (fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO && size > 5) {
+        // codec id, avc packet type and composition time precede the avcC/hvcC
+        int codec_id = buf[0] & 0x0f;
+        if (codec_id == 7 || codec_id == 12) {
+            seg_codec_tag(codec_id == 7 ? AV_CODEC_ID_H264 : AV_CODEC_ID_HEVC, buf + 5, size - 5,
+                rendition->video_codec, sizeof(rendition->video_codec));
+        }
+    } else if (fc->curr_pkt.packet_type == SRS_RTMP_TYPE_AUDIO && size > 2 && (buf[0] >> 4) == 10) {
+        seg_codec_tag(AV_CODEC_ID_AAC, buf + 2, size - 2,
+            rendition->audio_codec, sizeof(rendition->audio_codec));
+    }
+}
+
 static void update_extradata_on_needed(flv_context_t *fc, SegHandler *sh) {
     if (sh->params.flv_meta) {
         if (srs_rtmp_is_onMetaData(fc->curr_pkt.packet_type, fc->curr_pkt.packet_buf,
@@ -680,6 +968,7 @@ static void update_extradata_on_needed(flv_context_t *fc, SegHandler *sh) {
         if (!old_buf_is_valid || (old_buf_is_valid && (fc->avc_sh_buf.packet_size != fc->curr_pkt.packet_size||
             memcmp(fc->avc_sh_buf.packet_buf, fc->curr_pkt.packet_buf, fc->avc_sh_buf.packet_size)))) {
             logger(LOG_INFO, "update avc sequence header buffer, size:%d", fc->curr_pkt.packet_size);
+            update_rendition_codec(fc, sh);
             if (old_buf_is_valid) {
                 flv_packet_unref(&fc->aac_sh_buf);
             }
@@ -693,6 +982,7 @@ static void update_extradata_on_needed(flv_context_t *fc, SegHandler *sh) {
         if (!old_buf_is_valid || (old_buf_is_valid && (fc->aac_sh_buf.packet_size != fc->curr_pkt.packet_size ||
             memcmp(fc->aac_sh_buf.packet_buf, fc->curr_pkt.packet_buf, fc->aac_sh_buf.packet_size)))) {
             logger(LOG_INFO, "update aac sequence header buffer, size: %d", fc->curr_pkt.packet_size);
+            update_rendition_codec(fc, sh);
 
             if (old_buf_is_valid) {
                 flv_packet_unref(&fc->aac_sh_buf);
@@ -704,23 +994,24 @@ static void update_extradata_on_needed(flv_context_t *fc, SegHandler *sh) {
 
 static int is_flv_avc_seq_end(char type, char *buf, int size);
 // return no_seg to avoid wrong seg point, such as seq header with pts = 0
-static void update_duration_on_valid(flv_context_t *fc, SegHandler *sh, int *no_seg)
+static void update_duration_on_valid(flv_sink_t *sink, flv_context_t *fc, int *no_seg)
 {   
+    SegHandler *sh = &sink->sh;
     int no_upd_duration = 0;
     int is_avc_seq_end = is_flv_avc_seq_end(fc->curr_pkt.packet_type, fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size);
     // duration < 0 underflow cause a new seg
-    if (fc->curr_pkt.packet_time < fc->start_time) {
+    if (fc->curr_pkt.packet_time < sink->start_time) {
         if (fc->curr_pkt.is_seq_header || is_avc_seq_end) {
             logger(LOG_WARN, "no seg for seq %s at dts (%u)  < start(%u)",
                     fc->curr_pkt.is_seq_header? "header" : "end",
-                    fc->curr_pkt.packet_time, fc->start_time);
+                    fc->curr_pkt.packet_time, sink->start_time);
             if (no_seg) {
                 *no_seg = 1;
             }
             no_upd_duration = 1;
         } else {
             if (flv_is_base_stream(fc) || sh->is_base_missing) {
-                logger(LOG_WARN, "pkt dts (%u) < start (%u)", fc->curr_pkt.packet_time, fc->start_time);
+                logger(LOG_WARN, "pkt dts (%u) < start (%u)", fc->curr_pkt.packet_time, sink->start_time);
             }
             no_upd_duration = 1;
         }
@@ -735,7 +1026,10 @@ static void update_duration_on_valid(flv_context_t *fc, SegHandler *sh, int *no_
     }
 
     if (!no_upd_duration) {
-        sh->duration = (fc->curr_pkt.packet_time - fc->start_time) * 1000;
+        sh->duration = (fc->curr_pkt.packet_time - sink->start_time) * 1000;
+        if (!sh->params.no_playlist) {
+            metrics_set(&g_metrics.segment_duration_us, sh->duration);
+        }
     }
 }
 
@@ -776,17 +1070,17 @@ static void flv_context_free(flv_context_t *fc)
     }
 }
 
-static int write_aac_seq_header(SegHandler *sh, srs_flv_t flv, flv_context_t *fc)
+static int write_aac_seq_header(flv_sink_t *sink, flv_context_t *fc)
 {
     int res = 0;
     if (flv_packet_is_valid(&fc->aac_sh_buf)) {
-        if (sh->params.is_hds) {
-            res = srs_flv_write_tag(flv, SRS_RTMP_TYPE_AUDIO, fc->start_time, 
+        if (sink->sh.params.is_hds) {
+            res = srs_flv_write_tag(sink->out, SRS_RTMP_TYPE_AUDIO, sink->start_time, 
                     fc->aac_sh_buf.packet_buf, fc->aac_sh_buf.packet_size);
-        } else if (sh->params.is_rptp) {
+        } else if (sink->sh.params.is_rptp) {
             // do not add aac sh
         } else {
-            res = srs_flv_write_tag(flv, SRS_RTMP_TYPE_AUDIO, 0, 
+            res = flv_seg_write_tag(sink, SRS_RTMP_TYPE_AUDIO, 0, 
                     fc->aac_sh_buf.packet_buf, fc->aac_sh_buf.packet_size);
         }
         if (res != 0) {
@@ -798,17 +1092,17 @@ static int write_aac_seq_header(SegHandler *sh, srs_flv_t flv, flv_context_t *fc
     return EC_OK;
 }
 
-static int write_avc_seq_header(SegHandler *sh, srs_flv_t flv, flv_context_t *fc)
+static int write_avc_seq_header(flv_sink_t *sink, flv_context_t *fc)
 {
     int res = 0;
     if (flv_packet_is_valid(&fc->avc_sh_buf)) {
-        if (sh->params.is_hds) {
-            res = srs_flv_write_tag(flv, SRS_RTMP_TYPE_VIDEO, fc->start_time, 
+        if (sink->sh.params.is_hds) {
+            res = srs_flv_write_tag(sink->out, SRS_RTMP_TYPE_VIDEO, sink->start_time, 
                     fc->avc_sh_buf.packet_buf, fc->avc_sh_buf.packet_size);
-        } else if (sh->params.is_rptp) {
+        } else if (sink->sh.params.is_rptp) {
             // do not add avc sh
         } else {
-            res = srs_flv_write_tag(flv, SRS_RTMP_TYPE_VIDEO, 0, 
+            res = flv_seg_write_tag(sink, SRS_RTMP_TYPE_VIDEO, 0, 
                     fc->avc_sh_buf.packet_buf, fc->avc_sh_buf.packet_size);
         }
         if (res != 0) {
@@ -820,20 +1114,28 @@ static int write_avc_seq_header(SegHandler *sh, srs_flv_t flv, flv_context_t *fc
     return EC_OK;
 }
 
-static int flv_seg_file_init(SegHandler *sh, srs_flv_t flv, flv_context_t *fc)
+/**
+ * write header, metadata and sequence headers of a new segment,
+ * the pending packet in fc is written by the caller.
+ */
+static int flv_seg_file_init(flv_sink_t *sink, flv_context_t *fc)
 {
+    SegHandler *sh = &sink->sh;
+
     logger(LOG_INFO, "start init flv file header");
 
     int res = 0;
 
     if (sh->params.is_hds) {
-        res = srs_hds_write_header(flv, HDS_HEADER);
+        res = srs_hds_write_header(sink->out, HDS_HEADER);
     } else if (sh->params.is_rptp) {
         if (fc->is_first_frame) {
-            res = srs_flv_write_header(flv, FLV_HEADER);
+            res = srs_flv_write_header(sink->out, FLV_HEADER);
         }
+    } else if (sh->params.is_native_ts) {
+        // PAT/PMT is written by muxer before the first frame
     } else {
-        res = srs_flv_write_header(flv, FLV_HEADER);
+        res = srs_flv_write_header(sink->out, FLV_HEADER);
     }
 
     if (res != 0) {
@@ -847,8 +1149,8 @@ static int flv_seg_file_init(SegHandler *sh, srs_flv_t flv, flv_context_t *fc)
     sh->rptp_is_metadata = 0;
     sh->rptp_pts = 0;
 
-    if (flv_packet_is_valid(&fc->metadata_buf)) {
-        res = srs_flv_write_tag(flv, SRS_RTMP_TYPE_SCRIPT, 0, fc->metadata_buf.packet_buf, fc->metadata_buf.packet_size);
+    if (flv_packet_is_valid(&fc->metadata_buf) && !sh->params.is_native_ts) {
+        res = srs_flv_write_tag(sink->out, SRS_RTMP_TYPE_SCRIPT, 0, fc->metadata_buf.packet_buf, fc->metadata_buf.packet_size);
         if (res != 0) {
             logger(LOG_ERROR, "write metadata fail %d", res);
             return EC_OUTPUT_FAIL;
@@ -857,40 +1159,22 @@ static int flv_seg_file_init(SegHandler *sh, srs_flv_t flv, flv_context_t *fc)
     }
 
     // always write avc seq header first to avoid ffmpeg concat bug
-    res = write_avc_seq_header(sh, flv, fc);
+    res = write_avc_seq_header(sink, fc);
     if (res != EC_OK) {
         return res;
     }
 
-    res = write_aac_seq_header(sh, flv, fc);
+    res = write_aac_seq_header(sink, fc);
     if (res != EC_OK) {
         return res;
     }
 
     // should be key frame which is not written in last segment
-    if (flv_packet_is_valid(&fc->curr_pkt)) {
-        u_int32_t revised_packet_time;
-        if (sh->params.is_rptp) {
-            sh->rptp_pts = fc->curr_pkt.packet_time;
-            if (srs_flv_is_keyframe(fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size)) {
-                sh->rptp_is_keyframe = 1;
-            }
-        }
-
-        revised_packet_time = fc->curr_pkt.packet_time;
-        if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
-            // set to zero whatever
-            revised_packet_time = 0;
-        }
-        res = srs_flv_write_tag(flv, fc->curr_pkt.packet_type, revised_packet_time,
-                fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size);
-        if (res != 0) {
-            logger(LOG_ERROR, "write first key frame in init fail %d", res);
-            return EC_OUTPUT_FAIL;
+    if (flv_packet_is_valid(&fc->curr_pkt) && sh->params.is_rptp) {
+        sh->rptp_pts = fc->curr_pkt.packet_time;
+        if (srs_flv_is_keyframe(fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size)) {
+            sh->rptp_is_keyframe = 1;
         }
-        logger(LOG_DEBUG, "write first key frame in init success");
-
-        flv_context_clear_packet(fc);
     }
     return EC_OK;
 }
@@ -898,13 +1182,15 @@ static int flv_seg_file_init(SegHandler *sh, srs_flv_t flv, flv_context_t *fc)
 /**
  * no_seg pervents normal seg, but not for abnormal conditions.
  * return 1 if need cut a new seg
- * @param sh 
+ * @param sink 
  * @param fc 
  * @param no_seg 
  * @return int 
  */
-static int is_seg_need_cut(SegHandler *sh, flv_context_t *fc, int no_seg) 
+static int is_seg_need_cut(flv_sink_t *sink, flv_context_t *fc, int no_seg) 
 {
+    SegHandler *sh = &sink->sh;
+
     // too much frames blocked
     int flv_av_frames_num = sh->seg_data.input_audio_frames + sh->seg_data.input_video_frames;
 
@@ -922,6 +1208,15 @@ static int is_seg_need_cut(SegHandler *sh, flv_context_t *fc, int no_seg)
         return 0;
     }
 
+    // the segment stops where the input reconnected
+    if (sink->reconnected &&
+        ((fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO &&
+          srs_flv_is_keyframe(fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size)) ||
+         !flv_packet_is_valid(&fc->avc_sh_buf) || sh->is_base_missing)) {
+        logger(LOG_INFO, "input reconnected, new seg at %u", fc->curr_pkt.packet_time);
+        return 1;
+    }
+
     int threshold_ms = sh->params.duration * 1000 + sh->params.duration_ms;
 
     if (sh->params.is_rptp) {
@@ -929,15 +1224,15 @@ static int is_seg_need_cut(SegHandler *sh, flv_context_t *fc, int no_seg)
             logger(LOG_INFO, "rptp key frame, new seg.");
             return 1;
         }
-        if (fc->curr_pkt.packet_time - fc->start_time > threshold_ms) {
+        if (fc->curr_pkt.packet_time - sink->start_time > threshold_ms) {
             logger(LOG_INFO, "rptp duration surpasses threshold, new seg. (%u %u vs %d)",
-                    fc->curr_pkt.packet_time, fc->start_time, threshold_ms);
+                    fc->curr_pkt.packet_time, sink->start_time, threshold_ms);
             return 1;
         }
         return 0;
     }
 
-    if (fc->curr_pkt.packet_time - fc->start_time < threshold_ms && !sh->params.align) {
+    if (fc->curr_pkt.packet_time - sink->start_time < threshold_ms && !sh->params.align) {
         return 0;
     }
 
@@ -953,7 +1248,7 @@ static int is_seg_need_cut(SegHandler *sh, flv_context_t *fc, int no_seg)
             }
         } else {
             logger(LOG_INFO, "duration surpasses threshold, new seg. (%u %u vs %d)",
-                    fc->curr_pkt.packet_time, fc->start_time, threshold_ms);
+                    fc->curr_pkt.packet_time, sink->start_time, threshold_ms);
             return 1;
         }
     }
@@ -1012,6 +1307,18 @@ static int parse_metadata(SegHandler *sh, flv_context_t *fc)
         return 1;
     }
 
+    // resolution for master playlist
+    {
+        srs_amf0_t width = is_object ? srs_amf0_object_property(meta_amf, "width") :
+            srs_amf0_ecma_array_property(meta_amf, "width");
+        srs_amf0_t height = is_object ? srs_amf0_object_property(meta_amf, "height") :
+            srs_amf0_ecma_array_property(meta_amf, "height");
+        if (width && height && srs_amf0_is_number(width) && srs_amf0_is_number(height)) {
+            sh->statis.rendition.video_width = (int) srs_amf0_to_number(width);
+            sh->statis.rendition.video_height = (int) srs_amf0_to_number(height);
+        }
+    }
+
     if (sh->params.seq_sync) {
         srs_amf0_t basetime = NULL;
         srs_amf0_t abs_basetime = NULL;
@@ -1066,7 +1373,7 @@ static int parse_metadata(SegHandler *sh, flv_context_t *fc)
     if (do_regen) {
         int meta_amf_len = srs_amf0_size(meta_amf);
         int new_size = amf_offset + meta_amf_len;
-        char *new_buf = malloc(new_size);
+        char *new_buf = srs_rtmp_alloc_packet(new_size);
         srs_amf0_t key;
         int key_len;
         if (!new_buf) {
@@ -1077,14 +1384,14 @@ static int parse_metadata(SegHandler *sh, flv_context_t *fc)
         key = srs_amf0_create_string(script_name);
         if (key == NULL) {
             logger(LOG_ERROR, "%s failed to alloc create amf string, content = %s", script_name);
-            free(new_buf);
+            srs_rtmp_free_packet(new_buf);
             srs_amf0_free(meta_amf);
             return -1;
         }
         key_len = srs_amf0_size(key);
         if (amf_offset != key_len) {
             logger(LOG_ERROR, "unexpected, script name %s len %d != %d", key, key_len, amf_offset);
-            free(new_buf);
+            srs_rtmp_free_packet(new_buf);
             srs_amf0_free(key);
             srs_amf0_free(meta_amf);
             if (force_drop)  return 0;
@@ -1092,7 +1399,7 @@ static int parse_metadata(SegHandler *sh, flv_context_t *fc)
         }
         if(srs_amf0_serialize(key, new_buf, key_len) != 0) {
             logger(LOG_ERROR, "unexpected, script name %s failed to serialize", script_name);
-            free(new_buf);
+            srs_rtmp_free_packet(new_buf);
             srs_amf0_free(key);
             srs_amf0_free(meta_amf);
             if (force_drop)  return 0;
@@ -1101,7 +1408,7 @@ static int parse_metadata(SegHandler *sh, flv_context_t *fc)
         srs_amf0_free(key);
         if(srs_amf0_serialize(meta_amf, new_buf + key_len, meta_amf_len) != 0) {    
             logger(LOG_ERROR, "unexpected, meta amf %s failed to serialize", script_name);
-            free(new_buf);
+            srs_rtmp_free_packet(new_buf);
             srs_amf0_free(key);
             srs_amf0_free(meta_amf);
             if (force_drop)  return 0;
@@ -1111,7 +1418,7 @@ static int parse_metadata(SegHandler *sh, flv_context_t *fc)
         flv_packet_unref(&fc->curr_pkt);
         if (init_flv_empty_packet(&fc->curr_pkt) < 0) {
             logger(LOG_ERROR, "init_flv_empty_packet failed in %s", __FUNCTION__);
-            free(new_buf);
+            srs_rtmp_free_packet(new_buf);
             srs_amf0_free(meta_amf);
             return -1;
         }
@@ -1138,18 +1445,10 @@ static int is_packet_meet(SegHandler *sh, flv_context_t *fc)
     }
     if (fc->curr_pkt.packet_type == SRS_RTMP_TYPE_AUDIO) {
         logger(LOG_DEBUG, "meet audio frame");
-        sh->seg_data.input_audio_frames++;
-        sh->seg_data.output_audio_frames++;
-
-        sh->flags &= ~NF_NO_AUDIO;
         return 1;
     }
     if (fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO) {
         logger(LOG_DEBUG, "meet video frame");
-        sh->seg_data.input_video_frames++;
-        sh->seg_data.output_video_frames++;
-
-        sh->flags &= ~NF_NO_VIDEO;
         return 1;
     }
     return 0;
@@ -1315,15 +1614,123 @@ static int init_flv_context(flv_context_t *fc)
     // set base_stream_type to video, may further support only audio/video flv seg
     fc->base_stream_type = SRS_RTMP_TYPE_VIDEO;
 
-    fc->got_first_content = 0;
     return 0;
 }
 
+/**
+ * shift the packet time by the offset of the input reconnected, the first
+ * frame after reconnect follows the last one, and so do the others.
+ */
+static void flv_context_rebase(flv_context_t *fc)
+{
+    flv_referenced_packet *pkt = &fc->curr_pkt;
+
+    if (fc->rebase) {
+        u_int32_t last = fc->stream_info[STREAM_INFO_IDX_VIDEO].last_dts;
+        if (fc->stream_info[STREAM_INFO_IDX_AUDIO].last_dts > last) {
+            last = fc->stream_info[STREAM_INFO_IDX_AUDIO].last_dts;
+        }
+        // sequence headers and metadata wait for the first frame
+        if (pkt->is_seq_header || pkt->packet_type == SRS_RTMP_TYPE_SCRIPT) {
+            pkt->packet_time = last;
+            return;
+        }
+        fc->time_offset = last + 1 - pkt->packet_time;
+        fc->rebase = 0;
+        logger(LOG_WARN, "input timestamps shift %d ms after reconnect", (int32_t)fc->time_offset);
+    }
+    pkt->packet_time += fc->time_offset;
+}
+
+/**
+ * live input of the flv path, one of the handles is set.
+ */
+typedef struct {
+    RtmpClient *rc;
+    HttpFlv *hf;
+    StandbyInput *si;
+} flv_input_t;
+
+static int flv_input_open(SegHandler *sh, flv_input_t *in)
+{
+    memset(in, 0, sizeof(*in));
+    if (sh->params.backup_url) {
+        in->si = standby_input_open(sh->params.url, sh->params.backup_url, sh->params.failover_ms,
+                                    RTMP_CLIENT_TIMEOUT_MS, &sh->statis.standby);
+    } else if (!strncmp(sh->params.url, "http://", 7)) {
+        in->hf = http_init(sh);
+    } else {
+        in->rc = rtmp_init(sh);
+    }
+    if (in->rc == NULL && in->hf == NULL && in->si == NULL) {
+        return EC_OPEN_FAIL;
+    }
+    return EC_OK;
+}
+
+static int flv_input_is_open(flv_input_t *in)
+{
+    return in->rc != NULL || in->hf != NULL || in->si != NULL;
+}
+
+static int flv_input_read_packet(flv_input_t *in, char *type, u_int32_t *timestamp, char **data, int *size)
+{
+    if (in->si) {
+        return standby_input_read_packet(in->si, type, timestamp, data, size);
+    } else if (in->hf) {
+        return http_flv_read_packet(in->hf, type, timestamp, data, size);
+    }
+    return rtmp_client_read_packet(in->rc, type, timestamp, data, size);
+}
+
+static void flv_input_close(flv_input_t *in)
+{
+    if (in->rc) {
+        rtmp_log_recv_stats(in->rc);
+        rtmp_client_destroy(in->rc);
+        in->rc = NULL;
+    }
+    if (in->hf) {
+        http_flv_close(in->hf);
+        in->hf = NULL;
+    }
+    if (in->si) {
+        standby_input_close(in->si);
+        in->si = NULL;
+    }
+}
+
+/**
+ * reopen the live input with bounded backoff.
+ */
+static int flv_seg_reconnect(SegHandler *sh, flv_input_t *in)
+{
+    int64_t start = av_gettime_relative();
+    int backoff_ms = 0;
+
+    flv_input_close(in);
+    while (seg_reconnect_wait(sh, start, &backoff_ms) == 0) {
+        logger(LOG_WARN, "reconnect input %s", sh->params.url);
+        if (flv_input_open(sh, in) == EC_OK) {
+            sh->statis.reconnects++;
+            logger(LOG_WARN, "input reconnected in %lld ms, %lld times",
+                (av_gettime_relative() - start) / 1000, sh->statis.reconnects);
+            return EC_OK;
+        }
+    }
+    logger(LOG_ERROR, "reconnect input fail in %lld ms", (av_gettime_relative() - start) / 1000);
+    return EC_READ_FAIL;
+}
+
+/**
+ * read packets from the ingest until one is ready for the sinks,
+ * the packet is left in fc->curr_pkt, which is invalid on interrupt.
+ */
 #ifndef NDEBUG
-int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t in_flv, srs_flv_t flv, flv_context_t *fc) 
+static int flv_seg_read_packet(SegHandler *sh, flv_input_t *in, srs_flv_t in_flv, flv_context_t *fc)
 {
 #else
-int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t *fc)
+static int flv_seg_read_packet(SegHandler *sh, flv_input_t *in, flv_context_t *fc)
 {
 #endif // NDEBUG
 #ifdef UNIT_TEST
@@ -1338,28 +1745,11 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
     int res;
     int is_avc_seq_end = 0;
     int no_dts_increase_judge = 0;
-    int no_seg = 0;
-    u_int32_t revised_packet_time;
-
-    if (fc->is_first_frame) {
-        logger(LOG_INFO, "start transvae new segment %d", sh->index);
-    } else {
-        logger(LOG_INFO, "start transvae new segment %d, start_time %u", 
-            sh->index, fc->curr_pkt.packet_time);
-    }
-
-    // in hds mode, packet time may be got by continue_abst
-    fc->start_time = fc->curr_pkt.packet_time;
-
-    res = flv_seg_file_init(sh, flv, fc);
-    if (res != EC_OK) {
-        logger(LOG_ERROR, "init segment file fail %d", res);
-        return res;
-    }
 
     while (1) {
         flv_stream_info_t *stream_info;
         int pkt_popped = 0;
+        uint64_t stage_start = 0;
 
         if (sh->interrupt) {
             return EC_OK;
@@ -1379,11 +1769,12 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
                 logger(LOG_ERROR, "init flv packet failed, out of memory");
                 return EC_MEM;
             }
+            stage_start = stage_hist_begin();
 #ifndef NDEBUG
-            if (r != NULL) {
+            if (flv_input_is_open(in)) {
 #endif // NDEBUG
                 // support pure audio/video seg for input with av input.
-                res = srs_rtmp_read_packet(r, &(fc->curr_pkt.packet_type),
+                res = flv_input_read_packet(in, &(fc->curr_pkt.packet_type),
                                             &(fc->curr_pkt.packet_time),
                                             &(fc->curr_pkt.packet_buf),
                                             &(fc->curr_pkt.packet_size));
@@ -1410,7 +1801,7 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
                     logger(LOG_ERROR, "invalid flv packet size %d", res);
                     return EC_READ_FAIL;
                 }
-                fc->curr_pkt.packet_buf = malloc(fc->curr_pkt.packet_size);
+                fc->curr_pkt.packet_buf = srs_rtmp_alloc_packet(fc->curr_pkt.packet_size);
                 if (!fc->curr_pkt.packet_buf) {
                     logger(LOG_ERROR, "failed to malloc flv packet size %d",
                             fc->curr_pkt.packet_size);
@@ -1427,6 +1818,9 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
                 return EC_READ_FAIL;
             }
 #endif
+            fc->curr_pkt.arrival_time = av_gettime_relative();
+            stage_hist_end(stage_start, STAGE_READ, flv_stage_stream(fc->curr_pkt.packet_type));
+            stage_start = stage_hist_begin();
             logger(LOG_DEBUG, "read one rtmp packet. type:%d ts:%u size:%d",
                     fc->curr_pkt.packet_type, fc->curr_pkt.packet_time,
                     fc->curr_pkt.packet_size);
@@ -1444,11 +1838,13 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
             if (res < 0) {
                 return EC_MEM;
             } if (res == 0) {
+                flv_trace_packet(NULL, &fc->curr_pkt, PKT_TRACE_SKIP, 0);
                 flv_context_clear_packet(fc);
                 continue;
             }
 
             flv_context_update(fc, sh);
+            flv_context_rebase(fc);
 
             stream_info = get_flv_stream_info(fc, fc->curr_pkt.packet_type);
             stream_info->exist = 1;
@@ -1497,26 +1893,6 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
                 }
             }
 
-            if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
-                if (fc->curr_pkt.packet_time < fc->start_time &&
-                    (!fc->curr_pkt.is_seq_header && fc->curr_pkt.packet_type != SRS_RTMP_TYPE_SCRIPT)) {
-                    logger(LOG_WARN, "align dts buf packet time (%u) < start time (%u), "
-                                    "discarded", fc->curr_pkt.packet_time, fc->start_time);
-                    flv_context_clear_packet(fc);
-                    continue;
-                }
-            }
-
-            // TODO: make a better video existence judgement instead of using fc->avc_sh_buf
-            // if no seq head exists, unexpected conditions still happen
-            if (fc->curr_pkt.packet_time < fc->start_time &&
-                ((fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO && !fc->curr_pkt.is_seq_header) ||
-                 (sh->is_base_missing && !flv_packet_is_valid(&fc->avc_sh_buf) && 
-                  fc->curr_pkt.packet_type == SRS_RTMP_TYPE_AUDIO && !fc->curr_pkt.is_seq_header))) {
-                logger(LOG_INFO, "timestamp reverse, %u < %u, exit", fc->curr_pkt.packet_time, fc->start_time);
-                return EC_TS_ERR;
-            }
-
             // cache pkt here
             if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_INTERLEAVE_PKTS) {
                 int ret;
@@ -1526,6 +1902,7 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
                     // no need to clean, all done by flv_context_free
                     return EC_MEM;
                 }
+                flv_trace_packet(NULL, &fc->curr_pkt, PKT_TRACE_CACHE, 0);
 
                 flv_packet_unref(&fc->curr_pkt);
 
@@ -1541,24 +1918,6 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
         }
         update_extradata_on_needed(fc, sh);
 
-        if (!fc->got_first_content) {
-            if (fc->curr_pkt.is_seq_header) {
-                flv_context_clear_packet(fc);
-                continue;
-            } else if (fc->curr_pkt.packet_type != SRS_RTMP_TYPE_SCRIPT) {
-                res = write_avc_seq_header(sh, flv, fc);
-                if (res != EC_OK) {
-                    return res;
-                }
-
-                res = write_aac_seq_header(sh, flv, fc);
-                if (res != EC_OK) {
-                    return res;
-                }
-                fc->got_first_content = 1;
-            }
-        }
-
         if (!(fc->common_flag & FLV_LIVE_COMMON_FLAG_PRINTED_NO_SEQ_HEADER) &&
             fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO &&
             !flv_packet_is_valid(&fc->avc_sh_buf)) {
@@ -1580,65 +1939,288 @@ int flv_seg_transave(SegHandler *sh, srs_rtmp_t r, srs_flv_t flv, flv_context_t
             fc->common_flag |= FLV_LIVE_COMMON_FLAG_PRINTED_AUDIO_CODEC_ID;
         }
 
+        if (sh->params.is_native_ts && !native_ts_supports(&fc->curr_pkt)) {
+            logger(LOG_ERROR, "native ts muxes h.264 with aac or mp3 only, %s codec is %s, run without --native-ts",
+                fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO ? "video" : "audio",
+                fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO ?
+                srs_flv_get_video_codec_name(fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size) :
+                srs_flv_get_audio_codec_name(fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size));
+            return EC_STREAM_ERR;
+        }
+
         // re-get stream info for current output packet
         stream_info = get_flv_stream_info(fc, fc->curr_pkt.packet_type);
         stream_info->exist = 1;
 
-        no_seg = 0;
-        update_duration_on_valid(fc, sh, &no_seg);
+        stage_hist_end(stage_start, STAGE_CHECK, flv_stage_stream(fc->curr_pkt.packet_type));
+        return EC_OK;
+    }
+    return EC_OK;
+}
+
+/**
+ * write the packet in fc->curr_pkt to sink, cut a new segment of
+ * the sink when needed. ingest is the handler reading packets.
+ */
+static int flv_sink_write_packet(flv_sink_t *sink, flv_context_t *fc, SegHandler *ingest)
+{
+    SegHandler *sh = &sink->sh;
+    int res;
+    int no_seg = 0;
+    u_int32_t revised_packet_time;
+
+    // stream states are decided by the ingest
+    sh->is_base_missing = ingest->is_base_missing;
+    sh->cycle_base_time = ingest->cycle_base_time;
+    if (fc->curr_pkt.is_seq_header || fc->curr_pkt.packet_type == SRS_RTMP_TYPE_SCRIPT) {
+        sh->statis.rendition = ingest->statis.rendition;
+    }
 
-        if (is_seg_need_cut(sh, fc, no_seg)) {
+    if (!fc->is_first_frame && !sink->met_first_frame) {
+        sink->start_time = fc->start_time;
+        sink->met_first_frame = 1;
+    }
+
+    if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
+        if (fc->curr_pkt.packet_time < sink->start_time &&
+            (!fc->curr_pkt.is_seq_header && fc->curr_pkt.packet_type != SRS_RTMP_TYPE_SCRIPT)) {
+            logger(LOG_WARN, "align dts buf packet time (%u) < start time (%u), "
+                            "discarded", fc->curr_pkt.packet_time, sink->start_time);
             return EC_OK;
         }
+    }
 
-        revised_packet_time = fc->curr_pkt.packet_time;
-        if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
-            if (fc->is_first_frame) {
-                // start_time may not be set, here just set revised_packet_time to 0
-                // such as sequence header with large dts
-                revised_packet_time = 0;
-            } else if (revised_packet_time < fc->start_time) {
-                // seq_header or metadata
-                revised_packet_time = 0;
-            } else {
-                revised_packet_time = revised_packet_time - fc->start_time;
+    // TODO: make a better video existence judgement instead of using fc->avc_sh_buf
+    // if no seq head exists, unexpected conditions still happen
+    if (fc->curr_pkt.packet_time < sink->start_time &&
+        ((fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO && !fc->curr_pkt.is_seq_header) ||
+         (sh->is_base_missing && !flv_packet_is_valid(&fc->avc_sh_buf) && 
+          fc->curr_pkt.packet_type == SRS_RTMP_TYPE_AUDIO && !fc->curr_pkt.is_seq_header))) {
+        logger(LOG_INFO, "timestamp reverse, %u < %u, exit", fc->curr_pkt.packet_time, sink->start_time);
+        return EC_TS_ERR;
+    }
+
+    if (!sink->got_first_content) {
+        if (fc->curr_pkt.is_seq_header) {
+            return EC_OK;
+        } else if (fc->curr_pkt.packet_type != SRS_RTMP_TYPE_SCRIPT) {
+            res = write_avc_seq_header(sink, fc);
+            if (res != EC_OK) {
+                return res;
+            }
+
+            res = write_aac_seq_header(sink, fc);
+            if (res != EC_OK) {
+                return res;
             }
-            logger(LOG_DEBUG, "change ts from %u to %u (st = %u)",
-                                fc->curr_pkt.packet_time, revised_packet_time,
-                                fc->start_time);
+            sink->got_first_content = 1;
         }
-        res = srs_flv_write_tag(flv, fc->curr_pkt.packet_type, revised_packet_time,
-                fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size);
-        if (res != 0) {
-            logger(LOG_ERROR, "write flv tag fail %d", res);
-            sh->flags |= NF_WRITE_ERROR;
-            return EC_OUTPUT_FAIL;
+    }
+
+    update_duration_on_valid(sink, fc, &no_seg);
+
+    if (is_seg_need_cut(sink, fc, no_seg)) {
+        flv_seg_file_end(sink, fc->curr_pkt.packet_time, 0);
+
+        res = flv_seg_file_begin(sink);
+        if (res != EC_OK) {
+            return res;
+        }
+
+        logger(LOG_INFO, "start transave new segment %d, start_time %u", 
+            sh->index, fc->curr_pkt.packet_time);
+        sink->start_time = fc->curr_pkt.packet_time;
+        if (sink->reconnected) {
+            sink->reconnected = 0;
+            sh->input_reconnected = 1;
+        }
+
+        res = flv_seg_file_init(sink, fc);
+        if (res != EC_OK) {
+            logger(LOG_ERROR, "init segment file fail %d", res);
+            return res;
         }
-        flv_context_clear_packet(fc);
+    }
+
+    latency_on_write(sh, fc->curr_pkt.arrival_time);
+    if (fc->curr_pkt.packet_type == SRS_RTMP_TYPE_AUDIO) {
+        sh->seg_data.input_audio_frames++;
+        sh->seg_data.output_audio_frames++;
+
+        sh->flags &= ~NF_NO_AUDIO;
+    } else if (fc->curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO) {
+        sh->seg_data.input_video_frames++;
+        sh->seg_data.output_video_frames++;
+
+        sh->flags &= ~NF_NO_VIDEO;
+    }
+
+    revised_packet_time = fc->curr_pkt.packet_time;
+    if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_ALIGN_DTS) {
+        if (fc->is_first_frame) {
+            // start_time may not be set, here just set revised_packet_time to 0
+            // such as sequence header with large dts
+            revised_packet_time = 0;
+        } else if (revised_packet_time < sink->start_time) {
+            // seq_header or metadata
+            revised_packet_time = 0;
+        } else {
+            revised_packet_time = revised_packet_time - sink->start_time;
+        }
+        logger(LOG_DEBUG, "change ts from %u to %u (st = %u)",
+                            fc->curr_pkt.packet_time, revised_packet_time,
+                            sink->start_time);
+    }
+    res = flv_seg_write_tag(sink, fc->curr_pkt.packet_type, revised_packet_time,
+            fc->curr_pkt.packet_buf, fc->curr_pkt.packet_size);
+    if (res != 0) {
+        logger(LOG_ERROR, "write flv tag fail %d", res);
+        sh->flags |= NF_WRITE_ERROR;
+        metrics_add(&g_metrics.write_errors, 1);
+        return EC_OUTPUT_FAIL;
     }
     return EC_OK;
 }
 
-int flv_seg_run(SegHandler *sh)
+/**
+ * setup a sink of type from the ingest handler sh.
+ */
+static int flv_sink_init(flv_sink_t *sink, SegHandler *sh, int type)
 {
     int now_s;
+
+    memset(sink, 0, sizeof(*sink));
+    sink->type = type;
+    sink->sh = *sh;
+    sink->sh.params.is_flv = (type == FLV_SINK_FLV);
+    sink->sh.params.is_hds = (type == FLV_SINK_HDS);
+    sink->sh.params.is_rptp = (type == FLV_SINK_RPTP);
+    sink->sh.params.is_native_ts = (type == FLV_SINK_TS);
+
+    if (sink->sh.params.is_hds) {
+        // hds frag start with 1, not 0
+        sink->sh.index = 1;
+        if (sink->sh.params.start_number != 0) {
+            sink->sh.index = sink->sh.params.start_number;
+        }
+
+        sink->hds_frag_count = sink->sh.index - 1;
+    }
+
+    if (sink->sh.params.seq_sync) {
+        now_s = time((time_t *)NULL);
+        sink->sh.index = now_s / sink->sh.params.duration;
+        sink->hds_frag_count = sink->sh.index;
+    }
+
+    if (sink->sh.params.is_hds) {
+        if (sink->sh.params.continue_abst != NULL) {
+            if (parse_abst(sink, sink->sh.params.continue_abst) != 0) {
+                return EC_OPEN_FAIL;
+            }
+        }
+    }
+    return EC_OK;
+}
+
+static void flv_sink_free(flv_sink_t *sink)
+{
+    frag_info *p = sink->frag_list;
+    while (p != NULL) {
+        frag_info *next = p->next;
+        free(p);
+        p = next;
+    }
+    sink->frag_list = NULL;
+}
+
+static void flv_sinks_free(flv_sink_t *sinks, int nb_sinks)
+{
+    int i;
+
+    for (i = 0; i < nb_sinks; i++) {
+        flv_sink_free(&sinks[i]);
+    }
+}
+
+/**
+ * stop sink on an output error res, its segment is ended as the last.
+ * return the sinks still alive.
+ */
+static int flv_sink_fail(flv_sink_t *sinks, int nb_sinks, int i, u_int32_t end_time, int res)
+{
+    flv_sink_t *sink = &sinks[i];
+    int alive = 0;
+
+    logger(LOG_ERROR, "sink %d of %s fail %d, stop it", sink->type, sink->sh.file, res);
+    sink->sh.flags |= NF_WRITE_ERROR;
+    flv_seg_file_end(sink, end_time, 1);
+    sink->dead = 1;
+    for (i = 0; i < nb_sinks; i++) {
+        alive += !sinks[i].dead;
+    }
+    return alive;
+}
+
+int flv_seg_run(SegHandler *sh)
+{
     int ret = EC_OK;
+    int is_frame;
+    int trace_index;
+    int trace_event;
+    int trace_flags;
+    int i;
 
-    srs_rtmp_t r = NULL;
+    flv_input_t in = {0};
 #ifndef NDEBUG
     srs_flv_t in_flv = NULL;
 #endif // NDEBUG
 
+    flv_sink_t sinks[FLV_MAX_SINKS];
+    int nb_sinks = 0;
+    int nb_alive;
+    int playlist_sink = 0;
+    int res;
+
+    // every requested format is one sink of the same ingest
+    if (sh->params.is_flv) {
+        ret = flv_sink_init(&sinks[nb_sinks++], sh, FLV_SINK_FLV);
+    }
+    if (ret == EC_OK && sh->params.is_hds) {
+        ret = flv_sink_init(&sinks[nb_sinks++], sh, FLV_SINK_HDS);
+    }
+    if (ret == EC_OK && sh->params.is_rptp) {
+        ret = flv_sink_init(&sinks[nb_sinks++], sh, FLV_SINK_RPTP);
+    }
+    if (ret == EC_OK && sh->params.is_native_ts) {
+        playlist_sink = nb_sinks;
+        ret = flv_sink_init(&sinks[nb_sinks++], sh, FLV_SINK_TS);
+    }
+    if (ret == EC_OK && nb_sinks == 0) {
+        ret = flv_sink_init(&sinks[nb_sinks++], sh, FLV_SINK_FLV);
+    }
+    if (ret != EC_OK) {
+        flv_sinks_free(sinks, nb_sinks);
+        return ret;
+    }
+    nb_alive = nb_sinks;
+
+    // only one sink feeds the playlist, ts is preferred
+    for (i = 0; i < nb_sinks; i++) {
+        sinks[i].sh.params.no_playlist = (i != playlist_sink);
+    }
+    logger(LOG_INFO, "flv seg run with %d sinks", nb_sinks);
+    sh->statis.start_time = av_gettime();
+
     // SetSrsInterruptInfo((SrsInterruptCall) interrupt_callback, (SrsInterruptContext)s);
 
 #ifndef NDEBUG
-    if (sh->params.url && !strncmp(sh->params.url, "rtmp://", 7)) {
-        logger(LOG_WARN, "use rtmp version");
+    if (sh->params.url && (!strncmp(sh->params.url, "rtmp://", 7) || !strncmp(sh->params.url, "http://", 7))) {
+        logger(LOG_WARN, "use %s version", strncmp(sh->params.url, "http://", 7) ? "rtmp" : "http-flv");
 #endif // NDEBUG
-        // TODO: support interrupt on handshake
-        r = rtmp_init(sh->params.url);
-        if (r == NULL) {
-            logger(LOG_ERROR, "create rtmp handle fail");
+        if (flv_input_open(sh, &in) != EC_OK) {
+            logger(LOG_ERROR, "create input handle fail");
+            flv_sinks_free(sinks, nb_sinks);
             return EC_OPEN_FAIL;
         }
 #ifndef NDEBUG
@@ -1648,63 +2230,64 @@ int flv_seg_run(SegHandler *sh)
         in_flv = srs_flv_open_read(sh->params.url);
         if (!in_flv) {
             logger(LOG_ERROR, "create flv handle fail");
+            flv_sinks_free(sinks, nb_sinks);
             return EC_OPEN_FAIL;
         }
         ret = srs_flv_read_header(in_flv, flv_header);
         if (ret != 0) {
             logger(LOG_ERROR, "failed to read flv header");
+            srs_flv_close(in_flv);
+            flv_sinks_free(sinks, nb_sinks);
             return EC_OPEN_FAIL;
         }
     }
 #endif // NDEBUG
 
     logger(LOG_INFO, "create rtmp connect success");
+    sh->statis.connected_time = av_gettime();
 
     flv_context_t fc;
-    srs_flv_t flv = NULL;
 
     ret = init_flv_context(&fc);
     if (ret < 0) {
         logger(LOG_ERROR, "fail to init flv context");
+        flv_input_close(&in);
+#ifndef NDEBUG
+        if (in_flv)
+            srs_flv_close(in_flv);
+#endif
+        flv_sinks_free(sinks, nb_sinks);
         return EC_MEM;
     }
 
-    if (sh->params.is_hds) {
-        // hds frag start with 1, not 0
-        sh->index = 1;
-        if (sh->params.start_number != 0) {
-            sh->index = sh->params.start_number;
-        }
-
-        fc.hds_frag_count = sh->index - 1;
-    }
-
-    if (sh->params.seq_sync) {
-        now_s = time((time_t *)NULL);
-        sh->index = now_s / sh->params.duration;
-        fc.hds_frag_count = sh->index;
-    }
-
-    if (sh->params.is_hds) {
-        if (sh->params.continue_abst != NULL) {
-            ret = parse_abst(sh, &fc, sh->params.continue_abst);
-            if (ret != 0) {
-                return EC_OPEN_FAIL;
-            }
+    for (i = 0; i < nb_sinks; i++) {
+        ret = flv_seg_file_begin(&sinks[i]);
+        if (ret == EC_OK) {
+            ret = flv_seg_file_init(&sinks[i], &fc);
         }
-    }
-
-    while(1) {
-        ret = flv_seg_file_begin(sh, &flv, &fc);
         if (ret != EC_OK) {
-            break;
+            nb_alive = flv_sink_fail(sinks, nb_sinks, i, 0, ret);
         }
+    }
+    ret = nb_alive > 0 ? EC_OK : EC_OUTPUT_FAIL;
 
+    while (ret == EC_OK) {
 #ifndef NDEBUG
-        ret = flv_seg_transave(sh, r, in_flv, flv, &fc);
+        ret = flv_seg_read_packet(sh, &in, in_flv, &fc);
 #else
-        ret = flv_seg_transave(sh, r, flv, &fc);
+        ret = flv_seg_read_packet(sh, &in, &fc);
 #endif // NDEBUG
+        if (ret == EC_READ_FAIL && flv_input_is_open(&in) && sh->params.reconnect_ms > 0 && !sh->interrupt) {
+            flv_context_clear_packet(&fc);
+            ret = flv_seg_reconnect(sh, &in);
+            if (ret == EC_OK) {
+                fc.rebase = 1;
+                for (i = 0; i < nb_sinks; i++) {
+                    sinks[i].reconnected = 1;
+                }
+                continue;
+            }
+        }
         if (ret != EC_OK) {
             break;
         }
@@ -1714,19 +2297,69 @@ int flv_seg_run(SegHandler *sh)
             break;
         }
 
-        flv_seg_file_end(sh, flv, &fc, 0);
+        // sequence headers and metadata are not frames
+        is_frame = !fc.curr_pkt.is_seq_header && fc.curr_pkt.packet_type != SRS_RTMP_TYPE_SCRIPT;
+        if (is_frame) {
+            statis_on_input(sh, fc.curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO,
+                fc.curr_pkt.packet_size, (int64_t)fc.curr_pkt.packet_time * 1000,
+                fc.curr_pkt.packet_type == SRS_RTMP_TYPE_VIDEO &&
+                srs_flv_is_keyframe(fc.curr_pkt.packet_buf, fc.curr_pkt.packet_size));
+        }
+
+        trace_event = PKT_TRACE_WRITE;
+        trace_flags = 0;
+        for (i = 0; i < nb_sinks && ret == EC_OK; i++) {
+            if (sinks[i].dead) {
+                continue;
+            }
+            trace_index = sinks[i].sh.index;
+            res = flv_sink_write_packet(&sinks[i], &fc, sh);
+            // the tag is traced once, cut if any sink cut before it
+            if (sinks[i].sh.index != trace_index) {
+                trace_flags |= PKT_TRACE_FLAG_CUT;
+            }
+            if (res != EC_OK) {
+                trace_event = PKT_TRACE_FAIL;
+            }
+            // a bad input stops all, an output error only the sink
+            if (res == EC_TS_ERR || res == EC_MEM) {
+                ret = res;
+            } else if (res != EC_OK) {
+                nb_alive = flv_sink_fail(sinks, nb_sinks, i, fc.curr_pkt.packet_time, res);
+                if (nb_alive == 0) {
+                    ret = EC_OUTPUT_FAIL;
+                }
+            }
+        }
+        if (ret == EC_OK && is_frame) {
+            statis_on_frame_output(sh);
+        }
+        flv_trace_packet(&sinks[playlist_sink].sh, &fc.curr_pkt, trace_event, trace_flags);
+        flv_context_clear_packet(&fc);
+
+        if (sh->params.timer) {
+            sh->params.timer(sh);
+        }
     }
 
-    flv_seg_file_end(sh, flv, &fc, 1);
+    if (sh->params.flv_seg_flags & FLV_SEG_FLAGS_INTERLEAVE_PKTS) {
+        flush_interleaved_packet(sh, &fc, sinks, nb_sinks, playlist_sink);
+    }
+
+    for (i = 0; i < nb_sinks; i++) {
+        if (!sinks[i].dead) {
+            flv_seg_file_end(&sinks[i], fc.curr_pkt.packet_time, 1);
+        }
+        flv_sink_free(&sinks[i]);
+    }
 
     flv_context_free(&fc);
 
-    if (r)
-        srs_rtmp_destroy(r);
+    flv_input_close(&in);
 #ifndef NDEBUG
     if (in_flv)
         srs_flv_close(in_flv);
 #endif
 
     return ret;
-}
\ No newline at end of file
+}
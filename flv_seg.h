@@ -22,6 +22,8 @@ typedef struct flv_referenced_packet {
     int packet_size;
     char packet_type;
     u_int32_t packet_time;
+    // monotonic time in us it was read
+    int64_t arrival_time;
 
     int is_seq_header;
 } flv_referenced_packet;
@@ -85,6 +87,7 @@ typedef struct flv_stream_info_t {
 #define STREAM_INFO_TOTAL_NUM (3)
 
 typedef struct {
+    // timestamp of the first valid frame
     u_int32_t start_time;
     u_int32_t init_time;
 
@@ -98,19 +101,50 @@ typedef struct {
 
     flv_referenced_packet curr_pkt;
 
-    int hds_frag_count;
-    frag_info *frag_list;
-
     char base_stream_type;
 
     int common_flag;
 
-    int got_first_content;
-
     flv_interleaved_packet *interleave_buffer;
     flv_interleaved_packet *interleave_buffer_end;
+
+    // added to packet time, so the timeline continues across reconnects
+    u_int32_t time_offset;
+    // time_offset is set by the next frame
+    int rebase;
 } flv_context_t;
 
+#define FLV_SINK_FLV (0)
+#define FLV_SINK_HDS (1)
+#define FLV_SINK_RPTP (2)
+#define FLV_SINK_TS (3)
+
+#define FLV_MAX_SINKS (4)
+
+/**
+ * one output format of the ingest, all sinks share the packets read by
+ * flv_context_t, but cut and notify their segments independently.
+ */
+typedef struct {
+    int type;
+    // segment state and notify of this sink, params copied from the ingest
+    SegHandler sh;
+    srs_flv_t out;
+
+    // start timestamp of current segment
+    u_int32_t start_time;
+    // start_time is set, by the first frame or a continued abst
+    int met_first_frame;
+    int got_first_content;
+    // the input reconnected, cut at the next keyframe
+    int reconnected;
+    // an output error stopped the sink, the others of the ingest go on
+    int dead;
+
+    int hds_frag_count;
+    frag_info *frag_list;
+} flv_sink_t;
+
 int flv_seg_run(SegHandler *sh);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,394 @@
+#include "hls_server.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef struct {
+    char *data;
+    int size;
+    int capacity;
+    // delta playlist, empty if it would equal the full one
+    char *delta;
+    int delta_size;
+    int delta_capacity;
+    // media sequence number of the open segment
+    int msn;
+    int nb_parts;
+    int target_duration;
+} HlsPlaylist;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static HlsPlaylist g_playlist;
+static int g_closing = 0;
+static int g_conns = 0;
+
+static int g_listen_fd = -1;
+static pthread_t g_accept_thread;
+
+static int hls_send_all(int fd, const char *buf, int size)
+{
+    int pos = 0;
+    while (pos < size) {
+        ssize_t n = send(fd, buf + pos, size - pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+static void hls_send_status(int fd, int code, const char *reason)
+{
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n", code, reason);
+    hls_send_all(fd, buf, n);
+}
+
+// return NULL if the query key is absent
+static const char *hls_query_value(const char *query, const char *key)
+{
+    int len = strlen(key);
+    const char *p = query;
+
+    while (p && *p) {
+        if (!strncmp(p, key, len) && p[len] == '=') {
+            return p + len + 1;
+        }
+        p = strchr(p, '&');
+        if (p) {
+            p++;
+        }
+    }
+    return NULL;
+}
+
+// return -1 if the query key is absent
+static int hls_query_int(const char *query, const char *key)
+{
+    const char *value = hls_query_value(query, key);
+    return value ? atoi(value) : -1;
+}
+
+// _HLS_skip=YES, or v2 which asks to skip date ranges as well
+static int hls_query_skip(const char *query)
+{
+    const char *value = hls_query_value(query, "_HLS_skip");
+    return value && (!strncmp(value, "YES", 3) || !strncmp(value, "v2", 2));
+}
+
+// copy buffers of iov to a playlist buffer, growing it if needed
+static int hls_copy_iov(char **data, int *capacity, const struct iovec *iov, int iovcnt)
+{
+    int size = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    if (size > *capacity) {
+        char *p = realloc(*data, size);
+        if (!p) {
+            logger(LOG_ERROR, "alloc hls server playlist %d failed", size);
+            return -1;
+        }
+        *data = p;
+        *capacity = size;
+    }
+
+    size = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(*data + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+// the requested part is in the playlist, or nothing was asked
+static int hls_playlist_ready(int msn, int part)
+{
+    if (g_playlist.size == 0) {
+        return 0;
+    }
+    if (msn < 0 || g_playlist.msn > msn) {
+        return 1;
+    }
+    return g_playlist.msn == msn && part >= 0 && g_playlist.nb_parts > part;
+}
+
+static void hls_serve_playlist(int fd, int msn, int part, int skip)
+{
+    struct timespec deadline;
+    struct timeval now;
+    char header[256];
+    char *body = NULL;
+    int size = 0;
+    int n;
+    int ret = 0;
+
+    pthread_mutex_lock(&g_lock);
+
+    // hold at most three target durations, as ll-hls requires
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + (g_playlist.target_duration > 0 ? g_playlist.target_duration * 3 : 10);
+    deadline.tv_nsec = now.tv_usec * 1000;
+
+    if (msn >= 0 && g_playlist.size > 0 && msn > g_playlist.msn + 2) {
+        // too far in the future
+        pthread_mutex_unlock(&g_lock);
+        hls_send_status(fd, 400, "Bad Request");
+        return;
+    }
+
+    while (!g_closing && !hls_playlist_ready(msn, part) && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&g_cond, &g_lock, &deadline);
+    }
+
+    if (!g_closing && hls_playlist_ready(msn, part)) {
+        const char *data = g_playlist.data;
+        size = g_playlist.size;
+        if (skip && g_playlist.delta_size > 0) {
+            data = g_playlist.delta;
+            size = g_playlist.delta_size;
+        }
+        body = malloc(size);
+        if (body) {
+            memcpy(body, data, size);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    if (!body) {
+        hls_send_status(fd, 503, "Service Unavailable");
+        return;
+    }
+
+    n = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/vnd.apple.mpegurl\r\n"
+        "Content-Length: %d\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n\r\n", size);
+    if (hls_send_all(fd, header, n) == 0) {
+        hls_send_all(fd, body, size);
+    }
+    free(body);
+}
+
+static void *hls_connection_thread(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char req[HLS_SERVER_REQUEST_SIZE];
+    int size = 0;
+    char *path;
+    char *query;
+    char *end;
+
+    // read request header, body is not expected
+    while (size < (int)sizeof(req) - 1) {
+        ssize_t n = recv(fd, req + size, sizeof(req) - 1 - size, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        size += n;
+        req[size] = '\0';
+        if (strstr(req, "\r\n\r\n")) {
+            break;
+        }
+    }
+    req[size] = '\0';
+
+    if (strncmp(req, "GET ", 4)) {
+        hls_send_status(fd, size > 0 ? 405 : 400, size > 0 ? "Method Not Allowed" : "Bad Request");
+        goto done;
+    }
+
+    path = req + 4;
+    end = strchr(path, ' ');
+    if (!end) {
+        hls_send_status(fd, 400, "Bad Request");
+        goto done;
+    }
+    *end = '\0';
+
+    query = strchr(path, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+
+    // only the live playlist is served, segments are left to the file server
+    if (strlen(path) < 5 || strcmp(path + strlen(path) - 5, ".m3u8")) {
+        hls_send_status(fd, 404, "Not Found");
+        goto done;
+    }
+
+    int msn = query ? hls_query_int(query, "_HLS_msn") : -1;
+    int part = query ? hls_query_int(query, "_HLS_part") : -1;
+    if (part >= 0 && msn < 0) {
+        hls_send_status(fd, 400, "Bad Request");
+        goto done;
+    }
+    hls_serve_playlist(fd, msn, part, query && hls_query_skip(query));
+
+done:
+    close(fd);
+    pthread_mutex_lock(&g_lock);
+    g_conns--;
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static void *hls_accept_thread(void *arg)
+{
+    while (1) {
+        int fd = accept(g_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // closed by hls_server_stop
+            break;
+        }
+
+        struct timeval tv = {HLS_SERVER_RECV_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        pthread_mutex_lock(&g_lock);
+        if (g_closing || g_conns >= HLS_SERVER_MAX_CONNS) {
+            pthread_mutex_unlock(&g_lock);
+            hls_send_status(fd, 503, "Service Unavailable");
+            close(fd);
+            continue;
+        }
+        g_conns++;
+        pthread_mutex_unlock(&g_lock);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, hls_connection_thread, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            pthread_mutex_lock(&g_lock);
+            g_conns--;
+            pthread_mutex_unlock(&g_lock);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+int hls_server_start(const char *listen_addr)
+{
+    struct sockaddr_in addr;
+    const char *colon = strrchr(listen_addr, ':');
+    int port = atoi(colon ? colon + 1 : listen_addr);
+    int on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (colon) {
+        char host[64];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - listen_addr), listen_addr);
+        if (host[0] && inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+            logger(LOG_ERROR, "invalid hls server address %s", listen_addr);
+            return -1;
+        }
+    }
+    if (port <= 0 || port > 65535) {
+        logger(LOG_ERROR, "invalid hls server port %s", listen_addr);
+        return -1;
+    }
+
+    g_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (g_listen_fd < 0) {
+        logger(LOG_ERROR, "create hls server socket fail, errno %d", errno);
+        return -1;
+    }
+    setsockopt(g_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(g_listen_fd, 128) < 0) {
+        logger(LOG_ERROR, "listen hls server %s fail, errno %d", listen_addr, errno);
+        close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&g_accept_thread, NULL, hls_accept_thread, NULL) != 0) {
+        logger(LOG_ERROR, "create hls server thread fail");
+        close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+
+    logger(LOG_INFO, "hls server listen on %s", listen_addr);
+    return 0;
+}
+
+void hls_server_stop()
+{
+    if (g_listen_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    g_closing = 1;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+
+    shutdown(g_listen_fd, SHUT_RDWR);
+    close(g_listen_fd);
+    pthread_join(g_accept_thread, NULL);
+    g_listen_fd = -1;
+    // the playlist is kept, detached connections may still copy it
+}
+
+void hls_server_publish(const M3U8Update *update)
+{
+    int size;
+    int delta_size = 0;
+
+    pthread_mutex_lock(&g_lock);
+    size = hls_copy_iov(&g_playlist.data, &g_playlist.capacity, update->iov, update->iovcnt);
+    if (size < 0) {
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+    if (update->delta_iov) {
+        delta_size = hls_copy_iov(&g_playlist.delta, &g_playlist.delta_capacity,
+            update->delta_iov, update->delta_iovcnt);
+    }
+
+    g_playlist.size = size;
+    // full playlist is served when the delta could not be copied
+    g_playlist.delta_size = delta_size > 0 ? delta_size : 0;
+    g_playlist.msn = update->msn;
+    g_playlist.nb_parts = update->nb_parts;
+    g_playlist.target_duration = update->target_duration;
+
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+}
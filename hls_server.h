@@ -0,0 +1,26 @@
+#ifndef HLS_SERVER_H_
+#define HLS_SERVER_H_
+
+#include "m3u8.h"
+
+// parked playlist requests at most
+#define HLS_SERVER_MAX_CONNS 512
+#define HLS_SERVER_REQUEST_SIZE 4096
+// seconds to receive the request
+#define HLS_SERVER_RECV_TIMEOUT 5
+
+/**
+ * start serving the live playlist on listen_addr, "[addr:]port".
+ * requests with _HLS_msn/_HLS_part are held until the part is published.
+ */
+int hls_server_start(const char *listen_addr);
+
+void hls_server_stop();
+
+/**
+ * publish a new version of the live playlist and wake the requests
+ * waiting for it. the delta form is served to _HLS_skip=YES requests.
+ */
+void hls_server_publish(const M3U8Update *update);
+
+#endif
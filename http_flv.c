@@ -0,0 +1,565 @@
+#include "http_flv.h"
+#include "srs_librtmp.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define HTTP_DEFAULT_PORT 80
+#define HTTP_MAX_LINE 4096
+#define FLV_HEADER_SIZE 9
+#define FLV_TAG_HEADER_SIZE 11
+
+struct HttpFlv {
+    int fd;
+    char host[256];
+    int port;
+    char path[2048];
+    // address of host, resolved when empty
+    char ip[64];
+    HttpFlvStartup startup;
+    int timeout_ms;
+    // set while opening, the waits are sliced to check it
+    HttpFlvInterruptCallback interrupt;
+    void *opaque;
+
+    // body is in chunked transfer encoding
+    int chunked;
+    // bytes left of current chunk
+    int64_t chunk_left;
+
+    char buf[HTTP_FLV_BUFFER_SIZE];
+    int pos;
+    int end;
+};
+
+static int64_t http_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int http_flv_parse_url(HttpFlv *h, const char *url)
+{
+    const char *host;
+    const char *path;
+    const char *colon;
+
+    if (strncmp(url, "http://", 7)) {
+        logger(LOG_ERROR, "invalid http url %s", url);
+        return -1;
+    }
+    host = url + 7;
+    path = strchr(host, '/');
+    if (!path) {
+        path = host + strlen(host);
+    }
+    colon = memchr(host, ':', path - host);
+    if ((colon ? colon : path) - host >= (int)sizeof(h->host)) {
+        logger(LOG_ERROR, "too long host of http url %s", url);
+        return -1;
+    }
+    snprintf(h->host, sizeof(h->host), "%.*s", (int)((colon ? colon : path) - host), host);
+    h->port = colon ? atoi(colon + 1) : HTTP_DEFAULT_PORT;
+    snprintf(h->path, sizeof(h->path), "%s", *path ? path : "/");
+    return 0;
+}
+
+/**
+ * wait for events of the connection in slices of HTTP_FLV_INTERRUPT_MS,
+ * return -1 on interrupt or timeout.
+ */
+static int http_flv_wait(HttpFlv *h, short events)
+{
+    int waited = 0;
+
+    while (1) {
+        struct pollfd pfd;
+        int n;
+
+        if (h->interrupt && h->interrupt(h->opaque)) {
+            logger(LOG_WARN, "http-flv %s interrupted", h->host);
+            return -1;
+        }
+        pfd.fd = h->fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        n = poll(&pfd, 1, HTTP_FLV_INTERRUPT_MS);
+        if (n > 0) {
+            return 0;
+        }
+        if (n < 0 && errno != EINTR) {
+            logger(LOG_ERROR, "poll http-flv failed, errno %d", errno);
+            return -1;
+        }
+        waited += HTTP_FLV_INTERRUPT_MS;
+        if (waited >= h->timeout_ms) {
+            logger(LOG_ERROR, "http-flv %s timeout", h->host);
+            return -1;
+        }
+    }
+}
+
+static int http_flv_connect(HttpFlv *h, int timeout_ms)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    struct timeval tv;
+    char port[16];
+    int on = 1;
+    int64_t t;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (h->ip[0]) {
+        hints.ai_flags = AI_NUMERICHOST;
+    }
+    snprintf(port, sizeof(port), "%d", h->port);
+    t = http_now_us();
+    ret = getaddrinfo(h->ip[0] ? h->ip : h->host, port, &hints, &res);
+    if (ret != 0 || !res) {
+        logger(LOG_ERROR, "resolve http host %s failed, %s", h->host, gai_strerror(ret));
+        return -1;
+    }
+    h->startup.dns_us += http_now_us() - t;
+    inet_ntop(AF_INET, &((struct sockaddr_in *)res->ai_addr)->sin_addr, h->ip, sizeof(h->ip));
+
+    h->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (h->fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(h->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(h->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(h->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    t = http_now_us();
+    if (h->interrupt) {
+        // connect in background to check interrupt while waiting
+        int flags = fcntl(h->fd, F_GETFL);
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        fcntl(h->fd, F_SETFL, flags | O_NONBLOCK);
+        ret = connect(h->fd, res->ai_addr, res->ai_addrlen);
+        if (ret < 0 && errno == EINPROGRESS) {
+            ret = http_flv_wait(h, POLLOUT);
+            if (ret == 0 && (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error)) {
+                errno = error;
+                ret = -1;
+            }
+        }
+        fcntl(h->fd, F_SETFL, flags);
+    } else {
+        ret = connect(h->fd, res->ai_addr, res->ai_addrlen);
+    }
+    freeaddrinfo(res);
+    if (ret < 0) {
+        logger(LOG_ERROR, "connect http %s:%d %s failed, errno %d", h->host, h->port, h->ip, errno);
+        return -1;
+    }
+    h->startup.connect_us += http_now_us() - t;
+    return 0;
+}
+
+static int http_flv_send(HttpFlv *h, const char *data, int size)
+{
+    while (size > 0) {
+        ssize_t n = send(h->fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger(LOG_ERROR, "send http request failed, errno %d", errno);
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int http_flv_recv(HttpFlv *h, char *buf, int size)
+{
+    while (1) {
+        ssize_t n;
+
+        if (h->interrupt && http_flv_wait(h, POLLIN) < 0) {
+            return -1;
+        }
+        n = recv(h->fd, buf, size, 0);
+        if (n > 0) {
+            return n;
+        }
+        if (n == 0) {
+            logger(LOG_WARN, "http-flv %s closed by peer", h->host);
+            return -1;
+        }
+        if (errno != EINTR) {
+            logger(LOG_ERROR, "recv http-flv failed, errno %d", errno);
+            return -1;
+        }
+    }
+}
+
+static int http_flv_fill(HttpFlv *h)
+{
+    int n;
+
+    if (h->pos == h->end) {
+        h->pos = h->end = 0;
+    }
+    n = http_flv_recv(h, h->buf + h->end, sizeof(h->buf) - h->end);
+    if (n < 0) {
+        return -1;
+    }
+    h->end += n;
+    return 0;
+}
+
+// read exactly size bytes of the connection, large reads bypass the buffer
+static int http_flv_read_raw(HttpFlv *h, char *data, int size)
+{
+    while (size > 0) {
+        int n = h->end - h->pos;
+        if (n > 0) {
+            n = n < size ? n : size;
+            memcpy(data, h->buf + h->pos, n);
+            h->pos += n;
+        } else if (size >= HTTP_FLV_DIRECT_READ_MIN) {
+            n = http_flv_recv(h, data, size);
+            if (n < 0) {
+                return -1;
+            }
+        } else {
+            if (http_flv_fill(h) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// a line without CRLF, of the headers or chunk sizes
+static int http_flv_read_line(HttpFlv *h, char *line, int size)
+{
+    while (1) {
+        char *lf = memchr(h->buf + h->pos, '\n', h->end - h->pos);
+        if (lf) {
+            int n = lf - (h->buf + h->pos);
+            if (n > 0 && lf[-1] == '\r') {
+                n--;
+            }
+            if (n >= size) {
+                logger(LOG_ERROR, "too long http line");
+                return -1;
+            }
+            memcpy(line, h->buf + h->pos, n);
+            line[n] = '\0';
+            h->pos = lf + 1 - h->buf;
+            return 0;
+        }
+        if (h->end - h->pos >= HTTP_MAX_LINE) {
+            logger(LOG_ERROR, "too long http line");
+            return -1;
+        }
+        if (h->pos > 0 && h->end == (int)sizeof(h->buf)) {
+            memmove(h->buf, h->buf + h->pos, h->end - h->pos);
+            h->end -= h->pos;
+            h->pos = 0;
+        }
+        if (http_flv_fill(h) < 0) {
+            return -1;
+        }
+    }
+}
+
+// read exactly size bytes of the body
+static int http_flv_read(HttpFlv *h, char *data, int size)
+{
+    char line[64];
+
+    while (size > 0) {
+        int n = size;
+        if (h->chunked) {
+            if (h->chunk_left == 0) {
+                if (http_flv_read_line(h, line, sizeof(line)) < 0) {
+                    return -1;
+                }
+                // CRLF after the data of last chunk
+                if (line[0] == '\0' && http_flv_read_line(h, line, sizeof(line)) < 0) {
+                    return -1;
+                }
+                h->chunk_left = strtoll(line, NULL, 16);
+                if (h->chunk_left <= 0) {
+                    logger(LOG_WARN, "http-flv %s body ends", h->host);
+                    return -1;
+                }
+            }
+            if (n > h->chunk_left) {
+                n = h->chunk_left;
+            }
+        }
+        if (http_flv_read_raw(h, data, n) < 0) {
+            return -1;
+        }
+        h->chunk_left -= h->chunked ? n : 0;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * send the request and read the response headers, location is set
+ * on redirect. return the status code or -1 on error.
+ */
+static int http_flv_request(HttpFlv *h, char *location, int size)
+{
+    char line[HTTP_MAX_LINE];
+    int status;
+    int n;
+
+    n = snprintf(line, sizeof(line),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s:%d\r\n"
+        "User-Agent: lss\r\n"
+        "Accept: */*\r\n"
+        "Connection: close\r\n"
+        "\r\n", h->path, h->host, h->port);
+    if (n >= (int)sizeof(line) || http_flv_send(h, line, n) < 0) {
+        return -1;
+    }
+
+    if (http_flv_read_line(h, line, sizeof(line)) < 0) {
+        return -1;
+    }
+    if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+        logger(LOG_ERROR, "invalid http status line %s", line);
+        return -1;
+    }
+
+    while (1) {
+        char *value;
+        if (http_flv_read_line(h, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        if (line[0] == '\0') {
+            break;
+        }
+        value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        if (!strcasecmp(line, "Transfer-Encoding") && !strncasecmp(value, "chunked", 7)) {
+            h->chunked = 1;
+        } else if (!strcasecmp(line, "Location")) {
+            snprintf(location, size, "%s", value);
+        }
+    }
+    return status;
+}
+
+/**
+ * make a relative location absolute against the url requested,
+ * as rfc7231 allows for the Location header.
+ */
+static int http_flv_resolve_location(HttpFlv *h, char *location, int size)
+{
+    char base[2048];
+    const char *slash;
+    int n;
+
+    // absolute when a scheme comes first, which http_flv_parse_url checks
+    n = strcspn(location, ":/?#");
+    if (n > 0 && location[n] == ':') {
+        return 0;
+    }
+    if (!strncmp(location, "//", 2)) {
+        n = snprintf(base, sizeof(base), "http:");
+    } else if (location[0] == '/') {
+        n = snprintf(base, sizeof(base), "http://%s:%d", h->host, h->port);
+    } else {
+        // relative to the directory of the path, before the query
+        slash = h->path + strcspn(h->path, "?");
+        while (slash > h->path && slash[-1] != '/') {
+            slash--;
+        }
+        n = snprintf(base, sizeof(base), "http://%s:%d%.*s", h->host, h->port, (int)(slash - h->path), h->path);
+    }
+    if (n >= (int)sizeof(base) || n + strlen(location) >= (size_t)size) {
+        logger(LOG_ERROR, "too long http redirect %s", location);
+        return -1;
+    }
+    memmove(location + n, location, strlen(location) + 1);
+    memcpy(location, base, n);
+    return 0;
+}
+
+static void http_flv_reset(HttpFlv *h)
+{
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+    h->fd = -1;
+    h->chunked = 0;
+    h->chunk_left = 0;
+    h->pos = h->end = 0;
+    // the redirected host is resolved
+    h->ip[0] = '\0';
+}
+
+HttpFlv *http_flv_open(const char *url, const char *ip, int timeout_ms,
+                       HttpFlvInterruptCallback interrupt, void *opaque)
+{
+    char location[2048];
+    char header[FLV_HEADER_SIZE + 4];
+    int redirects = 0;
+    int64_t t;
+    int status;
+    int skip;
+
+    HttpFlv *h = calloc(1, sizeof(HttpFlv));
+    if (!h) {
+        return NULL;
+    }
+    h->fd = -1;
+    h->timeout_ms = timeout_ms;
+    h->interrupt = interrupt;
+    h->opaque = opaque;
+    if (ip) {
+        snprintf(h->ip, sizeof(h->ip), "%s", ip);
+    }
+
+    snprintf(location, sizeof(location), "%s", url);
+    while (1) {
+        if (http_flv_parse_url(h, location) < 0 || http_flv_connect(h, timeout_ms) < 0) {
+            goto fail;
+        }
+        location[0] = '\0';
+        t = http_now_us();
+        status = http_flv_request(h, location, sizeof(location));
+        if (status < 0) {
+            goto fail;
+        }
+        if (status >= 300 && status < 400 && location[0] && redirects++ < HTTP_FLV_MAX_REDIRECTS) {
+            if (http_flv_resolve_location(h, location, sizeof(location)) < 0) {
+                goto fail;
+            }
+            logger(LOG_INFO, "http-flv %s redirect to %s", url, location);
+            h->startup.request_us += http_now_us() - t;
+            http_flv_reset(h);
+            continue;
+        }
+        if (status != 200) {
+            logger(LOG_ERROR, "http-flv %s response %d", url, status);
+            goto fail;
+        }
+        break;
+    }
+
+    // flv header and the first previous tag size
+    if (http_flv_read(h, header, sizeof(header)) < 0) {
+        goto fail;
+    }
+    if (memcmp(header, "FLV", 3)) {
+        logger(LOG_ERROR, "http-flv %s is not flv", url);
+        goto fail;
+    }
+    skip = (((uint8_t)header[5] << 24) | ((uint8_t)header[6] << 16) |
+            ((uint8_t)header[7] << 8) | (uint8_t)header[8]) - FLV_HEADER_SIZE;
+    while (skip > 0) {
+        int n = skip < (int)sizeof(header) ? skip : (int)sizeof(header);
+        if (http_flv_read(h, header, n) < 0) {
+            goto fail;
+        }
+        skip -= n;
+    }
+    h->startup.request_us += http_now_us() - t;
+    // reads of the stream block in recv, with the socket timeout
+    h->interrupt = NULL;
+
+    logger(LOG_INFO, "http-flv %s connected%s", url, h->chunked ? ", chunked" : "");
+    return h;
+
+fail:
+    http_flv_close(h);
+    return NULL;
+}
+
+int http_flv_read_packet(HttpFlv *h, char *type, u_int32_t *timestamp, char **data, int *size)
+{
+    uint8_t header[FLV_TAG_HEADER_SIZE];
+    char tag_size[4];
+    char *payload;
+    int n;
+
+    if (http_flv_read(h, (char *)header, sizeof(header)) < 0) {
+        return -1;
+    }
+    n = (header[1] << 16) | (header[2] << 8) | header[3];
+
+    // empty tags are returned without data, as rtmp does
+    payload = n > 0 ? srs_rtmp_alloc_packet(n) : NULL;
+    if (n > 0 && !payload) {
+        logger(LOG_ERROR, "alloc http-flv tag %d bytes failed", n);
+        return -1;
+    }
+    if (http_flv_read(h, payload, n) < 0 || http_flv_read(h, tag_size, sizeof(tag_size)) < 0) {
+        if (payload) {
+            srs_rtmp_free_packet(payload);
+        }
+        return -1;
+    }
+
+    // the filter bit is reserved
+    *type = header[0] & 0x1f;
+    *timestamp = ((u_int32_t)header[7] << 24) | (header[4] << 16) | (header[5] << 8) | header[6];
+    *data = payload;
+    *size = n;
+    return 0;
+}
+
+const char *http_flv_server_ip(HttpFlv *h)
+{
+    return h->ip;
+}
+
+const HttpFlvStartup *http_flv_startup(HttpFlv *h)
+{
+    return &h->startup;
+}
+
+void http_flv_close(HttpFlv *h)
+{
+    if (!h) {
+        return;
+    }
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+    free(h);
+}
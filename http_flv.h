@@ -0,0 +1,53 @@
+#ifndef HTTP_FLV_H_
+#define HTTP_FLV_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// timeout of connecting and of every read
+#define HTTP_FLV_TIMEOUT_MS 5000
+#define HTTP_FLV_BUFFER_SIZE 65536
+// the rest of a tag is read into the packet directly when at least this large
+#define HTTP_FLV_DIRECT_READ_MIN 4096
+#define HTTP_FLV_MAX_REDIRECTS 3
+// http_flv_open checks the interrupt callback at least this often
+#define HTTP_FLV_INTERRUPT_MS 100
+
+typedef struct HttpFlv HttpFlv;
+
+// return nonzero to give up waiting
+typedef int (*HttpFlvInterruptCallback)(void *opaque);
+
+// time of the open phases in us, summed over redirects
+typedef struct {
+    int64_t dns_us;
+    int64_t connect_us;
+    // the request until the flv header is read
+    int64_t request_us;
+} HttpFlvStartup;
+
+/**
+ * GET url, http://host[:port]/path, and read the flv header of the body,
+ * redirects are followed. the host of url is connected at ip when not
+ * NULL, for example resolved by the dns cache. the open fails when
+ * interrupt, if not NULL, returns nonzero. return NULL on error.
+ */
+HttpFlv *http_flv_open(const char *url, const char *ip, int timeout_ms,
+                       HttpFlvInterruptCallback interrupt, void *opaque);
+
+/**
+ * the address connected, and the time it took to open.
+ */
+const char *http_flv_server_ip(HttpFlv *h);
+const HttpFlvStartup *http_flv_startup(HttpFlv *h);
+
+/**
+ * read a flv tag with the semantics of srs_rtmp_read_packet, type is
+ * SRS_RTMP_TYPE_*. data must be freed by srs_rtmp_free_packet.
+ * return 0, or -1 on error or end of stream.
+ */
+int http_flv_read_packet(HttpFlv *h, char *type, u_int32_t *timestamp, char **data, int *size);
+
+void http_flv_close(HttpFlv *h);
+
+#endif
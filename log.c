@@ -3,77 +3,96 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <sys/time.h>
 
 #define LOG_BUFFER_SIZE 4096
+// records waiting for the writer, a power of two
+#define LOG_RING_SIZE 1024
+// longer messages are truncated, as by the direct path
+#define LOG_RECORD_SIZE LOG_BUFFER_SIZE
+// the writer sleeps this long when the ring is empty, or till it is half full
+#define LOG_FLUSH_MS 10
+// the file is reopened for rotation
+#define LOG_REOPEN_S 60
+#define LOG_MERGE_MAX 100
+#define LOG_FILE_BUFFER_SIZE 65536
+
+typedef struct {
+    // the position it holds plus one when written, see logger_push
+    uint64_t seq;
+    struct timeval time;
+    int level;
+    char msg[LOG_RECORD_SIZE];
+} LogRecord;
 
 static const char *LV[] = {"ERROR", "WARN", "INFO", "VERB", "DEBUG"};
-static int g_level = LOG_INFO;
+int g_logger_level = LOG_INFO;
 static const char *g_filename = NULL;
 static FILE *g_fp = NULL;
 static time_t g_opentime = 0;
-static char g_lastmsg[LOG_BUFFER_SIZE];
+static char g_lastmsg[LOG_RECORD_SIZE];
 static int g_count = 0;
 
-void logger_init(int level, const char *filename)
-{
-    g_level = level;
-    g_filename = filename;
-    if (filename) {
-        g_fp = fopen(g_filename, "a+");
-        g_opentime = time(NULL);
-        if(!g_fp) {
-            logger(LOG_ERROR, "cannot open log file [%s]", g_filename);
-        }
-    }
-}
+// bounded multi producer ring, drained by the writer thread only
+static LogRecord *g_ring = NULL;
+static uint64_t g_push_pos = 0;
+static uint64_t g_pop_pos = 0;
+static uint64_t g_dropped = 0;
+static uint64_t g_dropped_reported = 0;
+static int g_running = 0;
+static int g_stopping = 0;
+static int g_atexit = 0;
+static pthread_t g_writer;
+// posted when the ring gets half full
+static sem_t g_wakeup;
+// records are written directly after the writer stops
+static pthread_mutex_t g_sync_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void logger_uninit()
+// the date of the last second formatted
+static time_t g_date_sec = -1;
+static char g_date[64];
+
+static void logger_open()
 {
-    if(g_fp) {
-        fclose(g_fp);
-        g_fp = NULL;
+    g_fp = fopen(g_filename, "a+");
+    g_opentime = time(NULL);
+    if (g_fp) {
+        setvbuf(g_fp, NULL, _IOFBF, LOG_FILE_BUFFER_SIZE);
     }
 }
 
-static void _logger(int level, const char *msg) 
+static void _logger(int level, const struct timeval *tp, const char *msg) 
 {
-    char date[64] = {0};
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    struct tm now_tm;
-    localtime_r(&tp.tv_sec, &now_tm);
-    strftime(date, sizeof(date) - 1, "%Y-%m-%d %H:%M:%S", &now_tm);
-    char buffer[LOG_BUFFER_SIZE] = {0};
-    snprintf(buffer, sizeof(buffer) - 1, "%s.%03ld %5s - %s\r\n", date, tp.tv_usec / 1000, LV[level], msg);
+    if (tp->tv_sec != g_date_sec) {
+        struct tm now_tm;
+        localtime_r(&tp->tv_sec, &now_tm);
+        strftime(g_date, sizeof(g_date) - 1, "%Y-%m-%d %H:%M:%S", &now_tm);
+        g_date_sec = tp->tv_sec;
+    }
 
     if(g_fp) {
-        fputs(buffer, g_fp);
-        fflush(g_fp);
+        fprintf(g_fp, "%s.%03ld %5s - %s\r\n", g_date, (long)tp->tv_usec / 1000, LV[level], msg);
     }
 }
 
-void logger(int level, const char * fmt, ...)
+// merge the same messages in a row, as the writer sees them
+static void logger_write(int level, const struct timeval *tp, const char *msg)
 {
-    if (level > g_level) {
-        return;
-    }
-
     if(!g_fp && g_filename) {
-        g_fp = fopen(g_filename, "a+");
-        g_opentime = time(NULL);
+        logger_open();
     }
 
-    char msg[LOG_BUFFER_SIZE] = {0};
-    va_list argp;
-    va_start(argp, fmt);
-    vsnprintf(msg, sizeof(msg) - 1, fmt, argp);
-    va_end(argp);
-
     if (g_count > 0) {
-        if(g_count >= 100 || strcmp(g_lastmsg, msg) != 0) {
+        if(g_count >= LOG_MERGE_MAX || strcmp(g_lastmsg, msg) != 0) {
             char buffer[64] = { 0 };
             snprintf(buffer, sizeof(buffer) - 1, "(((merged %d same messages)))", g_count);
-            _logger(LOG_WARN, buffer);
+            _logger(LOG_WARN, tp, buffer);
             g_count = 0;
         }
     }
@@ -83,17 +102,201 @@ void logger(int level, const char * fmt, ...)
         return;
     }
 
-    _logger(level, msg);
+    _logger(level, tp, msg);
+
+    snprintf(g_lastmsg, sizeof(g_lastmsg), "%s", msg);
+}
+
+static void logger_flush()
+{
+    uint64_t dropped = __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+
+    if (dropped != g_dropped_reported) {
+        char buffer[96] = { 0 };
+        struct timeval tp;
+        gettimeofday(&tp, NULL);
+        snprintf(buffer, sizeof(buffer) - 1, "(((dropped %llu messages, %llu in total)))",
+            (unsigned long long)(dropped - g_dropped_reported), (unsigned long long)dropped);
+        _logger(LOG_WARN, &tp, buffer);
+        g_dropped_reported = dropped;
+    }
 
-    strcpy(g_lastmsg, msg);
     if(g_fp) {
-        if(time(NULL) - g_opentime >= 60) {
+        fflush(g_fp);
+        if(time(NULL) - g_opentime >= LOG_REOPEN_S) {
             fclose(g_fp);
             g_fp = NULL;
         }
     }
 }
 
+// write the records pushed so far, return how many
+static int logger_drain()
+{
+    int n = 0;
+
+    while (1) {
+        LogRecord *r = &g_ring[g_pop_pos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != g_pop_pos + 1) {
+            break;
+        }
+        logger_write(r->level, &r->time, r->msg);
+        // free for the push one lap later
+        __atomic_store_n(&r->seq, g_pop_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&g_pop_pos, g_pop_pos + 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    return n;
+}
+
+static void *logger_writer(void *arg)
+{
+    struct timespec deadline;
+
+    while (!__atomic_load_n(&g_stopping, __ATOMIC_ACQUIRE)) {
+        if (logger_drain() > 0) {
+            logger_flush();
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&g_wakeup, &deadline) < 0 && errno == EINTR) {
+        }
+    }
+    logger_drain();
+    logger_flush();
+    return NULL;
+}
+
+/**
+ * claim a slot, format the message in place and publish it.
+ * return -1 if the ring is full.
+ */
+static int logger_push(int level, const char *fmt, va_list argp)
+{
+    uint64_t pos = __atomic_load_n(&g_push_pos, __ATOMIC_RELAXED);
+    LogRecord *r;
+
+    while (1) {
+        r = &g_ring[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_push_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the writer is a lap behind
+            return -1;
+        } else {
+            pos = __atomic_load_n(&g_push_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    gettimeofday(&r->time, NULL);
+    r->level = level;
+    vsnprintf(r->msg, sizeof(r->msg), fmt, argp);
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // a sleeping writer would let a burst fill the ring
+    if (pos - __atomic_load_n(&g_pop_pos, __ATOMIC_RELAXED) == LOG_RING_SIZE / 2) {
+        sem_post(&g_wakeup);
+    }
+    return 0;
+}
+
+static void logger_ring_init()
+{
+    uint64_t i;
+
+    g_ring = calloc(LOG_RING_SIZE, sizeof(LogRecord));
+    if (!g_ring) {
+        return;
+    }
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        g_ring[i].seq = i;
+    }
+}
+
+void logger_init(int level, const char *filename)
+{
+    sigset_t all, old;
+
+    g_logger_level = level;
+    g_filename = filename;
+    if (filename) {
+        logger_open();
+        if(!g_fp) {
+            logger(LOG_ERROR, "cannot open log file [%s]", g_filename);
+        }
+    }
+
+    if (!g_ring) {
+        logger_ring_init();
+        sem_init(&g_wakeup, 0, 0);
+    }
+    if (!g_ring || g_running) {
+        return;
+    }
+    // signals are left to the listener of main
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    g_stopping = 0;
+    if (pthread_create(&g_writer, NULL, logger_writer, NULL) == 0) {
+        g_running = 1;
+        // records queued by a call of exit are written too
+        if (!g_atexit) {
+            atexit(logger_uninit);
+            g_atexit = 1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void logger_uninit()
+{
+    // the first caller stops the writer, exit may race the end of main
+    if (__atomic_exchange_n(&g_stopping, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (g_running) {
+        sem_post(&g_wakeup);
+        pthread_join(g_writer, NULL);
+        __atomic_store_n(&g_running, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&g_sync_lock);
+    if(g_fp) {
+        fclose(g_fp);
+        g_fp = NULL;
+    }
+    pthread_mutex_unlock(&g_sync_lock);
+}
+
+void logger_log(int level, const char * fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    if (__atomic_load_n(&g_running, __ATOMIC_ACQUIRE)) {
+        if (logger_push(level, fmt, argp) < 0) {
+            __atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        char msg[LOG_BUFFER_SIZE] = {0};
+        struct timeval tp;
+        vsnprintf(msg, sizeof(msg) - 1, fmt, argp);
+        gettimeofday(&tp, NULL);
+        pthread_mutex_lock(&g_sync_lock);
+        logger_write(level, &tp, msg);
+        logger_flush();
+        pthread_mutex_unlock(&g_sync_lock);
+    }
+    va_end(argp);
+}
+
 void logger_binary(int level, const char* prefix, unsigned char *buf, int len) 
 {
     if (len > 64) {
@@ -110,5 +313,10 @@ void logger_binary(int level, const char* prefix, unsigned char *buf, int len)
 
 int logger_level() 
 {
-    return g_level;
-}
\ No newline at end of file
+    return g_logger_level;
+}
+
+uint64_t logger_dropped()
+{
+    return __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+}
@@ -1,6 +1,8 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <stdint.h>
+
 enum {
     LOG_ERROR = 0,
     LOG_WARN,
@@ -9,9 +11,26 @@ enum {
     LOG_DEBUG,
 };
 
+// records above this level compile to nothing, set by TRACE=0 of the Makefile
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+// the runtime level, cached for the check at call sites
+extern int g_logger_level;
+
+#define logger_enabled(level) ((level) <= LOG_MAX_LEVEL && (level) <= g_logger_level)
+
 void logger_init(int level, const char*filename);
 void logger_uninit();
-void logger(int level, const char *fmt, ...);
+void logger_log(int level, const char *fmt, ...);
+
+// arguments are not evaluated when the level is off
+#define logger(level, ...) do { \
+        if (logger_enabled(level)) { \
+            logger_log(level, __VA_ARGS__); \
+        } \
+    } while (0)
 
 void logger_binary(int level, const char *prefix, unsigned char *buf, int len);
 
@@ -19,4 +38,9 @@ void logger_binary(int level, const char *prefix, unsigned char *buf, int len);
 
 int logger_level();
 
+/**
+ * records dropped since start because the writer fell behind.
+ */
+uint64_t logger_dropped();
+
 #endif
\ No newline at end of file
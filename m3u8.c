@@ -1,7 +1,26 @@
 #include "m3u8.h"
 #include "log.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+
+void m3u8_get_default_options(M3U8Options *opts)
+{
+    if (!opts) {
+        return;
+    }
+    memset(opts, 0, sizeof(*opts));
+    opts->version = M3U8_VERSION_DEFAULT;
+    opts->window = SLICE_NUM;
+    opts->target_round = M3U8_TARGET_PAD;
+}
 
 void m3u8_get_default_slice_props(M3U8SliceProps *props)
 {
@@ -11,93 +30,701 @@ void m3u8_get_default_slice_props(M3U8SliceProps *props)
     memset(props, 0, sizeof(*props));
 }
 
-int m3u8_begin(const char *filename, int duration, M3U8Context *ctx)
+/**
+ * replace filename by the iov buffers atomically, players either read
+ * the old playlist or the new one, never a half written file.
+ */
+static int m3u8_write_file(const char *filename, struct iovec *iov, int iovcnt)
 {
-    if (ctx) {
-        // initialize and return
-        memset(ctx, 0, sizeof(M3U8Context));
-        ctx->duration = duration;
-    } else {
-        FILE *fp = fopen(filename, "w");
-        if (!fp) {
-            logger(LOG_ERROR, "open m3u8[%s] failed.", filename);
+    size_t size = strlen(filename) + sizeof(".tmp");
+    char *tmp = malloc(size);
+    int fd;
+
+    if (!tmp) {
+        logger(LOG_ERROR, "alloc m3u8 tmp path %d failed.", (int)size);
+        return -1;
+    }
+    snprintf(tmp, size, "%s.tmp", filename);
+
+    fd = open(tmp, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+    if (fd < 0) {
+        logger(LOG_ERROR, "open m3u8[%s] failed.", tmp);
+        free(tmp);
+        return -1;
+    }
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger(LOG_ERROR, "write m3u8[%s] failed, errno %d.", tmp, errno);
+            close(fd);
+            unlink(tmp);
+            free(tmp);
+            return -1;
+        }
+        // short write, skip what is done
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    close(fd);
+
+    if (rename(tmp, filename) != 0) {
+        logger(LOG_ERROR, "rename m3u8[%s] to [%s] failed, errno %d.", tmp, filename, errno);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+/**
+ * reserve size bytes at the end of body, the consumed head is
+ * compacted before the buffer grows.
+ */
+static char *m3u8_body_reserve(M3U8Context *ctx, int size)
+{
+    if (ctx->body_end + size <= ctx->body_capacity) {
+        return ctx->body + ctx->body_end;
+    }
+
+    if (ctx->body_start > 0) {
+        memmove(ctx->body, ctx->body + ctx->body_start, ctx->body_end - ctx->body_start);
+        ctx->body_end -= ctx->body_start;
+        ctx->body_base += ctx->body_start;
+        ctx->body_start = 0;
+    }
+
+    if (ctx->body_end + size > ctx->body_capacity) {
+        int capacity = ctx->body_capacity ? ctx->body_capacity : 4096;
+        char *buf;
+        while (capacity < ctx->body_end + size) {
+            capacity *= 2;
+        }
+        buf = realloc(ctx->body, capacity);
+        if (!buf) {
+            logger(LOG_ERROR, "alloc m3u8 buffer %d failed.", capacity);
+            return NULL;
+        }
+        ctx->body = buf;
+        ctx->body_capacity = capacity;
+    }
+    return ctx->body + ctx->body_end;
+}
+
+static int m3u8_buffer_append(M3U8Buffer *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data + buf->size, buf->capacity - buf->size, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
             return -1;
         }
+        if (buf->size + n < buf->capacity) {
+            break;
+        }
 
-        fprintf(fp, "#EXTM3U\r\n");
-        fprintf(fp, "#EXT-X-VERSION:3\r\n");
-        fprintf(fp, "#EXT-X-TARGETDURATION:%d\r\n", duration);
+        int capacity = buf->capacity ? buf->capacity * 2 : 1024;
+        while (capacity <= buf->size + n) {
+            capacity *= 2;
+        }
+        char *data = realloc(buf->data, capacity);
+        if (!data) {
+            logger(LOG_ERROR, "alloc m3u8 buffer %d failed.", capacity);
+            return -1;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    buf->size += n;
+    return n;
+}
+
+static void m3u8_buffer_free(M3U8Buffer *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/**
+ * render the lines of one slice to the end of body once, they are
+ * reused on every playlist update while the slice stays in the window.
+ * positions are recorded to info if not NULL.
+ * return bytes rendered or -1.
+ */
+static int m3u8_render_slice(M3U8Context *ctx, M3U8Slice *info, const char *map, const char *slice,
+    int duration, M3U8SliceProps *props)
+{
+    int size = strlen(slice) + 64;
+    char *p;
+    int n = 0;
+
+    if (map) {
+        size += strlen(map) + 32;
+    }
+
+    p = m3u8_body_reserve(ctx, size);
+    if (!p) {
+        return -1;
+    }
 
-        fclose(fp);
+    if (props && props->discontinuity_before) {
+        n += snprintf(p + n, size - n, "#EXT-X-DISCONTINUITY\r\n");
+    }
+    if (map) {
+        n += snprintf(p + n, size - n, "#EXT-X-MAP:URI=\"%s\"\r\n", map);
+    }
+    if (info) {
+        info->line_pos = ctx->body_base + ctx->body_end;
+        info->prefix_size = n;
+    }
+    n += snprintf(p + n, size - n, "#EXTINF:%g,\r\n%s\r\n", (float) duration / 1000, slice);
+
+    ctx->body_end += n;
+    return n;
+}
+
+/**
+ * target duration never changes in a playlist, a longer slice is
+ * clamped to the longest EXTINF the target allows.
+ */
+static int m3u8_clamp_duration(M3U8Context *ctx, int duration)
+{
+    int max = ctx->duration * 1000;
+
+    if (ctx->target_round == M3U8_TARGET_NEAREST) {
+        max += 499;
+    }
+    if (duration > max) {
+        logger(LOG_WARN, "m3u8 slice %dms longer than target duration %ds, clamped", duration, ctx->duration);
+        return max;
+    }
+    return duration;
+}
+
+/**
+ * render playlist header to buf, served is set for the form published
+ * to hls_server, only it can answer blocking reloads and delta requests.
+ */
+static int m3u8_render_header(M3U8Context *ctx, char *buf, int size, int live, int served)
+{
+    int can_block_reload = served && ctx->can_block_reload;
+    int can_skip = served && ctx->can_skip;
+    int n = snprintf(buf, size,
+        "#EXTM3U\r\n"
+        "#EXT-X-VERSION:%d\r\n", ctx->version);
+
+    if (live && (can_block_reload || can_skip || ctx->part_target > 0)) {
+        const char *sep = "";
+        n += snprintf(buf + n, size - n, "#EXT-X-SERVER-CONTROL:");
+        if (can_block_reload) {
+            n += snprintf(buf + n, size - n, "CAN-BLOCK-RELOAD=YES");
+            sep = ",";
+        }
+        if (can_skip) {
+            n += snprintf(buf + n, size - n, "%sCAN-SKIP-UNTIL=%.1f", sep,
+                (double) ctx->duration * M3U8_SKIP_TARGETS);
+            sep = ",";
+        }
+        if (ctx->part_target > 0) {
+            n += snprintf(buf + n, size - n, "%sPART-HOLD-BACK=%.3f", sep, (double) ctx->part_target * 3 / 1000);
+        }
+        n += snprintf(buf + n, size - n, "\r\n");
+    }
+    if (live && ctx->part_target > 0) {
+        n += snprintf(buf + n, size - n, "#EXT-X-PART-INF:PART-TARGET=%.3f\r\n",
+            (double) ctx->part_target / 1000);
+    }
+    if (live) {
+        n += snprintf(buf + n, size - n, "#EXT-X-MEDIA-SEQUENCE:%d\r\n",
+            ctx->sequence > ctx->window ? ctx->sequence - ctx->window : 0);
+        if (ctx->discontinuity_sequence > 0) {
+            n += snprintf(buf + n, size - n, "#EXT-X-DISCONTINUITY-SEQUENCE:%d\r\n",
+                ctx->discontinuity_sequence);
+        }
+    }
+    n += snprintf(buf + n, size - n, "#EXT-X-TARGETDURATION:%d\r\n", ctx->duration);
+    return n;
+}
+
+static int m3u8_context_init(M3U8Context *ctx, M3U8Options *opts, int window)
+{
+    memset(ctx, 0, sizeof(M3U8Context));
+    ctx->duration = opts->duration;
+    if (opts->target_round == M3U8_TARGET_PAD) {
+        ctx->duration++;
+    }
+    ctx->version = opts->version;
+    ctx->target_round = opts->target_round;
+    if (window > 0) {
+        ctx->can_block_reload = opts->can_block_reload;
+        ctx->can_skip = opts->can_skip;
+        if (ctx->can_skip && ctx->version < M3U8_VERSION_SKIP) {
+            ctx->version = M3U8_VERSION_SKIP;
+        }
+        ctx->on_update = opts->on_update;
+        ctx->opaque = opts->opaque;
+    }
+    if (window > 0 && opts->part_target > 0) {
+        ctx->part_target = opts->part_target;
+        if (ctx->version < M3U8_VERSION_LLHLS) {
+            ctx->version = M3U8_VERSION_LLHLS;
+        }
+    }
+    ctx->window = window;
+    if (window > 0) {
+        ctx->slice = calloc(window, sizeof(M3U8Slice));
+        if (!ctx->slice) {
+            logger(LOG_ERROR, "alloc m3u8 window %d failed.", window);
+            return -1;
+        }
     }
     return 0;
 }
 
-int m3u8_input_slice(const char *filename, const char *slice, int duration, M3U8Context *ctx, M3U8SliceProps *props)
+static void m3u8_context_free(M3U8Context *ctx)
+{
+    int i;
+    for (i = 0; i < ctx->window; i++) {
+        free(ctx->slice[i].path);
+        free(ctx->slice[i].map);
+        m3u8_buffer_free(&ctx->slice[i].parts);
+    }
+    free(ctx->slice);
+    free(ctx->vod_map);
+    free(ctx->body);
+    m3u8_buffer_free(&ctx->open_parts);
+    free(ctx->open_uri);
+    memset(ctx, 0, sizeof(M3U8Context));
+}
+
+#define M3U8_BODY_IOV(pos, end) do {\
+    r->iov[r->iovcnt].iov_base = ctx->body + ((pos) - ctx->body_base);\
+    r->iov[r->iovcnt].iov_len = (end) - (pos);\
+    r->iovcnt++;\
+    } while(0)
+
+// one rendered form of the live playlist
+typedef struct {
+    char header[512];
+    char map_line[1024];
+    char hint[1024];
+    struct iovec iov[8 + 2 * M3U8_MAX_PART_SLICES];
+    int iovcnt;
+} M3U8Render;
+
+/**
+ * slices at the head of window a delta playlist may skip, they all end
+ * at least CAN-SKIP-UNTIL before the end of the playlist.
+ */
+static int m3u8_skippable(M3U8Context *ctx, int first)
+{
+    int64_t distance = 0;
+    int i = ctx->sequence;
+
+    while (i > first && distance < (int64_t)ctx->duration * M3U8_SKIP_TARGETS * 1000) {
+        i--;
+        distance += ctx->slice[i % ctx->window].duration;
+    }
+    return i - first;
+}
+
+/**
+ * render live playlist of ctx to r without copying the slice lines,
+ * slices near the end are followed by their parts, and the parts of
+ * the open segment come last. the first skip slices are replaced by
+ * EXT-X-SKIP. served is the form published to hls_server.
+ */
+static void m3u8_render_live(M3U8Context *ctx, M3U8Render *r, int skip, int served)
 {
-    if (ctx) {
-        FILE *fp = fopen(filename, "w");
-        if (!fp) {
-            logger(LOG_ERROR, "open m3u8[%s] failed.", filename);
+    int nb_slices = ctx->sequence < ctx->window ? ctx->sequence : ctx->window;
+    int first = ctx->sequence - nb_slices + skip;
+    int part_first = ctx->sequence;
+    int64_t pos = ctx->body_base + ctx->body_start;
+    int n;
+    int i;
+
+    r->iovcnt = 0;
+
+    n = m3u8_render_header(ctx, r->header, sizeof(r->header), 1, served);
+    if (skip > 0) {
+        n += snprintf(r->header + n, sizeof(r->header) - n, "#EXT-X-SKIP:SKIPPED-SEGMENTS=%d\r\n", skip);
+        pos = ctx->slice[first % ctx->window].line_pos;
+    }
+    r->iov[r->iovcnt].iov_base = r->header;
+    r->iov[r->iovcnt].iov_len = n;
+    r->iovcnt++;
+
+    // the first slice in window always carries its map
+    if (first < ctx->sequence) {
+        M3U8Slice *info = &(ctx->slice[first % ctx->window]);
+        if (info->map && !info->has_map_line) {
+            r->iov[r->iovcnt].iov_base = r->map_line;
+            r->iov[r->iovcnt].iov_len = snprintf(r->map_line, sizeof(r->map_line),
+                "#EXT-X-MAP:URI=\"%s\"\r\n", info->map);
+            r->iovcnt++;
+        }
+    }
+
+    if (ctx->part_target > 0) {
+        // parts are removed once they are 3 target durations from the end
+        int64_t distance = 0;
+        while (part_first > first && ctx->sequence - part_first < M3U8_MAX_PART_SLICES &&
+            distance < (int64_t)ctx->duration * 3000) {
+            part_first--;
+            distance += ctx->slice[part_first % ctx->window].duration;
+        }
+    }
+
+    for (i = part_first; i < ctx->sequence; i++) {
+        M3U8Slice *info = &(ctx->slice[i % ctx->window]);
+        if (info->parts.size == 0) {
+            continue;
+        }
+        M3U8_BODY_IOV(pos, info->line_pos + info->prefix_size);
+        r->iov[r->iovcnt].iov_base = info->parts.data;
+        r->iov[r->iovcnt].iov_len = info->parts.size;
+        r->iovcnt++;
+        pos = info->line_pos + info->prefix_size;
+    }
+    M3U8_BODY_IOV(pos, ctx->body_base + ctx->body_end);
+
+    if (ctx->open_parts.size > 0) {
+        r->iov[r->iovcnt].iov_base = ctx->open_parts.data;
+        r->iov[r->iovcnt].iov_len = ctx->open_parts.size;
+        r->iovcnt++;
+    }
+    if (ctx->open_uri) {
+        r->iov[r->iovcnt].iov_base = r->hint;
+        r->iov[r->iovcnt].iov_len = snprintf(r->hint, sizeof(r->hint),
+            "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s\",BYTERANGE-START=%lld\r\n",
+            ctx->open_uri, (long long)ctx->open_next);
+        r->iovcnt++;
+    }
+}
+
+/**
+ * write live playlist of ctx to filename, and hand the served full and
+ * delta form to on_update.
+ */
+static int m3u8_write_live(const char *filename, M3U8Context *ctx)
+{
+    M3U8Render file;
+    M3U8Render full;
+    M3U8Render delta;
+    int nb_slices = ctx->sequence < ctx->window ? ctx->sequence : ctx->window;
+
+    m3u8_render_live(ctx, &file, 0, 0);
+
+    if (ctx->on_update) {
+        M3U8Update update;
+        int skip = ctx->can_skip ? m3u8_skippable(ctx, ctx->sequence - nb_slices) : 0;
+
+        m3u8_render_live(ctx, &full, 0, 1);
+        memset(&update, 0, sizeof(update));
+        update.iov = full.iov;
+        update.iovcnt = full.iovcnt;
+        if (skip > 0) {
+            m3u8_render_live(ctx, &delta, skip, 1);
+            update.delta_iov = delta.iov;
+            update.delta_iovcnt = delta.iovcnt;
+        }
+        update.msn = ctx->sequence;
+        update.nb_parts = ctx->open_part_count;
+        update.target_duration = ctx->duration;
+        ctx->on_update(ctx->opaque, &update);
+    }
+    return m3u8_write_file(filename, file.iov, file.iovcnt);
+}
+
+int m3u8_begin(const char *filename, M3U8Options *opts, M3U8Context *ctx)
+{
+    if (!ctx) {
+        logger(LOG_ERROR, "no context of m3u8[%s].", filename);
+        return -1;
+    }
+    if (!opts->vod) {
+        // initialize and return
+        return m3u8_context_init(ctx, opts, opts->window > 0 ? opts->window : SLICE_NUM);
+    } else {
+        // vod playlist keeps all rendered slices in body, no ring
+        char header[256];
+        struct iovec iov;
+
+        if (m3u8_context_init(ctx, opts, 0) != 0) {
             return -1;
         }
 
-        M3U8Slice *info = &(ctx->slice[ctx->sequence % SLICE_NUM]);
+        iov.iov_base = header;
+        iov.iov_len = m3u8_render_header(ctx, header, sizeof(header), 0, 0);
+        return m3u8_write_file(filename, &iov, 1);
+    }
+    return 0;
+}
+
+int m3u8_input_slice(const char *filename, const char *slice, int duration, M3U8Context *ctx, M3U8SliceProps *props)
+{
+    const char *map = (props && props->map && props->map[0]) ? props->map : NULL;
+    char header[256];
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (!ctx) {
+        return -1;
+    }
+    if (ctx->window > 0) {
+        M3U8Slice *info = &(ctx->slice[ctx->sequence % ctx->window]);
+        M3U8Slice *prev = ctx->sequence > 0 ? &(ctx->slice[(ctx->sequence - 1) % ctx->window]) : NULL;
+
+        duration = m3u8_clamp_duration(ctx, duration);
         if (info->duration > 0) {
             remove(info->path);
+            if (info->discontinuity) {
+                ctx->discontinuity_sequence++;
+            }
+            // drop its lines from the head of body
+            ctx->body_start += info->line_size;
+        }
+        free(info->path);
+        free(info->map);
+        m3u8_buffer_free(&info->parts);
+        memset(info, 0, sizeof(*info));
+
+        info->path = strdup(slice);
+        info->map = map ? strdup(map) : NULL;
+        if (!info->path || (map && !info->map)) {
+            logger(LOG_ERROR, "alloc m3u8 slice %s failed.", slice);
+            free(info->path);
+            free(info->map);
+            memset(info, 0, sizeof(*info));
+            return -1;
         }
+        info->discontinuity = props ? props->discontinuity_before : 0;
         info->duration = duration;
-        strncpy(info->path, slice, sizeof(info->path) - 1);
-        ctx->sequence++;
 
-        fprintf(fp, "#EXTM3U\r\n");
-        fprintf(fp, "#EXT-X-VERSION:3\r\n");
-        fprintf(fp, "#EXT-X-MEDIA-SEQUENCE:%d\r\n", ctx->sequence);
-        fprintf(fp, "#EXT-X-TARGETDURATION:%d\r\n", ctx->duration);
-
-        int i;
-        for (i = 0; i < SLICE_NUM; i++) {
-            M3U8Slice *info = &(ctx->slice[(ctx->sequence + i) % SLICE_NUM]);
-            if (info->duration > 0) {
-                fprintf(fp, "EXTINF:%g,\r\n", (float) info->duration / 1000);
-                fprintf(fp, "%s\r\n", info->path);
-            }
+        // map is only repeated when it changes between slices
+        info->has_map_line = map && (!prev || !prev->map || strcmp(prev->map, map));
+        info->line_size = m3u8_render_slice(ctx, info, info->has_map_line ? map : NULL, slice, duration, props);
+        if (info->line_size < 0) {
+            // nothing is rendered, body_end is not moved
+            free(info->path);
+            free(info->map);
+            memset(info, 0, sizeof(*info));
+            return -1;
         }
-        fclose(fp);
+        ctx->sequence++;
+
+        // parts of the open segment now belong to this slice
+        info->parts = ctx->open_parts;
+        memset(&ctx->open_parts, 0, sizeof(ctx->open_parts));
+        ctx->open_part_count = 0;
+        free(ctx->open_uri);
+        ctx->open_uri = NULL;
+
+        return m3u8_write_live(filename, ctx);
     } else {
-        FILE *fp = fopen(filename, "a");
-        if (!fp) {
-            logger(LOG_ERROR, "open m3u8[%s] failed.", filename);
+        int has_map_line = map && (!ctx->vod_map || strcmp(ctx->vod_map, map));
+
+        if (has_map_line) {
+            free(ctx->vod_map);
+            ctx->vod_map = strdup(map);
+        }
+        duration = m3u8_clamp_duration(ctx, duration);
+        if (m3u8_render_slice(ctx, NULL, has_map_line ? map : NULL, slice, duration, props) < 0) {
             return -1;
         }
 
-        if (props) {
-            if (props->discontinuity_before) {
-                fprintf(fp, "#EXT-X-DISCONTINUITY\r\n");
-            }
+        iov[iovcnt].iov_base = header;
+        iov[iovcnt].iov_len = m3u8_render_header(ctx, header, sizeof(header), 0, 0);
+        iovcnt++;
+        iov[iovcnt].iov_base = ctx->body;
+        iov[iovcnt].iov_len = ctx->body_end;
+        iovcnt++;
+        return m3u8_write_file(filename, iov, iovcnt);
+    }
+    return 0;
+}
+
+int m3u8_input_part(const char *filename, M3U8Context *ctx, M3U8Part *part)
+{
+    if (!ctx || ctx->part_target <= 0) {
+        return 0;
+    }
+
+    if (!ctx->open_uri || strcmp(ctx->open_uri, part->uri)) {
+        free(ctx->open_uri);
+        ctx->open_uri = strdup(part->uri);
+        if (!ctx->open_uri) {
+            return -1;
         }
+    }
+    ctx->open_next = part->offset + part->length;
 
-        fprintf(fp, "#EXTINF:%g,\r\n", (float) duration / 1000);
-        fprintf(fp, "%s\r\n", slice);
+    if (part->duration > ctx->part_target) {
+        logger(LOG_WARN, "m3u8 part %dms longer than part target %dms", part->duration, ctx->part_target);
+    }
 
-        fclose(fp);
+    if (m3u8_buffer_append(&ctx->open_parts,
+            "#EXT-X-PART:DURATION=%.3f,URI=\"%s\",BYTERANGE=\"%lld@%lld\"%s\r\n",
+            (double) part->duration / 1000, part->uri, (long long)part->length, (long long)part->offset,
+            part->independent ? ",INDEPENDENT=YES" : "") < 0) {
+        return -1;
     }
-    return 0;
+    ctx->open_part_count++;
+    return m3u8_write_live(filename, ctx);
 }
 
-int m3u8_end(const char *filename, M3U8Context *ctx) 
+int m3u8_end(const char *filename, M3U8Context *ctx)
 {
-    if (ctx) {
+    if (!ctx) {
+        return 0;
+    }
+    if (ctx->window > 0) {
         // no end label
+        m3u8_context_free(ctx);
     } else {
-        FILE *fp = fopen(filename, "a");
-        if (!fp) {
-            logger(LOG_ERROR, "open m3u8[%s] failed.", filename);
+        static const char endlist[] = "#EXT-X-ENDLIST\r\n";
+        char header[256];
+        struct iovec iov[3];
+        int ret;
+
+        iov[0].iov_base = header;
+        iov[0].iov_len = m3u8_render_header(ctx, header, sizeof(header), 0, 0);
+        iov[1].iov_base = ctx->body;
+        iov[1].iov_len = ctx->body_end;
+        iov[2].iov_base = (void *)endlist;
+        iov[2].iov_len = sizeof(endlist) - 1;
+        ret = m3u8_write_file(filename, iov, 3);
+
+        m3u8_context_free(ctx);
+        return ret;
+    }
+    return 0;
+}
+
+// append content of file to buf, return -1 on error
+static int m3u8_buffer_append_file(M3U8Buffer *buf, const char *filename)
+{
+    char data[1024];
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return -1;
+    }
+    while (1) {
+        ssize_t n = read(fd, data, sizeof(data));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(fd);
+            return n < 0 ? -1 : 0;
+        }
+        if (m3u8_buffer_append(buf, "%.*s", (int) n, data) < 0) {
+            close(fd);
             return -1;
         }
+    }
+}
 
-        fprintf(fp, "#EXT-X-ENDLIST\r\n");
-        fclose(fp);
+// rewrite master playlist from the entries of all renditions
+static int m3u8_write_master(const char *filename)
+{
+    M3U8Buffer master = {NULL, 0, 0};
+    struct iovec iov;
+    char pattern[1024];
+    glob_t entries;
+    size_t i;
+    int ret;
+
+    snprintf(pattern, sizeof(pattern), "%s.*.inf", filename);
+    ret = glob(pattern, 0, NULL, &entries);
+    if (ret != 0 && ret != GLOB_NOMATCH) {
+        logger(LOG_ERROR, "glob master m3u8 entries[%s] failed.", pattern);
+        return -1;
     }
-    return 0;
-}
\ No newline at end of file
+
+    ret = m3u8_buffer_append(&master, "#EXTM3U\r\n");
+    for (i = 0; ret >= 0 && i < entries.gl_pathc; i++) {
+        // fails if removed by its rendition meanwhile, skip it
+        m3u8_buffer_append_file(&master, entries.gl_pathv[i]);
+    }
+    globfree(&entries);
+
+    if (ret >= 0) {
+        iov.iov_base = master.data;
+        iov.iov_len = master.size;
+        ret = m3u8_write_file(filename, &iov, 1);
+    }
+    m3u8_buffer_free(&master);
+    return ret;
+}
+
+int m3u8_update_master(const char *filename, const char *name, const M3U8Variant *variant)
+{
+    char entry_file[1024];
+    char lock_file[1024];
+    int fd;
+    int ret;
+
+    snprintf(entry_file, sizeof(entry_file), "%s.%s.inf", filename, name);
+    snprintf(lock_file, sizeof(lock_file), "%s.lock", filename);
+
+    if (variant) {
+        M3U8Buffer entry = {NULL, 0, 0};
+        struct iovec iov;
+
+        ret = m3u8_buffer_append(&entry, "#EXT-X-STREAM-INF:BANDWIDTH=%d", variant->bandwidth);
+        if (ret >= 0 && variant->average_bandwidth > 0) {
+            ret = m3u8_buffer_append(&entry, ",AVERAGE-BANDWIDTH=%d", variant->average_bandwidth);
+        }
+        if (ret >= 0 && variant->width > 0 && variant->height > 0) {
+            ret = m3u8_buffer_append(&entry, ",RESOLUTION=%dx%d", variant->width, variant->height);
+        }
+        if (ret >= 0 && variant->codecs && variant->codecs[0]) {
+            ret = m3u8_buffer_append(&entry, ",CODECS=\"%s\"", variant->codecs);
+        }
+        if (ret >= 0) {
+            ret = m3u8_buffer_append(&entry, "\r\n%s\r\n", variant->uri);
+        }
+        if (ret >= 0) {
+            iov.iov_base = entry.data;
+            iov.iov_len = entry.size;
+            ret = m3u8_write_file(entry_file, &iov, 1);
+        }
+        m3u8_buffer_free(&entry);
+        if (ret < 0) {
+            return -1;
+        }
+    } else {
+        unlink(entry_file);
+    }
+
+    // renditions rebuild the master one at a time, the last one sees all entries
+    fd = open(lock_file, O_CREAT|O_RDWR, 0644);
+    if (fd < 0) {
+        logger(LOG_ERROR, "open master m3u8 lock[%s] failed, errno %d.", lock_file, errno);
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) < 0 && errno == EINTR);
+
+    ret = m3u8_write_master(filename);
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ret;
+}
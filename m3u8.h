@@ -1,29 +1,184 @@
 #ifndef M3U8_H_
 #define M3U8_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
+
+// default slices kept in live playlist
 #define SLICE_NUM 10
 
+#define M3U8_VERSION_DEFAULT 3
+// EXT-X-MAP for fmp4 segments
+#define M3U8_VERSION_FMP4 7
+// EXT-X-PART with BYTERANGE
+#define M3U8_VERSION_LLHLS 6
+// EXT-X-SKIP of delta playlist
+#define M3U8_VERSION_SKIP 9
+
+// CAN-SKIP-UNTIL in target durations, at least 6 by spec
+#define M3U8_SKIP_TARGETS 6
+
+// slices keeping their parts at most, spec keeps 3 target durations
+#define M3U8_MAX_PART_SLICES 8
+
+// target duration is segment duration + 1s
+#define M3U8_TARGET_PAD 0
+// target duration is segment duration, no slice goes over it
+#define M3U8_TARGET_CEIL 1
+// target duration is segment duration, slices round to nearest within it, as rfc8216 requires
+#define M3U8_TARGET_NEAREST 2
+
+typedef struct {
+    // full playlist
+    const struct iovec *iov;
+    int iovcnt;
+    // delta playlist with EXT-X-SKIP, NULL if nothing can be skipped
+    const struct iovec *delta_iov;
+    int delta_iovcnt;
+    // media sequence number of the open segment
+    int msn;
+    // parts of the open segment
+    int nb_parts;
+    int target_duration;
+} M3U8Update;
+
+/**
+ * called with the rendered live playlist on every update, the buffers
+ * are only valid during the call.
+ */
+typedef void (*M3U8UpdateCallback)(void *opaque, const M3U8Update *update);
+
+typedef struct {
+    // segment duration in seconds
+    int duration;
+    int version;
+    // slices kept in live playlist
+    int window;
+    // vod playlist keeps all slices and ends with EXT-X-ENDLIST, window is unused
+    int vod;
+    // M3U8_TARGET_*
+    int target_round;
+    // max part duration in ms, live playlist is ll-hls if larger than zero
+    int part_target;
+    // playlist published to on_update is served with blocking reload
+    int can_block_reload;
+    // delta playlist is rendered for on_update, only served playlists advertise skipping
+    int can_skip;
+    M3U8UpdateCallback on_update;
+    void *opaque;
+} M3U8Options;
+
+typedef struct {
+    char *data;
+    int size;
+    int capacity;
+} M3U8Buffer;
+
 typedef struct {
+    // segment file the part is a byte range of
+    const char *uri;
+    int64_t offset;
+    int64_t length;
+    // ms
     int duration;
-    char path[128];
+    // part starts with a key frame
+    int independent;
+} M3U8Part;
+
+typedef struct {
+    int duration;
+    char *path;
+    char *map;
+    int discontinuity;
+    // position of the pre-rendered lines of this slice in body, counted
+    // from the first byte ever rendered
+    int64_t line_pos;
+    int line_size;
+    // DISCONTINUITY and MAP lines ahead of EXTINF, parts are put after them
+    int prefix_size;
+    // the lines start with EXT-X-MAP of this slice
+    int has_map_line;
+    // rendered EXT-X-PART lines of this slice
+    M3U8Buffer parts;
 } M3U8Slice;
 
 typedef struct {
     int discontinuity_before;
+    // init segment of fmp4 slice, NULL for ts
+    const char *map;
 } M3U8SliceProps;
 
 typedef struct {
     int duration;
+    int version;
+    int target_round;
     int sequence;
-    M3U8Slice slice[SLICE_NUM];
+    int discontinuity_sequence;
+
+    // ring of window slices, slice[sequence % window] is the next one,
+    // zero for vod, whose body keeps all slices
+    int window;
+    M3U8Slice *slice;
+    // last EXT-X-MAP written to vod playlist
+    char *vod_map;
+
+    // rendered lines of slices in window, [body_start, body_end)
+    char *body;
+    int body_start;
+    int body_end;
+    int body_capacity;
+    // position of body[0] counted from the first byte ever rendered
+    int64_t body_base;
+
+    // ll-hls, parts of the segment being written
+    int part_target;
+    M3U8Buffer open_parts;
+    int open_part_count;
+    char *open_uri;
+    int64_t open_next;
+
+    int can_block_reload;
+    int can_skip;
+    M3U8UpdateCallback on_update;
+    void *opaque;
 } M3U8Context;
 
+void m3u8_get_default_options(M3U8Options *opts);
+
 void m3u8_get_default_slice_props(M3U8SliceProps *props);
 
-int m3u8_begin(const char *filename, int duration, M3U8Context *ctx);
+/**
+ * initialize ctx for a live or vod playlist as opts->vod, ctx is passed
+ * to the other calls and freed by m3u8_end.
+ */
+int m3u8_begin(const char *filename, M3U8Options *opts, M3U8Context *ctx);
 
 int m3u8_input_slice(const char *filename, const char *slice, int duration, M3U8Context *ctx, M3U8SliceProps *props);
 
+/**
+ * add a part of the segment being written to a live ll-hls playlist,
+ * the segment itself is added by m3u8_input_slice when it is finished.
+ */
+int m3u8_input_part(const char *filename, M3U8Context *ctx, M3U8Part *part);
+
 int m3u8_end(const char *filename, M3U8Context *ctx);
 
-#endif
\ No newline at end of file
+// one rendition of master playlist, zero or NULL attributes are omitted
+typedef struct {
+    const char *uri;
+    int bandwidth;
+    int average_bandwidth;
+    int width;
+    int height;
+    const char *codecs;
+} M3U8Variant;
+
+/**
+ * publish variant as rendition name of master playlist filename. every
+ * rendition keeps its entry in <filename>.<name>.inf and the master is
+ * rebuilt from all of them under a lock, so aligned renditions running in
+ * separate processes share one master playlist. NULL variant removes it.
+ */
+int m3u8_update_master(const char *filename, const char *name, const M3U8Variant *variant);
+
+#endif
@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <pthread.h>
 #include <libgen.h>
+#include <sys/stat.h>
 #include "libavutil/avstring.h"
 #include "libavutil/mem.h"
 #include "seg.h"
@@ -13,6 +14,8 @@
 #include "m3u8.h"
 #include "notify.h"
 #include "srs_librtmp.h"
+#include "hls_server.h"
+#include "metrics.h"
 
 #define M3U8_VOD 1
 #define M3U8_LIVE 2
@@ -25,10 +28,29 @@ static int g_log_level = LOG_INFO;
 static int g_enable_m3u8 = 0;
 static char m3u8_filename[1024] = {0};
 static M3U8Context *m3u8_context = NULL;
+static const char *g_hls_listen = NULL;
+static const char *g_metrics_listen = NULL;
+
+// BANDWIDTH is the peak of the last segments
+#define MASTER_PEAK_WINDOW 10
+// bitrates are rounded to it, so the master is not rewritten on every segment
+#define MASTER_BANDWIDTH_STEP 10000
+
+typedef struct {
+    int64_t bitrates[MASTER_PEAK_WINDOW];
+    int nb_segments;
+    int64_t total_bytes;
+    int64_t total_duration;
+    // last published variant
+    M3U8Variant variant;
+    char codecs[SEG_CODEC_TAG_SIZE * 2];
+} MasterState;
+static MasterState g_master = {{0}};
 
 static int g_flv_mod = 0;
 static int g_rptp_mod = 0;
 static int g_hds_mod = 0;
+static int g_ts_mod = 0;
 
 static int g_statis_notify = 0;
 static int64_t g_statis_time = 0;
@@ -55,6 +77,7 @@ static void display_usage()
     printf("\t-M --generate-m3u8 LIVE\n");
     printf("\t-f --flv generate flv segments\n");
     printf("\t-r --rptp generate rptp segments\n");
+    printf("\t --native-ts generate ts segments from rtmp without libavformat, h.264 with aac or mp3 only\n");
     printf("\t-F --flv-meta generate flv segments with metadata ahead\n");
     printf("\t-a --align support multi bitrate\n");
     printf("\t-A --align support multi bitrate and sync sequence number\n");
@@ -65,6 +88,9 @@ static void display_usage()
     printf("\t-w --work-around can be: cra hevcaud\n");
     printf("\t-L --lhls use lhls mode\n");
     printf("\t-C --chunk-duration chunk duration in ms for lhls mode\n");
+    printf("\t --fmp4 generate fragmented mp4 segments with init segment, one fragment per lhls chunk\n");
+    printf("\t --hls-server [ADDR:]PORT serve the live m3u8 with blocking playlist reload\n");
+    printf("\t --metrics [ADDR:]PORT|unix:PATH serve prometheus metrics on /metrics\n");
     printf("\t --custom customized options, a=xxx:b=xxx for further customized demands\n");
     printf("\t-h --help\n");
     exit(0);
@@ -260,6 +286,39 @@ static int set_custom_args(SegParams *params, const char *key, const char *value
             params->flv_seg_flags &= ~FLV_SEG_FLAGS_INTERLEAVE_PKTS;
             logger(LOG_WARN, "set flv seg non force interleave mode");
         }
+    } else if(!strcmp(key, "fast_start_ms")) {
+        params->fast_start_ms = atoi(value);
+        logger(LOG_WARN, "set fast_start_ms=%d", params->fast_start_ms);
+    } else if(!strcmp(key, "rtmp_recv_buffer")) {
+        params->rtmp_recv_buffer = atoi(value);
+        logger(LOG_WARN, "set rtmp_recv_buffer=%d", params->rtmp_recv_buffer);
+    } else if(!strcmp(key, "rtmp_merge_read_ms")) {
+        params->rtmp_merge_read_ms = atoi(value);
+        logger(LOG_WARN, "set rtmp_merge_read_ms=%d", params->rtmp_merge_read_ms);
+    } else if(!strcmp(key, "rtmp_dns_cache")) {
+        params->rtmp_dns_cache = av_strdup(value);
+        logger(LOG_WARN, "set rtmp_dns_cache=%s", params->rtmp_dns_cache);
+    } else if(!strcmp(key, "rtmp_pipeline")) {
+        params->rtmp_pipeline = atoi(value);
+        logger(LOG_WARN, "set rtmp_pipeline=%d", params->rtmp_pipeline);
+    } else if(!strcmp(key, "reconnect_ms")) {
+        params->reconnect_ms = atoi(value);
+        logger(LOG_WARN, "set reconnect_ms=%d", params->reconnect_ms);
+    } else if(!strcmp(key, "backup_url")) {
+        params->backup_url = av_strdup(value);
+        logger(LOG_WARN, "set backup_url=%s", params->backup_url);
+    } else if(!strcmp(key, "failover_ms")) {
+        params->failover_ms = atoi(value);
+        logger(LOG_WARN, "set failover_ms=%d", params->failover_ms);
+    } else if(!strcmp(key, "stage_hist")) {
+        params->stage_hist = atoi(value);
+        logger(LOG_WARN, "set stage_hist=%d", params->stage_hist);
+    } else if(!strcmp(key, "packet_trace")) {
+        params->packet_trace = av_strdup(value);
+        logger(LOG_WARN, "set packet_trace=%s", params->packet_trace);
+    } else if(!strcmp(key, "packet_trace_records")) {
+        params->packet_trace_records = atoi(value);
+        logger(LOG_WARN, "set packet_trace_records=%d", params->packet_trace_records);
     } else if(!strcmp(key, "probe_gop_ms")) {
         params->probe_gop = atoi(value);
         logger(LOG_WARN, "set probe gop ms to %d", params->probe_gop);
@@ -272,6 +331,21 @@ static int set_custom_args(SegParams *params, const char *key, const char *value
     } else if(!strcmp(key, "cb_discontinuity")) {
         params->do_judge_discontinuity = atoi(value);
         logger(LOG_WARN, "set do_judge_discontinuity=%s", params->do_judge_discontinuity ? "true" : "false");
+    } else if(!strcmp(key, "m3u8_window")) {
+        params->m3u8_window = atoi(value);
+        logger(LOG_WARN, "set m3u8_window=%d", params->m3u8_window);
+    } else if(!strcmp(key, "master_playlist")) {
+        params->master_playlist = av_strdup(value);
+        logger(LOG_WARN, "set master_playlist=%s", params->master_playlist);
+    } else if(!strcmp(key, "m3u8_target_round")) {
+        if(!strcmp(value, "ceil")) {
+            params->m3u8_target_round = M3U8_TARGET_CEIL;
+        } else if(!strcmp(value, "nearest")) {
+            params->m3u8_target_round = M3U8_TARGET_NEAREST;
+        } else {
+            params->m3u8_target_round = M3U8_TARGET_PAD;
+        }
+        logger(LOG_WARN, "set m3u8_target_round=%d", params->m3u8_target_round);
     } else {
         logger(LOG_ERROR, "unknown custom param [key]%s [value]%s", key, value);
         return -1;
@@ -331,6 +405,10 @@ static void parse_opt(int argc, char *argv[])
 {
     int lopt;
 #define LOPT_CUSTOM (1001)
+#define LOPT_NATIVE_TS (1002)
+#define LOPT_FMP4 (1003)
+#define LOPT_HLS_SERVER (1004)
+#define LOPT_METRICS (1005)
     const char *optstring = "c:i:d:D:p:t:l:g:u:N:o:w:C:nfrFHsmMhvaATL";
     const struct option opts[] = {
         {"continue-abst",   required_argument, NULL, 'c'},
@@ -361,6 +439,10 @@ static void parse_opt(int argc, char *argv[])
         {"copyts",          no_argument, NULL, 'T'},
         {"lhls",            no_argument, NULL, 'L'},
         {"custom",          required_argument, &lopt, LOPT_CUSTOM},
+        {"native-ts",       no_argument, &lopt, LOPT_NATIVE_TS},
+        {"fmp4",            no_argument, &lopt, LOPT_FMP4},
+        {"hls-server",      required_argument, &lopt, LOPT_HLS_SERVER},
+        {"metrics",         required_argument, &lopt, LOPT_METRICS},
         {0, 0, 0, 0}
     };
 
@@ -390,6 +472,27 @@ static void parse_opt(int argc, char *argv[])
                         }
                         break;
                     }
+                    case LOPT_NATIVE_TS : {
+                        g_params.is_native_ts = 1;
+                        g_ts_mod = 1;
+                        logger(LOG_INFO, "use native ts mod");
+                        break;
+                    }
+                    case LOPT_FMP4 : {
+                        g_params.seg_format = SEG_FORMAT_FMP4;
+                        logger(LOG_INFO, "use fmp4 segment format");
+                        break;
+                    }
+                    case LOPT_HLS_SERVER : {
+                        g_hls_listen = optarg;
+                        logger(LOG_INFO, "serve live m3u8 on %s", g_hls_listen);
+                        break;
+                    }
+                    case LOPT_METRICS : {
+                        g_metrics_listen = optarg;
+                        logger(LOG_INFO, "serve metrics on %s", g_metrics_listen);
+                        break;
+                    }
                     default:
                         logger(LOG_ERROR, "unknown param with lopt %d", lopt);
                         break;
@@ -540,6 +643,7 @@ static void parse_opt(int argc, char *argv[])
                 break;
             }
             case 'f': {
+                g_params.is_flv = 1;
                 g_flv_mod = 1;
                 logger(LOG_INFO, "use flv mod");
                 break;
@@ -552,6 +656,7 @@ static void parse_opt(int argc, char *argv[])
             }
             case 'F': {
                 g_params.flv_meta = 1;
+                g_params.is_flv = 1;
                 g_flv_mod = 1;
                 logger(LOG_INFO, "use flv mod with metadata ahead");
                 break;
@@ -571,12 +676,143 @@ static void parse_opt(int argc, char *argv[])
     } while(opt != -1);
 }
 
+static void m3u8_update_callback(void *opaque, const M3U8Update *update)
+{
+    hls_server_publish(update);
+}
+
+static void m3u8_prepare(SegHandler *sh)
+{
+    if (strlen(m3u8_filename) == 0) {
+        M3U8Options opts;
+
+        snprintf(m3u8_filename, sizeof(m3u8_filename) - 1, "%s.m3u8", g_params.name);
+        m3u8_context = (M3U8Context *) malloc(sizeof(M3U8Context));
+        m3u8_get_default_options(&opts);
+        opts.vod = M3U8_VOD == g_enable_m3u8;
+        opts.duration = sh->params.duration;
+        opts.version = sh->params.seg_format == SEG_FORMAT_FMP4 ? M3U8_VERSION_FMP4 : M3U8_VERSION_DEFAULT;
+        if (sh->params.m3u8_window > 0) {
+            opts.window = sh->params.m3u8_window;
+        }
+        opts.target_round = sh->params.m3u8_target_round;
+        if (sh->params.is_lhls) {
+            // the planner never cuts a chunk longer than its higher border
+            opts.part_target = sh->params.chunk_duration_higher_ms > 0 ?
+                sh->params.chunk_duration_higher_ms : sh->params.chunk_duration_ms * 3 / 2;
+        }
+        if (g_hls_listen) {
+            opts.can_block_reload = 1;
+            opts.can_skip = 1;
+            opts.on_update = m3u8_update_callback;
+        }
+        m3u8_begin(m3u8_filename, &opts, m3u8_context);
+    }
+}
+
+// add the chunk just finished as a ll-hls part of the live playlist
+static void m3u8_input_chunk(SegHandler *sh)
+{
+    M3U8Part part;
+
+    if (M3U8_LIVE != g_enable_m3u8 || !sh->params.is_lhls || sh->params.no_playlist ||
+        sh->chunk_end <= sh->chunk_start) {
+        return;
+    }
+    m3u8_prepare(sh);
+
+    memset(&part, 0, sizeof(part));
+    part.uri = basename(sh->file);
+    part.offset = sh->chunk_start;
+    part.length = sh->chunk_end - sh->chunk_start;
+    part.duration = (int)(sh->chunk_duration / 1000);
+    part.independent = (sh->curr_chunk_flag & CURR_CHUNK_FLAG_KEY_IN_HEAD) ? 1 : 0;
+    m3u8_input_part(m3u8_filename, m3u8_context, &part);
+}
+
+// update the entry of this rendition in master playlist when it changes
+static void master_update(SegHandler *sh, int last)
+{
+    SegRendition *rendition = &sh->statis.rendition;
+    M3U8Variant variant;
+    char codecs[SEG_CODEC_TAG_SIZE * 2];
+    struct stat st;
+    int64_t peak = 0;
+    int i;
+
+    if (!sh->params.master_playlist) {
+        return;
+    }
+    if (last && M3U8_LIVE == g_enable_m3u8) {
+        // the live rendition is gone
+        m3u8_update_master(sh->params.master_playlist, basename(m3u8_filename), NULL);
+        return;
+    }
+    if (sh->duration <= 0 || stat(sh->file, &st) != 0) {
+        return;
+    }
+
+    // bytes actually written, container overhead included
+    g_master.bitrates[g_master.nb_segments % MASTER_PEAK_WINDOW] = st.st_size * 8 * 1000000 / sh->duration;
+    g_master.nb_segments++;
+    g_master.total_bytes += st.st_size;
+    g_master.total_duration += sh->duration;
+    for (i = 0; i < MASTER_PEAK_WINDOW && i < g_master.nb_segments; i++) {
+        if (g_master.bitrates[i] > peak) {
+            peak = g_master.bitrates[i];
+        }
+    }
+
+    memset(&variant, 0, sizeof(variant));
+    variant.uri = basename(m3u8_filename);
+    variant.bandwidth = (peak + MASTER_BANDWIDTH_STEP - 1) / MASTER_BANDWIDTH_STEP * MASTER_BANDWIDTH_STEP;
+    variant.average_bandwidth = (g_master.total_bytes * 8 * 1000000 / g_master.total_duration +
+        MASTER_BANDWIDTH_STEP / 2) / MASTER_BANDWIDTH_STEP * MASTER_BANDWIDTH_STEP;
+    variant.width = rendition->video_width;
+    variant.height = rendition->video_height;
+    snprintf(codecs, sizeof(codecs), "%s%s%s", rendition->video_codec,
+        rendition->video_codec[0] && rendition->audio_codec[0] ? "," : "", rendition->audio_codec);
+    variant.codecs = codecs;
+
+    if (variant.bandwidth == g_master.variant.bandwidth &&
+        variant.average_bandwidth == g_master.variant.average_bandwidth &&
+        variant.width == g_master.variant.width && variant.height == g_master.variant.height &&
+        !strcmp(codecs, g_master.codecs)) {
+        return;
+    }
+
+    logger(LOG_INFO, "update master %s: bandwidth %d average %d resolution %dx%d codecs %s",
+        sh->params.master_playlist, variant.bandwidth, variant.average_bandwidth,
+        variant.width, variant.height, codecs);
+    if (m3u8_update_master(sh->params.master_playlist, variant.uri, &variant) == 0) {
+        g_master.variant = variant;
+        snprintf(g_master.codecs, sizeof(g_master.codecs), "%s", codecs);
+        g_master.variant.codecs = g_master.codecs;
+    }
+}
+
+// publish time of latency minus arrival in ms, -1 if nothing arrived
+static int64_t latency_ms(const SegLatency *latency, int64_t arrival)
+{
+    return arrival > 0 ? (latency->publish_time - arrival) / 1000 : -1;
+}
+
 static void notify_callback(SegHandler *sh, int last) 
 {
-    logger(LOG_INFO, "notify: tid[%s] file[%s] duration[%lldms] last[%d] flags[%08x]",
-        sh->params.tid, sh->file, sh->duration/1000, last, sh->flags);
+    const SegLatency *latency = &sh->seg_data.latency;
+
+    logger(LOG_INFO, "notify: tid[%s] file[%s] duration[%lldms] last[%d] flags[%08x] latency[%lldms]",
+        sh->params.tid, sh->file, sh->duration/1000, last, sh->flags,
+        latency_ms(latency, latency->first_arrival));
     if (sh->params.nurl) {
         SegmentNotify segment = {};
+        segment.file = sh->file;
+        segment.index = sh->index;
+        segment.duration = sh->duration;
+        segment.last = last;
+        segment.flags = sh->flags;
+        segment.latency_first_ms = latency_ms(latency, latency->first_arrival);
+        segment.latency_last_ms = latency_ms(latency, latency->last_arrival);
 
         if(!sh->params.is_lhls) {
             segment_notify(sh->params.nurl, sh->params.tid, &segment);
@@ -585,20 +821,20 @@ static void notify_callback(SegHandler *sh, int last)
         }
     }
 
-    if(g_enable_m3u8) {
+    if(g_enable_m3u8 && !sh->params.no_playlist) {
         M3U8SliceProps slice_props;
-        if (strlen(m3u8_filename) == 0) {
-            snprintf(m3u8_filename, sizeof(m3u8_filename) - 1, "%s.m3u8", g_params.name);
-            if (M3U8_LIVE == g_enable_m3u8) {
-                m3u8_context = (M3U8Context *) malloc(sizeof(M3U8Context));
-            }
-            m3u8_begin(m3u8_filename, sh->params.duration + 1, m3u8_context);
-        }
+        m3u8_prepare(sh);
+        // the last chunk of segment is not notified by chunk_end
+        m3u8_input_chunk(sh);
         m3u8_get_default_slice_props(&slice_props);
         if(sh->discontinuity_before) {
             slice_props.discontinuity_before = 1;
         }
+        if(sh->params.seg_format == SEG_FORMAT_FMP4) {
+            slice_props.map = basename(sh->init_file);
+        }
         m3u8_input_slice(m3u8_filename, basename(sh->file), (int)(sh->duration / 1000), m3u8_context, &slice_props);
+        master_update(sh, last);
         if(last) {
             m3u8_end(m3u8_filename, m3u8_context);
             if(m3u8_context) {
@@ -611,19 +847,90 @@ static void notify_callback(SegHandler *sh, int last)
 
 static void chunk_notify_callback(SegHandler *sh) 
 {
-    logger(LOG_INFO, "chunk notify: tid[%s] file[%s] duration[%lldms]",
-        sh->params.tid, sh->file, sh->chunk_duration / 1000);
+    const SegLatency *latency = &sh->chunk_data.latency;
+
+    logger(LOG_INFO, "chunk notify: tid[%s] file[%s] duration[%lldms] latency[%lldms]",
+        sh->params.tid, sh->file, sh->chunk_duration / 1000,
+        latency_ms(latency, latency->first_arrival));
     if(sh->params.nurl) {
         ChunkNotify chunk = {};
+        chunk.file = sh->file;
+        chunk.index = sh->index;
+        chunk.chunk_index = sh->chunk_index;
+        chunk.duration = sh->chunk_duration;
+        chunk.latency_first_ms = latency_ms(latency, latency->first_arrival);
+        chunk.latency_last_ms = latency_ms(latency, latency->last_arrival);
         if(sh->params.is_lhls) {
             chunk_notify_pipe(sh->params.nurl, sh->params.tid, &chunk);
         }
     }
+    m3u8_input_chunk(sh);
+}
+
+// counters at the start of the window and of the last period
+static StreamStatis g_window_vss, g_window_ass, g_period_vss, g_period_ass;
+static int64_t g_window_time, g_period_time;
+static int64_t g_peak_vbitrate, g_peak_abitrate;
+
+static void fill_statis_stream(StatisStream *ss, const StreamStatis *curr, const StreamStatis *start, int64_t duration)
+{
+    ss->in_frames = curr->in_frames - start->in_frames;
+    ss->out_frames = curr->out_frames - start->out_frames;
+    ss->in_bitrate = duration > 0 ? (curr->in_bytes - start->in_bytes) * 8 * AV_TIME_BASE / duration : 0;
+    ss->out_bitrate = duration > 0 ? (curr->out_bytes - start->out_bytes) * 8 * AV_TIME_BASE / duration : 0;
+    ss->fps = duration > 0 ? (double)ss->in_frames * AV_TIME_BASE / duration : 0;
+    ss->drop_rate = ss->in_frames > 0 ? (double)(ss->in_frames - ss->out_frames) / ss->in_frames : 0;
+}
+
+static int64_t period_bitrate(const StreamStatis *curr, const StreamStatis *last, int64_t duration)
+{
+    return duration > 0 ? (curr->in_bytes - last->in_bytes) * 8 * AV_TIME_BASE / duration : 0;
 }
 
+/**
+ * called every STATIS_PERIOD, statis is filled with the window of count + 1 periods.
+ */
 static void fill_statis(SegHandler *sh, StatisNotify *statis, int count) 
 {
+    const SegStatis *ss = &sh->statis;
+    int64_t now = av_gettime();
+    int64_t v, a;
+
+    if (count == 0) {
+        g_peak_vbitrate = 0;
+        g_peak_abitrate = 0;
+    }
+    v = period_bitrate(&ss->vss, &g_period_vss, now - g_period_time);
+    a = period_bitrate(&ss->ass, &g_period_ass, now - g_period_time);
+    g_peak_vbitrate = FFMAX(g_peak_vbitrate, v);
+    g_peak_abitrate = FFMAX(g_peak_abitrate, a);
+    g_period_vss = ss->vss;
+    g_period_ass = ss->ass;
+    g_period_time = now;
+
     statis->url = sh->params.url;
+    statis->live_streamid = ss->live_streamid;
+    statis->time = now;
+    statis->duration = now - g_window_time;
+    statis->uptime = ss->start_time ? now - ss->start_time : 0;
+    statis->gop = ss->gop;
+    statis->first_write_ms = ss->first_write_time ? (ss->first_write_time - ss->start_time) / 1000 : -1;
+    statis->startup = ss->startup;
+    statis->reconnects = ss->reconnects;
+    statis->has_standby = sh->params.backup_url != NULL;
+    statis->standby = ss->standby;
+    fill_statis_stream(&statis->video, &ss->vss, &g_window_vss, statis->duration);
+    fill_statis_stream(&statis->audio, &ss->ass, &g_window_ass, statis->duration);
+    statis->video.peak_bitrate = g_peak_vbitrate;
+    statis->audio.peak_bitrate = g_peak_abitrate;
+}
+
+// the next window starts from the counters of now
+static void reset_statis_window(SegHandler *sh)
+{
+    g_window_vss = g_period_vss = sh->statis.vss;
+    g_window_ass = g_period_ass = sh->statis.ass;
+    g_window_time = g_period_time = av_gettime();
 }
 
 static void timer_callback(SegHandler *sh) 
@@ -631,6 +938,7 @@ static void timer_callback(SegHandler *sh)
     int64_t now_time = av_gettime();
     if(g_statis_time == 0) {
         g_statis_time = now_time + STATIS_PERIOD;
+        reset_statis_window(sh);
     }
     if(now_time >= g_statis_time) {
         fill_statis(sh, &g_statis, g_statis_count);
@@ -644,6 +952,7 @@ static void timer_callback(SegHandler *sh)
                 }
             }
             g_statis_count = 0;
+            reset_statis_window(sh);
         }
         g_statis_time += STATIS_PERIOD;
     }
@@ -749,19 +1058,38 @@ int main(int argc, char* argv[])
 
     catch_signal();
 
+    // started after catch_signal, so it inherits the blocked signals
+    if (g_hls_listen && M3U8_LIVE == g_enable_m3u8) {
+        if (hls_server_start(g_hls_listen) != 0) {
+            logger(LOG_ERROR, "start hls server on %s fail", g_hls_listen);
+        }
+    }
+    if (g_metrics_listen) {
+        if (metrics_start(g_metrics_listen, g_params.tid) != 0) {
+            logger(LOG_ERROR, "start metrics on %s fail", g_metrics_listen);
+        }
+    }
+
     seg_init(&g_seg, &g_params);
 
     srs_initialize();
 
     int ret = 0;
-    if(g_flv_mod == 1 || g_hds_mod == 1 || g_rptp_mod == 1) {
+    if(g_flv_mod == 1 || g_hds_mod == 1 || g_rptp_mod == 1 || g_ts_mod == 1) {
         ret = flv_seg_run(&g_seg);
     } else {
+        if (g_params.backup_url) {
+            logger(LOG_WARN, "backup_url is only supported by the flv path");
+        }
         ret = seg_run(&g_seg);
     }
 
     seg_uninit(&g_seg, &g_params);
 
+    hls_server_stop();
+    metrics_stop();
+    notify_stop();
+
     logger(LOG_INFO, "live stream segmenter ret: %d", ret);
 
     logger_uninit();
@@ -0,0 +1,382 @@
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_UNIX_PREFIX "unix:"
+
+Metrics g_metrics;
+
+static const char *stream_names[METRICS_STREAM_MAX] = {
+    "video", "audio", "other"
+};
+
+static const char *standby_names[METRICS_STANDBY_INPUTS] = {
+    "primary", "backup"
+};
+
+static int g_listen_fd = -1;
+static pthread_t g_accept_thread;
+static char g_unix_path[108];
+// tid escaped as a label value
+static char g_tid[256];
+
+static int metrics_send_all(int fd, const char *buf, int size)
+{
+    int pos = 0;
+    while (pos < size) {
+        ssize_t n = send(fd, buf + pos, size - pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+static void metrics_send_status(int fd, int code, const char *reason)
+{
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n", code, reason);
+    metrics_send_all(fd, buf, n);
+}
+
+static void metrics_escape_label(const char *str, char *buf, int size)
+{
+    int n = 0;
+
+    for (; str && *str && n + 2 < size; str++) {
+        if (*str == '\\' || *str == '"') {
+            buf[n++] = '\\';
+            buf[n++] = *str;
+        } else if (*str == '\n') {
+            buf[n++] = '\\';
+            buf[n++] = 'n';
+        } else {
+            buf[n++] = *str;
+        }
+    }
+    buf[n] = '\0';
+}
+
+// append to buf of size at len, return the new length
+static int metrics_append(char *buf, int size, int len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (len >= size) {
+        return len;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    return n < 0 ? len : len + n;
+}
+
+static int metrics_header(char *buf, int size, int len, const char *name, const char *type, const char *help)
+{
+    return metrics_append(buf, size, len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// a sample of each stream, offset is the field in MetricsStream
+static int metrics_streams(char *buf, int size, int len, const char *name, const char *help, size_t offset)
+{
+    int i;
+
+    len = metrics_header(buf, size, len, name, "counter", help);
+    for (i = 0; i < METRICS_STREAM_MAX; i++) {
+        uint64_t *counter = (uint64_t *)((char *)&g_metrics.streams[i] + offset);
+        len = metrics_append(buf, size, len, "%s{tid=\"%s\",type=\"%s\"} %llu\n",
+            name, g_tid, stream_names[i], (unsigned long long)__atomic_load_n(counter, __ATOMIC_RELAXED));
+    }
+    return len;
+}
+
+static int metrics_counter(char *buf, int size, int len, const char *name, const char *help, uint64_t *counter)
+{
+    len = metrics_header(buf, size, len, name, "counter", help);
+    return metrics_append(buf, size, len, "%s{tid=\"%s\"} %llu\n",
+        name, g_tid, (unsigned long long)__atomic_load_n(counter, __ATOMIC_RELAXED));
+}
+
+static int metrics_gauge(char *buf, int size, int len, const char *name, const char *help, double value)
+{
+    len = metrics_header(buf, size, len, name, "gauge", help);
+    return metrics_append(buf, size, len, "%s{tid=\"%s\"} %g\n", name, g_tid, value);
+}
+
+static int metrics_latency(char *buf, int size, int len, const char *name, const char *help, MetricsLatency *latency)
+{
+    char last[128];
+
+    snprintf(last, sizeof(last), "%s_last", name);
+    len = metrics_header(buf, size, len, last, "gauge", help);
+    len = metrics_append(buf, size, len, "%s{tid=\"%s\"} %g\n",
+        last, g_tid, __atomic_load_n(&latency->last_us, __ATOMIC_RELAXED) / 1e6);
+    len = metrics_header(buf, size, len, name, "summary", help);
+    len = metrics_append(buf, size, len, "%s_sum{tid=\"%s\"} %g\n",
+        name, g_tid, __atomic_load_n(&latency->sum_us, __ATOMIC_RELAXED) / 1e6);
+    return metrics_append(buf, size, len, "%s_count{tid=\"%s\"} %llu\n",
+        name, g_tid, (unsigned long long)__atomic_load_n(&latency->count, __ATOMIC_RELAXED));
+}
+
+static int metrics_standby(char *buf, int size, int len)
+{
+    int i;
+
+    len = metrics_gauge(buf, size, len, "lss_standby_active_input", "Standby input read, 0 for the primary.",
+        __atomic_load_n(&g_metrics.standby_active, __ATOMIC_RELAXED));
+    len = metrics_counter(buf, size, len, "lss_standby_switches_total", "Switches between the standby inputs.",
+        &g_metrics.standby_switches);
+    len = metrics_header(buf, size, len, "lss_standby_lag_seconds", "gauge",
+        "Arrival lag of the standby inputs behind their timestamps.");
+    for (i = 0; i < METRICS_STANDBY_INPUTS; i++) {
+        len = metrics_append(buf, size, len, "lss_standby_lag_seconds{tid=\"%s\",input=\"%s\"} %g\n",
+            g_tid, standby_names[i], __atomic_load_n(&g_metrics.standby_lag_ms[i], __ATOMIC_RELAXED) / 1e3);
+    }
+    return len;
+}
+
+static int metrics_format(char *buf, int size)
+{
+    int len = 0;
+
+    len = metrics_streams(buf, size, len, "lss_packets_in_total", "Frames read from input.",
+        offsetof(MetricsStream, packets_in));
+    len = metrics_streams(buf, size, len, "lss_bytes_in_total", "Bytes of frames read from input.",
+        offsetof(MetricsStream, bytes_in));
+    len = metrics_streams(buf, size, len, "lss_packets_out_total", "Frames written to output.",
+        offsetof(MetricsStream, packets_out));
+    len = metrics_streams(buf, size, len, "lss_bytes_out_total", "Bytes of frames written to output.",
+        offsetof(MetricsStream, bytes_out));
+    len = metrics_counter(buf, size, len, "lss_segments_total", "Segments produced.",
+        &g_metrics.segments);
+    len = metrics_counter(buf, size, len, "lss_chunks_total", "Lhls chunks produced.",
+        &g_metrics.chunks);
+    len = metrics_counter(buf, size, len, "lss_write_errors_total", "Failed output writes.",
+        &g_metrics.write_errors);
+    len = metrics_counter(buf, size, len, "lss_filter_errors_total", "Failed bitstream filters.",
+        &g_metrics.filter_errors);
+    len = metrics_counter(buf, size, len, "lss_timestamp_warnings_total", "Non monotonic dts or pts.",
+        &g_metrics.timestamp_warnings);
+    len = metrics_gauge(buf, size, len, "lss_base_stream_missing", "1 while the base stream is missing.",
+        __atomic_load_n(&g_metrics.base_missing, __ATOMIC_RELAXED));
+    len = metrics_gauge(buf, size, len, "lss_segment_duration_seconds", "Duration of the open segment.",
+        __atomic_load_n(&g_metrics.segment_duration_us, __ATOMIC_RELAXED) / 1e6);
+    len = metrics_gauge(buf, size, len, "lss_notify_latency_seconds", "Time of the last segment or chunk notify.",
+        __atomic_load_n(&g_metrics.notify_latency_us, __ATOMIC_RELAXED) / 1e6);
+    len = metrics_header(buf, size, len, "lss_log_dropped_total", "counter", "Log records dropped by a full ring.");
+    len = metrics_append(buf, size, len, "lss_log_dropped_total{tid=\"%s\"} %llu\n",
+        g_tid, (unsigned long long)logger_dropped());
+    len = metrics_latency(buf, size, len, "lss_segment_availability_seconds",
+        "Segment publish time minus the arrival of its first packet.", &g_metrics.segment_latency);
+    len = metrics_latency(buf, size, len, "lss_chunk_availability_seconds",
+        "Chunk publish time minus the arrival of its first packet.", &g_metrics.chunk_latency);
+    if (__atomic_load_n(&g_metrics.standby, __ATOMIC_RELAXED)) {
+        len = metrics_standby(buf, size, len);
+    }
+    return len;
+}
+
+static void metrics_serve(int fd)
+{
+    char req[METRICS_REQUEST_SIZE];
+    char body[METRICS_RESPONSE_SIZE];
+    char header[256];
+    int size = 0;
+    int n;
+
+    // read request header, body is not expected
+    while (size < (int)sizeof(req) - 1) {
+        ssize_t r = recv(fd, req + size, sizeof(req) - 1 - size, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        size += r;
+        req[size] = '\0';
+        if (strstr(req, "\r\n\r\n")) {
+            break;
+        }
+    }
+    req[size] = '\0';
+
+    if (strncmp(req, "GET ", 4)) {
+        metrics_send_status(fd, size > 0 ? 405 : 400, size > 0 ? "Method Not Allowed" : "Bad Request");
+        return;
+    }
+    if (strncmp(req + 4, "/metrics", 8) || (req[12] != ' ' && req[12] != '?')) {
+        metrics_send_status(fd, 404, "Not Found");
+        return;
+    }
+
+    size = metrics_format(body, sizeof(body));
+    if (size >= (int)sizeof(body)) {
+        logger(LOG_ERROR, "metrics truncated, %d bytes", size);
+        size = sizeof(body) - 1;
+    }
+    n = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n\r\n", size);
+    if (metrics_send_all(fd, header, n) == 0) {
+        metrics_send_all(fd, body, size);
+    }
+}
+
+// scrapes are rare, so they are served one by one
+static void *metrics_accept_thread(void *arg)
+{
+    while (1) {
+        int fd = accept(g_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // closed by metrics_stop
+            break;
+        }
+
+        struct timeval tv = {METRICS_RECV_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        metrics_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int metrics_listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        logger(LOG_ERROR, "metrics socket path too long %s", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_listen_fd < 0) {
+        logger(LOG_ERROR, "create metrics socket fail, errno %d", errno);
+        return -1;
+    }
+    // left by a previous run
+    unlink(path);
+    if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(g_listen_fd, 16) < 0) {
+        logger(LOG_ERROR, "listen metrics %s fail, errno %d", path, errno);
+        close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+    strcpy(g_unix_path, path);
+    return 0;
+}
+
+static int metrics_listen_tcp(const char *listen_addr)
+{
+    struct sockaddr_in addr;
+    const char *colon = strrchr(listen_addr, ':');
+    int port = atoi(colon ? colon + 1 : listen_addr);
+    int on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (colon) {
+        char host[64];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - listen_addr), listen_addr);
+        if (host[0] && inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+            logger(LOG_ERROR, "invalid metrics address %s", listen_addr);
+            return -1;
+        }
+    }
+    if (port <= 0 || port > 65535) {
+        logger(LOG_ERROR, "invalid metrics port %s", listen_addr);
+        return -1;
+    }
+
+    g_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (g_listen_fd < 0) {
+        logger(LOG_ERROR, "create metrics socket fail, errno %d", errno);
+        return -1;
+    }
+    setsockopt(g_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(g_listen_fd, 16) < 0) {
+        logger(LOG_ERROR, "listen metrics %s fail, errno %d", listen_addr, errno);
+        close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int metrics_start(const char *listen_addr, const char *tid)
+{
+    int ret;
+
+    metrics_escape_label(tid, g_tid, sizeof(g_tid));
+    if (!strncmp(listen_addr, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX))) {
+        ret = metrics_listen_unix(listen_addr + strlen(METRICS_UNIX_PREFIX));
+    } else {
+        ret = metrics_listen_tcp(listen_addr);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (pthread_create(&g_accept_thread, NULL, metrics_accept_thread, NULL) != 0) {
+        logger(LOG_ERROR, "create metrics thread fail");
+        metrics_stop();
+        return -1;
+    }
+
+    logger(LOG_INFO, "metrics listen on %s", listen_addr);
+    return 0;
+}
+
+void metrics_stop()
+{
+    if (g_listen_fd < 0) {
+        return;
+    }
+
+    shutdown(g_listen_fd, SHUT_RDWR);
+    close(g_listen_fd);
+    if (g_accept_thread) {
+        pthread_join(g_accept_thread, NULL);
+        g_accept_thread = 0;
+    }
+    g_listen_fd = -1;
+    if (g_unix_path[0]) {
+        unlink(g_unix_path);
+        g_unix_path[0] = '\0';
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+#define METRICS_REQUEST_SIZE 4096
+// seconds to receive the request
+#define METRICS_RECV_TIMEOUT 5
+#define METRICS_RESPONSE_SIZE 8192
+// primary and backup of the hot standby input
+#define METRICS_STANDBY_INPUTS 2
+
+enum {
+    METRICS_STREAM_VIDEO = 0,
+    METRICS_STREAM_AUDIO,
+    METRICS_STREAM_OTHER,
+    METRICS_STREAM_MAX
+};
+
+typedef struct {
+    uint64_t packets_in;
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+} MetricsStream;
+
+// publish time minus the first packet arrival of segments or chunks
+typedef struct {
+    int64_t last_us;
+    uint64_t sum_us;
+    uint64_t count;
+} MetricsLatency;
+
+typedef struct {
+    MetricsStream streams[METRICS_STREAM_MAX];
+    uint64_t segments;
+    uint64_t chunks;
+    uint64_t write_errors;
+    uint64_t filter_errors;
+    uint64_t timestamp_warnings;
+    // gauges
+    int64_t base_missing;
+    int64_t segment_duration_us;
+    // the last segment or chunk notify
+    int64_t notify_latency_us;
+    MetricsLatency segment_latency;
+    MetricsLatency chunk_latency;
+    // hot standby, exported when it is used
+    int64_t standby;
+    int64_t standby_active;
+    uint64_t standby_switches;
+    int64_t standby_lag_ms[METRICS_STANDBY_INPUTS];
+} Metrics;
+
+// written by the segmenting thread only, so counters need no locked add
+extern Metrics g_metrics;
+
+static inline void metrics_add(uint64_t *counter, uint64_t v)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(int64_t *gauge, int64_t v)
+{
+    __atomic_store_n(gauge, v, __ATOMIC_RELAXED);
+}
+
+/**
+ * serve g_metrics in prometheus text format on listen_addr,
+ * "[addr:]port" or "unix:path". tid labels every sample.
+ */
+int metrics_start(const char *listen_addr, const char *tid);
+
+void metrics_stop();
+
+#endif
@@ -1,10 +1,40 @@
 #include "notify.h"
 #include "log.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <curl/curl.h>
 
+typedef struct NotifyJob {
+    char *url;
+    char *body;
+    // reuse the connection of the sender, for frequent notifications
+    int keepalive;
+    // of the event list
+    struct NotifyJob *next;
+} NotifyJob;
+
 static int g_on = 1;
 
+// notifications are sent by one thread, so ingest never waits for http
+static pthread_mutex_t g_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_queue_cond = PTHREAD_COND_INITIALIZER;
+// statistics, a newer one replaces the oldest when full
+static NotifyJob g_queue[NOTIFY_QUEUE_SIZE];
+static int g_queue_head = 0;
+static int g_queue_count = 0;
+// segments and chunks in order, sent before statistics and never dropped
+static NotifyJob *g_events = NULL;
+static NotifyJob *g_events_tail = NULL;
+static int g_events_count = 0;
+static int g_sender_started = 0;
+static pthread_t g_sender;
+// set by notify_stop, the sender exits when the queues are empty
+static int g_sender_stopping = 0;
+static int64_t g_queue_dropped = 0;
+
 void set_notify_flag(int flag) {
     g_on = flag;
 }
@@ -17,26 +47,22 @@ static char *curl_urlencode(const char *str)
     return v;
 }
 
-static int http_send(const char *url, const char *data) 
+static int http_perform(CURL *curl, const char *url, const char *data, int keepalive)
 {
-    if (!g_on) {
-        logger(LOG_WARN, "notify is off");
-        return 0;
+    struct curl_slist *headers = NULL;
+    if (!keepalive) {
+        headers = curl_slist_append(headers, "Connection: close");
     }
-
-    CURL *curl  = curl_easy_init();
-    if(!curl) {
-        logger(LOG_ERROR, "curl_easy_init fail");
-        return -1;
+    if (data) {
+        headers = curl_slist_append(headers, "Content-Type: application/json");
     }
 
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Connection: close");
-
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, READ_TIMEOUT);
+    // timeouts must not signal, the sender is not the main thread
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 
     if(data) {
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
@@ -55,32 +81,367 @@ static int http_send(const char *url, const char *data)
     }
 
     curl_slist_free_all(headers);
+    return (int) code;
+}
+
+static int http_send(const char *url, const char *data) 
+{
+    if (!g_on) {
+        logger(LOG_WARN, "notify is off");
+        return 0;
+    }
+
+    CURL *curl  = curl_easy_init();
+    if(!curl) {
+        logger(LOG_ERROR, "curl_easy_init fail");
+        return -1;
+    }
+
+    int code = http_perform(curl, url, data, 0);
 
     curl_easy_cleanup(curl);
-    return (int) code;
+    return code;
+}
+
+static void *notify_sender(void *arg)
+{
+    // the connection kept for keepalive jobs
+    CURL *curl = NULL;
+
+    while (1) {
+        NotifyJob job;
+
+        pthread_mutex_lock(&g_queue_lock);
+        while (g_queue_count == 0 && g_events == NULL && !g_sender_stopping) {
+            pthread_cond_wait(&g_queue_cond, &g_queue_lock);
+        }
+        if (g_queue_count == 0 && g_events == NULL) {
+            pthread_mutex_unlock(&g_queue_lock);
+            break;
+        }
+        if (g_events) {
+            NotifyJob *event = g_events;
+            g_events = event->next;
+            if (!g_events) {
+                g_events_tail = NULL;
+            }
+            g_events_count--;
+            job = *event;
+            free(event);
+        } else {
+            job = g_queue[g_queue_head];
+            g_queue_head = (g_queue_head + 1) % NOTIFY_QUEUE_SIZE;
+            g_queue_count--;
+        }
+        pthread_mutex_unlock(&g_queue_lock);
+
+        if (!job.keepalive) {
+            http_send(job.url, job.body);
+        } else if (!g_on) {
+            logger(LOG_WARN, "notify is off");
+        } else {
+            if (!curl) {
+                curl = curl_easy_init();
+            }
+            if (curl) {
+                http_perform(curl, job.url, job.body, 1);
+            } else {
+                logger(LOG_ERROR, "curl_easy_init fail");
+            }
+        }
+        free(job.url);
+        free(job.body);
+    }
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+    return NULL;
+}
+
+void notify_stop()
+{
+    pthread_mutex_lock(&g_queue_lock);
+    if (!g_sender_started || g_sender_stopping) {
+        g_sender_stopping = 1;
+        pthread_mutex_unlock(&g_queue_lock);
+        return;
+    }
+    g_sender_stopping = 1;
+    if (g_events_count > 0 || g_queue_count > 0) {
+        logger(LOG_INFO, "send %d segment and %d statis notifications before exit",
+            g_events_count, g_queue_count);
+    }
+    pthread_cond_signal(&g_queue_cond);
+    pthread_mutex_unlock(&g_queue_lock);
+
+    pthread_join(g_sender, NULL);
+}
+
+/**
+ * queue body to be posted to url, body is taken over. an event is a segment
+ * or chunk notification, which is kept until sent, others are statistics.
+ */
+static void notify_post(const char *url, char *body, int keepalive, int event)
+{
+    int64_t dropped = 0;
+    int backlog = 0;
+    NotifyJob *job;
+
+    if (event) {
+        job = calloc(1, sizeof(NotifyJob));
+        if (!job || !(job->url = strdup(url))) {
+            logger(LOG_ERROR, "alloc notify to %s fail", url);
+            free(job);
+            free(body);
+            return;
+        }
+        job->body = body;
+        job->keepalive = keepalive;
+    }
+
+    pthread_mutex_lock(&g_queue_lock);
+    if (g_sender_stopping) {
+        // the sender is gone, post in place
+        pthread_mutex_unlock(&g_queue_lock);
+        http_send(url, body);
+        if (event) {
+            free(job->url);
+            free(job);
+        }
+        free(body);
+        return;
+    }
+    if (!g_sender_started) {
+        curl_global_init(CURL_GLOBAL_ALL);
+        if (pthread_create(&g_sender, NULL, notify_sender, NULL) != 0) {
+            pthread_mutex_unlock(&g_queue_lock);
+            logger(LOG_ERROR, "create notify sender fail");
+            if (event) {
+                free(job->url);
+                free(job);
+            }
+            free(body);
+            return;
+        }
+        g_sender_started = 1;
+        // exit() of the process waits for the queued notifications too
+        atexit(notify_stop);
+    }
+    if (event) {
+        if (g_events_tail) {
+            g_events_tail->next = job;
+        } else {
+            g_events = job;
+        }
+        g_events_tail = job;
+        if (++g_events_count % NOTIFY_EVENT_BACKLOG_WARN == 0) {
+            backlog = g_events_count;
+        }
+        pthread_cond_signal(&g_queue_cond);
+        pthread_mutex_unlock(&g_queue_lock);
+
+        if (backlog) {
+            logger(LOG_WARN, "notify sender is slow, %d segment notifications waiting", backlog);
+        }
+        return;
+    }
+    if (g_queue_count == NOTIFY_QUEUE_SIZE) {
+        job = &g_queue[g_queue_head];
+        free(job->url);
+        free(job->body);
+        g_queue_head = (g_queue_head + 1) % NOTIFY_QUEUE_SIZE;
+        g_queue_count--;
+        dropped = ++g_queue_dropped;
+    }
+    job = &g_queue[(g_queue_head + g_queue_count) % NOTIFY_QUEUE_SIZE];
+    job->url = strdup(url);
+    job->body = body;
+    job->keepalive = keepalive;
+    g_queue_count++;
+    pthread_cond_signal(&g_queue_cond);
+    pthread_mutex_unlock(&g_queue_lock);
+
+    if (dropped) {
+        logger(LOG_WARN, "notify sender is slow, %lld statis notifications dropped", dropped);
+    }
+}
+
+static void json_escape(const char *str, char *buf, int size)
+{
+    int n = 0;
+
+    for (; str && *str && n + 7 < size; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(buf + n, size - n, "\\u%04x", c);
+        } else {
+            buf[n++] = c;
+        }
+    }
+    buf[n] = '\0';
+}
+
+// append to buf of size at len, return the new length
+static int json_append(char *buf, int size, int len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (len >= size) {
+        return len;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    return n < 0 ? len : len + n;
+}
+
+static int statis_stream_json(char *buf, int size, int len, const char *name, const StatisStream *ss)
+{
+    return json_append(buf, size, len,
+        ",\"%s\":{\"in\":%lld,\"out\":%lld,\"in_bitrate\":%lld,\"out_bitrate\":%lld,"
+        "\"peak_bitrate\":%lld,\"fps\":%.2f,\"drop_rate\":%.4f}",
+        name, ss->in_frames, ss->out_frames, ss->in_bitrate, ss->out_bitrate,
+        ss->peak_bitrate, ss->fps, ss->drop_rate);
+}
+
+/**
+ * serialize info to a compact json object, return NULL on error.
+ */
+static char *statis_json(const char *session, const StatisNotify *info)
+{
+    const SegStartup *st = &info->startup;
+    char tid[256];
+    char url[2048];
+    char streamid[1024];
+    int size = 2048 + sizeof(tid) + sizeof(url) + sizeof(streamid);
+    char *buf = malloc(size);
+    int len;
+
+    if (!buf) {
+        return NULL;
+    }
+    json_escape(session, tid, sizeof(tid));
+    json_escape(info->url, url, sizeof(url));
+    json_escape(info->live_streamid, streamid, sizeof(streamid));
+
+    len = json_append(buf, size, 0,
+        "{\"tid\":\"%s\",\"url\":\"%s\",\"live_streamid\":\"%s\",\"time\":%lld,\"duration\":%lld,"
+        "\"uptime\":%lld,\"gop\":%lld,\"first_write_ms\":%lld,\"reconnects\":%lld",
+        tid, url, streamid, info->time / 1000, info->duration / 1000, info->uptime / 1000,
+        info->gop, info->first_write_ms, info->reconnects);
+    len = json_append(buf, size, len,
+        ",\"startup\":{\"dns\":%lld,\"connect\":%lld,\"handshake\":%lld,\"connect_app\":%lld,\"play\":%lld}",
+        st->dns_us / 1000, st->connect_us / 1000, st->handshake_us / 1000,
+        st->connect_app_us / 1000, st->play_us / 1000);
+    if (info->has_standby) {
+        len = json_append(buf, size, len,
+            ",\"standby\":{\"active\":%d,\"switches\":%lld,\"lag\":[%lld,%lld]}",
+            info->standby.active, info->standby.switches,
+            info->standby.lag_ms[STANDBY_PRIMARY], info->standby.lag_ms[STANDBY_BACKUP]);
+    }
+    len = statis_stream_json(buf, size, len, "video", &info->video);
+    len = statis_stream_json(buf, size, len, "audio", &info->audio);
+    len = json_append(buf, size, len, "}");
+    if (len >= size) {
+        logger(LOG_ERROR, "statis notify body truncated");
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static char *segment_json(const char *session, const SegmentNotify *info)
+{
+    char tid[256];
+    char file[2048];
+    int size = 512 + sizeof(tid) + sizeof(file);
+    char *buf = malloc(size);
+    int len;
+
+    if (!buf) {
+        return NULL;
+    }
+    json_escape(session, tid, sizeof(tid));
+    json_escape(info->file, file, sizeof(file));
+    len = json_append(buf, size, 0,
+        "{\"tid\":\"%s\",\"file\":\"%s\",\"index\":%d,\"duration\":%lld,\"last\":%d,\"flags\":%d,"
+        "\"latency_first\":%lld,\"latency_last\":%lld}",
+        tid, file, info->index, info->duration / 1000, info->last, info->flags,
+        info->latency_first_ms, info->latency_last_ms);
+    if (len >= size) {
+        logger(LOG_ERROR, "segment notify body truncated");
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static char *chunk_json(const char *session, const ChunkNotify *info)
+{
+    char tid[256];
+    char file[2048];
+    int size = 512 + sizeof(tid) + sizeof(file);
+    char *buf = malloc(size);
+    int len;
+
+    if (!buf) {
+        return NULL;
+    }
+    json_escape(session, tid, sizeof(tid));
+    json_escape(info->file, file, sizeof(file));
+    len = json_append(buf, size, 0,
+        "{\"tid\":\"%s\",\"file\":\"%s\",\"index\":%d,\"chunk\":%d,\"duration\":%lld,"
+        "\"latency_first\":%lld,\"latency_last\":%lld}",
+        tid, file, info->index, info->chunk_index, info->duration / 1000,
+        info->latency_first_ms, info->latency_last_ms);
+    if (len >= size) {
+        logger(LOG_ERROR, "chunk notify body truncated");
+        free(buf);
+        return NULL;
+    }
+    return buf;
 }
 
 void segment_notify(const char *url, const char *session, const SegmentNotify *info)
 {
-    // todo
+    char *body = segment_json(session, info);
+    if (body) {
+        notify_post(url, body, 0, 1);
+    }
 }
 
 void segment_notify_pipe(const char *url, const char *session, const SegmentNotify *info)
 {
-    // todo
+    char *body = segment_json(session, info);
+    if (body) {
+        notify_post(url, body, 1, 1);
+    }
 }
 
 void chunk_notify_pipe(const char *url, const char *session, const ChunkNotify *info)
 {
-    // todo
+    char *body = chunk_json(session, info);
+    if (body) {
+        notify_post(url, body, 1, 1);
+    }
 }
 
 void statis_notify(const char *url, const char *session, const StatisNotify *info)
 {
-    // todo
+    char *body = statis_json(session, info);
+    if (body) {
+        notify_post(url, body, 0, 0);
+    }
 }
 
 void statis_notify_pipe(const char *url, const char *session, const StatisNotify *info)
 {
-    // todo
+    char *body = statis_json(session, info);
+    if (body) {
+        notify_post(url, body, 1, 0);
+    }
 }
@@ -8,10 +8,30 @@
 
 #define PERIOD_SIZE 5
 
+// statistics waiting for the sender, the oldest is dropped when full
+#define NOTIFY_QUEUE_SIZE 16
+// segment and chunk notifications are never dropped, a warning is logged
+// every time this many more are waiting
+#define NOTIFY_EVENT_BACKLOG_WARN 64
+
 void set_notify_flag(int on);
 
-typedef struct {
+/**
+ * send the queued notifications and stop the sender, later ones are sent
+ * in place. called at exit as well.
+ */
+void notify_stop();
 
+typedef struct {
+    const char *file;
+    int index;
+    // in us
+    int64_t duration;
+    int last;
+    int flags;
+    // publish time minus the arrival of the first and the last packet in ms, -1 if none
+    int64_t latency_first_ms;
+    int64_t latency_last_ms;
 } SegmentNotify;
 
 void segment_notify(const char *url, const char * session, const SegmentNotify *info);
@@ -19,13 +39,50 @@ void segment_notify(const char *url, const char * session, const SegmentNotify *
 void segment_notify_pipe(const char *url, const char * session, const SegmentNotify *info);
 
 typedef struct {
-
+    const char *file;
+    int index;
+    int chunk_index;
+    // in us
+    int64_t duration;
+    // same as SegmentNotify
+    int64_t latency_first_ms;
+    int64_t latency_last_ms;
 } ChunkNotify;
 
 void chunk_notify_pipe(const char *url, const char * session, const ChunkNotify *info);
 
+typedef struct {
+    int64_t in_frames;
+    int64_t out_frames;
+    // bits per second of the window
+    int64_t in_bitrate;
+    int64_t out_bitrate;
+    // the highest input bitrate of a period in the window
+    int64_t peak_bitrate;
+    double fps;
+    // frames read but not written
+    double drop_rate;
+} StatisStream;
+
+// statistics of the STATIS_PERIOD * PERIOD_SIZE window
 typedef struct {
     const char *url;
+    const char *live_streamid;
+    // end and length of the window in us
+    int64_t time;
+    int64_t duration;
+    int64_t uptime;
+    // video frames of the last gop
+    int64_t gop;
+    // the first frame written after start in ms, -1 for none yet
+    int64_t first_write_ms;
+    SegStartup startup;
+    int64_t reconnects;
+    // hot standby input, only when backup is set
+    int has_standby;
+    StandbyStats standby;
+    StatisStream video;
+    StatisStream audio;
 } StatisNotify;
 
 void statis_notify(const char *url, const char * session, const StatisNotify *info);
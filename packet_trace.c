@@ -0,0 +1,77 @@
+#include "packet_trace.h"
+#include "log.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+PktTrace g_pkt_trace;
+
+static size_t g_map_size = 0;
+
+int pkt_trace_open(const char *path, int records)
+{
+    uint64_t capacity = 1;
+    struct timeval tv;
+    void *map;
+    int fd;
+
+    if (g_pkt_trace.records) {
+        return 0;
+    }
+    if (records <= 0) {
+        records = PKT_TRACE_DEFAULT_RECORDS;
+    }
+    while (capacity < (uint64_t)records) {
+        capacity <<= 1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        logger(LOG_ERROR, "open packet trace %s fail, errno %d", path, errno);
+        return -1;
+    }
+    g_map_size = sizeof(PktTraceHeader) + capacity * sizeof(PktTraceRecord);
+    if (ftruncate(fd, g_map_size) < 0) {
+        logger(LOG_ERROR, "resize packet trace %s to %zu fail, errno %d", path, g_map_size, errno);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, g_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping holds the file
+    close(fd);
+    if (map == MAP_FAILED) {
+        logger(LOG_ERROR, "map packet trace %s fail, errno %d", path, errno);
+        return -1;
+    }
+
+    g_pkt_trace.header = map;
+    g_pkt_trace.records = (PktTraceRecord *)((char *)map + sizeof(PktTraceHeader));
+    g_pkt_trace.mask = capacity - 1;
+    g_pkt_trace.start = pkt_trace_mono_us();
+
+    gettimeofday(&tv, NULL);
+    memcpy(g_pkt_trace.header->magic, PKT_TRACE_MAGIC, sizeof(g_pkt_trace.header->magic));
+    g_pkt_trace.header->version = PKT_TRACE_VERSION;
+    g_pkt_trace.header->record_size = sizeof(PktTraceRecord);
+    g_pkt_trace.header->capacity = capacity;
+    g_pkt_trace.header->count = 0;
+    g_pkt_trace.header->start_time = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    logger(LOG_INFO, "packet trace %s of %llu records", path, (unsigned long long)capacity);
+    return 0;
+}
+
+void pkt_trace_close()
+{
+    if (!g_pkt_trace.records) {
+        return;
+    }
+    logger(LOG_INFO, "packet trace closed after %llu records",
+        (unsigned long long)g_pkt_trace.header->count);
+    msync(g_pkt_trace.header, g_map_size, MS_ASYNC);
+    munmap(g_pkt_trace.header, g_map_size);
+    memset(&g_pkt_trace, 0, sizeof(g_pkt_trace));
+}
@@ -0,0 +1,113 @@
+#ifndef PACKET_TRACE_H_
+#define PACKET_TRACE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define PKT_TRACE_MAGIC "LSSTRACE"
+#define PKT_TRACE_VERSION 1
+// records kept by default, the file is 64 bytes a record
+#define PKT_TRACE_DEFAULT_RECORDS (1 << 18)
+// timestamp of a record is absent
+#define PKT_TRACE_NOTS INT64_MIN
+
+// what became of the packet
+enum {
+    PKT_TRACE_WRITE = 0,
+    // discarded before output
+    PKT_TRACE_SKIP,
+    // held back, written later
+    PKT_TRACE_CACHE,
+    PKT_TRACE_FAIL,
+    PKT_TRACE_EVENT_MAX
+};
+
+enum {
+    PKT_TRACE_TYPE_VIDEO = 0,
+    PKT_TRACE_TYPE_AUDIO,
+    PKT_TRACE_TYPE_OTHER
+};
+
+#define PKT_TRACE_FLAG_KEY 0x01
+// a segment was cut before the packet
+#define PKT_TRACE_FLAG_CUT 0x02
+// an lhls chunk was cut before the packet
+#define PKT_TRACE_FLAG_CHUNK 0x04
+#define PKT_TRACE_FLAG_SEQ_HEADER 0x08
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    // a power of two
+    uint64_t capacity;
+    // records written, the ring holds the last capacity of them
+    uint64_t count;
+    // wall clock in us when time_us of records is 0
+    int64_t start_time;
+    uint8_t reserved[24];
+} PktTraceHeader;
+
+typedef struct {
+    // monotonic since the trace opened
+    int64_t time_us;
+    // in us, PKT_TRACE_NOTS if absent
+    int64_t in_dts;
+    int64_t in_pts;
+    int64_t out_dts;
+    int64_t out_pts;
+    int32_t size;
+    int32_t seg_index;
+    int32_t chunk_index;
+    // NF_* of the segment
+    uint32_t seg_flags;
+    uint8_t stream;
+    uint8_t type;
+    uint8_t event;
+    uint8_t flags;
+    uint32_t reserved;
+} PktTraceRecord;
+
+typedef struct {
+    PktTraceHeader *header;
+    PktTraceRecord *records;
+    uint64_t mask;
+    int64_t start;
+} PktTrace;
+
+// records is NULL when the trace is off
+extern PktTrace g_pkt_trace;
+
+/**
+ * map a ring of records, rounded up to a power of two, at path.
+ */
+int pkt_trace_open(const char *path, int records);
+
+void pkt_trace_close();
+
+static inline int64_t pkt_trace_mono_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * the record to fill, NULL when the trace is off.
+ */
+static inline PktTraceRecord *pkt_trace_alloc()
+{
+    if (!g_pkt_trace.records) {
+        return NULL;
+    }
+    return &g_pkt_trace.records[g_pkt_trace.header->count & g_pkt_trace.mask];
+}
+
+// the count is published after the record for a reader of the live file
+static inline void pkt_trace_commit(PktTraceRecord *r)
+{
+    r->time_us = pkt_trace_mono_us() - g_pkt_trace.start;
+    __atomic_store_n(&g_pkt_trace.header->count, g_pkt_trace.header->count + 1, __ATOMIC_RELEASE);
+}
+
+#endif
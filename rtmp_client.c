@@ -0,0 +1,1409 @@
+#include "rtmp_client.h"
+#include "srs_librtmp.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_DEFAULT_PORT 1935
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+#define RTMP_ACK_WINDOW 2500000
+#define RTMP_PLAY_BUFFER_MS 1000
+
+#define RTMP_MSG_SET_CHUNK_SIZE 1
+#define RTMP_MSG_ABORT 2
+#define RTMP_MSG_ACK 3
+#define RTMP_MSG_USER_CONTROL 4
+#define RTMP_MSG_WINDOW_ACK_SIZE 5
+#define RTMP_MSG_SET_PEER_BANDWIDTH 6
+#define RTMP_MSG_AUDIO 8
+#define RTMP_MSG_VIDEO 9
+#define RTMP_MSG_AMF3_DATA 15
+#define RTMP_MSG_AMF3_COMMAND 17
+#define RTMP_MSG_AMF0_DATA 18
+#define RTMP_MSG_AMF0_COMMAND 20
+#define RTMP_MSG_AGGREGATE 22
+
+#define RTMP_UC_SET_BUFFER_LENGTH 3
+#define RTMP_UC_PING_REQUEST 6
+#define RTMP_UC_PING_RESPONSE 7
+
+#define RTMP_CID_CONTROL 2
+#define RTMP_CID_COMMAND 3
+#define RTMP_CID_STREAM 8
+
+#define RTMP_TXN_CONNECT 1
+#define RTMP_TXN_CREATE_STREAM 2
+// stream id of the pipelined play, which most servers create first
+#define RTMP_PIPELINE_STREAM_ID 1
+
+typedef struct RtmpChunkStream {
+    int csid;
+    u_int32_t timestamp;
+    u_int32_t delta;
+    // extended timestamp of the message header, repeated by type 3 chunks
+    int has_ext_timestamp;
+    u_int32_t ext_timestamp;
+    int length;
+    int type;
+    int stream_id;
+    int msg_count;
+
+    // message being received
+    char *payload;
+    int received;
+
+    struct RtmpChunkStream *next;
+} RtmpChunkStream;
+
+typedef struct {
+    char type;
+    u_int32_t timestamp;
+    char *data;
+    int size;
+} RtmpTag;
+
+typedef struct {
+    char *data;
+    int pos;
+    int size;
+    int capacity;
+    // bytes moved to make space
+    int64_t moved;
+} RtmpBuffer;
+
+struct RtmpClient {
+    char host[256];
+    int port;
+    char app[512];
+    char stream[1024];
+    char tc_url[1024];
+    // set to skip resolving, or the address resolved
+    char server_ip[64];
+    int pipeline;
+
+    int fd;
+    int state;
+    int error;
+    int timeout_ms;
+    int64_t deadline;
+    int events;
+
+    RtmpPoller *poller;
+    // poller of the blocking wrapper
+    int own_poller;
+    struct RtmpClient *prev;
+    struct RtmpClient *next;
+
+    RtmpBuffer in;
+    RtmpBuffer out;
+
+    int in_chunk_size;
+    RtmpChunkStream *chunk_streams;
+    // chunk whose payload is being received
+    RtmpChunkStream *chunk;
+    int chunk_left;
+
+    int64_t in_bytes;
+    int64_t in_acked;
+    int ack_window;
+    int stream_id;
+
+    // free space reserved for a read, grows to recv_max when set
+    int read_size;
+    int recv_max;
+    int merge_read_ms;
+    int64_t nb_reads;
+    int64_t last_read_bytes;
+    // bytes read in the window since window_start, and bytes per second of the last one
+    int64_t window_start;
+    int64_t window_bytes;
+    int64_t bitrate;
+
+    RtmpClientStartup startup;
+    int64_t phase_start;
+
+    RtmpTagCallback on_tag;
+    RtmpCloseCallback on_close;
+    void *opaque;
+    RtmpInterruptCallback interrupt;
+    void *interrupt_opaque;
+
+    // ring of the tags read by the blocking wrapper, capacity is a power of two
+    RtmpTag *tags;
+    int tags_head;
+    int tags_count;
+    int tags_capacity;
+};
+
+struct RtmpPoller {
+    int epfd;
+    RtmpClient *clients;
+};
+
+static int64_t rtmp_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t rtmp_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// duration of the phase ending now, the next one starts
+static int64_t rtmp_client_phase_end(RtmpClient *c)
+{
+    int64_t now = rtmp_now_us();
+    int64_t us = now - c->phase_start;
+
+    c->phase_start = now;
+    return us;
+}
+
+static u_int32_t rtmp_read_be(const char *p, int n)
+{
+    u_int32_t v = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        v = (v << 8) | (u_int8_t)p[i];
+    }
+    return v;
+}
+
+static char *rtmp_write_be(char *p, u_int32_t v, int n)
+{
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        p[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+    return p + n;
+}
+
+static int rtmp_buffer_reserve(RtmpBuffer *buf, int size)
+{
+    if (buf->pos > 0 && buf->size + size > buf->capacity) {
+        memmove(buf->data, buf->data + buf->pos, buf->size - buf->pos);
+        buf->moved += buf->size - buf->pos;
+        buf->size -= buf->pos;
+        buf->pos = 0;
+    }
+    if (buf->size + size > buf->capacity) {
+        int capacity = buf->capacity ? buf->capacity : RTMP_CLIENT_BUFFER_SIZE;
+        char *data;
+        while (capacity < buf->size + size) {
+            capacity *= 2;
+        }
+        data = realloc(buf->data, capacity);
+        if (!data) {
+            logger(LOG_ERROR, "alloc rtmp client buffer %d failed", capacity);
+            return -1;
+        }
+        if (buf->data && data != buf->data) {
+            buf->moved += buf->size;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    return 0;
+}
+
+/**
+ * amf0 encoders, p must have room for the value.
+ */
+static char *amf0_put_key(char *p, const char *key)
+{
+    int len = strlen(key);
+    p = rtmp_write_be(p, len, 2);
+    memcpy(p, key, len);
+    return p + len;
+}
+
+static char *amf0_put_string(char *p, const char *value)
+{
+    *p++ = 0x02;
+    return amf0_put_key(p, value);
+}
+
+static char *amf0_put_number(char *p, double value)
+{
+    u_int64_t bits;
+    int i;
+
+    memcpy(&bits, &value, sizeof(bits));
+    *p++ = 0x00;
+    for (i = 7; i >= 0; i--) {
+        *p++ = (char)(bits >> (i * 8));
+    }
+    return p;
+}
+
+static char *amf0_put_bool(char *p, int value)
+{
+    *p++ = 0x01;
+    *p++ = value ? 1 : 0;
+    return p;
+}
+
+static char *amf0_put_null(char *p)
+{
+    *p++ = 0x05;
+    return p;
+}
+
+static char *amf0_put_object_end(char *p)
+{
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = 0x09;
+    return p;
+}
+
+static void rtmp_client_close_fd(RtmpClient *c)
+{
+    if (c->fd >= 0) {
+        if (c->poller) {
+            epoll_ctl(c->poller->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        }
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void rtmp_client_fail(RtmpClient *c, int error)
+{
+    if (c->state == RTMP_CLIENT_STATE_CLOSED) {
+        return;
+    }
+    if (error) {
+        logger(LOG_ERROR, "rtmp client %s/%s closed at state %d, error %d",
+            c->tc_url, c->stream, c->state, error);
+    } else {
+        logger(LOG_WARN, "rtmp client %s/%s closed by peer at state %d", c->tc_url, c->stream, c->state);
+    }
+    c->state = RTMP_CLIENT_STATE_CLOSED;
+    c->error = error;
+    rtmp_client_close_fd(c);
+    if (c->on_close) {
+        c->on_close(c->opaque, error);
+    }
+}
+
+static void rtmp_client_update_events(RtmpClient *c)
+{
+    struct epoll_event ev;
+    int events = EPOLLIN;
+
+    if (c->state == RTMP_CLIENT_STATE_CONNECTING || c->out.size > c->out.pos) {
+        events |= EPOLLOUT;
+    }
+    if (events == c->events || c->fd < 0) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->poller->epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        rtmp_client_fail(c, errno);
+        return;
+    }
+    c->events = events;
+}
+
+static int rtmp_client_flush(RtmpClient *c)
+{
+    while (c->out.size > c->out.pos) {
+        ssize_t n = write(c->fd, c->out.data + c->out.pos, c->out.size - c->out.pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            rtmp_client_fail(c, errno);
+            return -1;
+        }
+        c->out.pos += n;
+    }
+    if (c->out.pos == c->out.size) {
+        c->out.pos = c->out.size = 0;
+    }
+    rtmp_client_update_events(c);
+    return 0;
+}
+
+/**
+ * queue one message in chunks of the default chunk size, it is sent by
+ * rtmp_client_flush.
+ */
+static int rtmp_client_queue_message(RtmpClient *c, int csid, int type, int stream_id,
+    const char *data, int size)
+{
+    int nb_chunks = size > 0 ? (size + RTMP_DEFAULT_CHUNK_SIZE - 1) / RTMP_DEFAULT_CHUNK_SIZE : 1;
+    char *p;
+    int pos = 0;
+
+    if (rtmp_buffer_reserve(&c->out, 12 + nb_chunks - 1 + size) < 0) {
+        return -1;
+    }
+    p = c->out.data + c->out.size;
+
+    // fmt 0, timestamp 0
+    *p++ = (char)(csid & 0x3f);
+    p = rtmp_write_be(p, 0, 3);
+    p = rtmp_write_be(p, size, 3);
+    *p++ = (char)type;
+    // stream id is little endian
+    *p++ = (char)(stream_id & 0xff);
+    *p++ = (char)((stream_id >> 8) & 0xff);
+    *p++ = (char)((stream_id >> 16) & 0xff);
+    *p++ = (char)((stream_id >> 24) & 0xff);
+
+    while (pos < size) {
+        int n = size - pos < RTMP_DEFAULT_CHUNK_SIZE ? size - pos : RTMP_DEFAULT_CHUNK_SIZE;
+        if (pos > 0) {
+            // fmt 3
+            *p++ = (char)(0xc0 | (csid & 0x3f));
+        }
+        memcpy(p, data + pos, n);
+        p += n;
+        pos += n;
+    }
+    c->out.size = p - c->out.data;
+    return 0;
+}
+
+static int rtmp_client_send_connect(RtmpClient *c)
+{
+    char buf[4096];
+    char *p = buf;
+
+    if (strlen(c->app) + strlen(c->tc_url) + 512 > sizeof(buf)) {
+        return -1;
+    }
+    p = amf0_put_string(p, "connect");
+    p = amf0_put_number(p, RTMP_TXN_CONNECT);
+    *p++ = 0x03;
+    p = amf0_put_key(p, "app");
+    p = amf0_put_string(p, c->app);
+    p = amf0_put_key(p, "flashVer");
+    p = amf0_put_string(p, "WIN 15,0,0,239");
+    p = amf0_put_key(p, "tcUrl");
+    p = amf0_put_string(p, c->tc_url);
+    p = amf0_put_key(p, "fpad");
+    p = amf0_put_bool(p, 0);
+    p = amf0_put_key(p, "capabilities");
+    p = amf0_put_number(p, 239);
+    p = amf0_put_key(p, "audioCodecs");
+    p = amf0_put_number(p, 3575);
+    p = amf0_put_key(p, "videoCodecs");
+    p = amf0_put_number(p, 252);
+    p = amf0_put_key(p, "videoFunction");
+    p = amf0_put_number(p, 1);
+    p = amf0_put_key(p, "objectEncoding");
+    p = amf0_put_number(p, 0);
+    p = amf0_put_object_end(p);
+    if (rtmp_client_queue_message(c, RTMP_CID_COMMAND, RTMP_MSG_AMF0_COMMAND, 0, buf, p - buf) < 0) {
+        return -1;
+    }
+
+    p = rtmp_write_be(buf, RTMP_ACK_WINDOW, 4);
+    return rtmp_client_queue_message(c, RTMP_CID_CONTROL, RTMP_MSG_WINDOW_ACK_SIZE, 0, buf, p - buf);
+}
+
+static int rtmp_client_send_create_stream(RtmpClient *c)
+{
+    char buf[64];
+    char *p = buf;
+
+    p = amf0_put_string(p, "createStream");
+    p = amf0_put_number(p, RTMP_TXN_CREATE_STREAM);
+    p = amf0_put_null(p);
+    return rtmp_client_queue_message(c, RTMP_CID_COMMAND, RTMP_MSG_AMF0_COMMAND, 0, buf, p - buf);
+}
+
+static int rtmp_client_send_play(RtmpClient *c)
+{
+    char buf[1200];
+    char *p = buf;
+
+    p = amf0_put_string(p, "play");
+    p = amf0_put_number(p, 0);
+    p = amf0_put_null(p);
+    p = amf0_put_string(p, c->stream);
+    if (rtmp_client_queue_message(c, RTMP_CID_STREAM, RTMP_MSG_AMF0_COMMAND, c->stream_id, buf, p - buf) < 0) {
+        return -1;
+    }
+
+    p = rtmp_write_be(buf, RTMP_UC_SET_BUFFER_LENGTH, 2);
+    p = rtmp_write_be(p, c->stream_id, 4);
+    p = rtmp_write_be(p, RTMP_PLAY_BUFFER_MS, 4);
+    return rtmp_client_queue_message(c, RTMP_CID_CONTROL, RTMP_MSG_USER_CONTROL, 0, buf, p - buf);
+}
+
+static void rtmp_client_deliver(RtmpClient *c, char type, u_int32_t timestamp, char *data, int size)
+{
+    if (c->state == RTMP_CLIENT_STATE_PLAY) {
+        c->state = RTMP_CLIENT_STATE_PLAYING;
+    }
+    c->on_tag(c->opaque, type, timestamp, data, size);
+}
+
+/**
+ * split aggregate message to tags, timestamps are shifted to the message.
+ * the tags are views of the payload, whose tag header is overwritten.
+ */
+static int rtmp_client_on_aggregate(RtmpClient *c, RtmpChunkStream *cs)
+{
+    char *p = cs->payload;
+    const char *end = cs->payload + cs->length;
+    int64_t delta = 0;
+    int first = 1;
+
+    while (end - p >= 11) {
+        char type = p[0];
+        int size = rtmp_read_be(p + 1, 3);
+        u_int32_t timestamp = rtmp_read_be(p + 4, 3) | ((u_int32_t)(u_int8_t)p[7] << 24);
+        char *data;
+
+        timestamp &= 0x7fffffff;
+        p += 11;
+        if (end - p < size + 4) {
+            logger(LOG_ERROR, "invalid rtmp aggregate message, size %d", size);
+            return -1;
+        }
+        if (first) {
+            delta = (int64_t)cs->timestamp - timestamp;
+            first = 0;
+        }
+
+        data = srs_rtmp_view_packet(cs->payload, p);
+        rtmp_client_deliver(c, type, (u_int32_t)((timestamp + delta) & 0x7fffffff), data, size);
+        // previous tag size
+        p += size + 4;
+    }
+    return 0;
+}
+
+static int rtmp_client_on_command(RtmpClient *c, char *data, int size)
+{
+    srs_amf0_t name = NULL;
+    srs_amf0_t txn = NULL;
+    srs_amf0_t arg = NULL;
+    srs_amf0_t info = NULL;
+    const char *command;
+    int ret = 0;
+    int pos = 0;
+    int n;
+
+    name = srs_amf0_parse(data, size, &n);
+    if (!name || !srs_amf0_is_string(name)) {
+        goto done;
+    }
+    pos += n;
+    command = srs_amf0_to_string(name);
+    if (pos < size && (txn = srs_amf0_parse(data + pos, size - pos, &n)) != NULL) {
+        pos += n;
+    }
+    if (pos < size && (arg = srs_amf0_parse(data + pos, size - pos, &n)) != NULL) {
+        pos += n;
+    }
+    if (pos < size) {
+        info = srs_amf0_parse(data + pos, size - pos, &n);
+    }
+
+    if (!strcmp(command, "_result")) {
+        int id = txn && srs_amf0_is_number(txn) ? (int) srs_amf0_to_number(txn) : 0;
+        if (c->state == RTMP_CLIENT_STATE_CONNECT_APP && id == RTMP_TXN_CONNECT) {
+            logger(LOG_INFO, "rtmp client %s connected", c->tc_url);
+            c->state = RTMP_CLIENT_STATE_CREATE_STREAM;
+            // createStream is sent already when pipelined
+            if (!c->pipeline) {
+                c->startup.connect_app_us = rtmp_client_phase_end(c);
+                ret = rtmp_client_send_create_stream(c);
+            }
+        } else if (c->state == RTMP_CLIENT_STATE_CREATE_STREAM && id == RTMP_TXN_CREATE_STREAM) {
+            int stream_id = info && srs_amf0_is_number(info) ? (int) srs_amf0_to_number(info) : 1;
+            logger(LOG_INFO, "rtmp client %s play %s, stream id %d", c->tc_url, c->stream, stream_id);
+            c->state = RTMP_CLIENT_STATE_PLAY;
+            if (!c->pipeline) {
+                c->startup.play_us = rtmp_client_phase_end(c);
+                c->stream_id = stream_id;
+                ret = rtmp_client_send_play(c);
+            } else {
+                c->startup.connect_app_us = rtmp_client_phase_end(c);
+                if (stream_id != c->stream_id) {
+                    logger(LOG_WARN, "pipelined play over stream %d, play again over %d", c->stream_id, stream_id);
+                    c->stream_id = stream_id;
+                    ret = rtmp_client_send_play(c);
+                }
+            }
+        }
+    } else if (!strcmp(command, "_error")) {
+        logger(LOG_ERROR, "rtmp client %s command error at state %d", c->tc_url, c->state);
+        rtmp_client_fail(c, ECONNREFUSED);
+    } else if (!strcmp(command, "onStatus")) {
+        srs_amf0_t level = NULL;
+        srs_amf0_t code = NULL;
+        if (info && srs_amf0_is_object(info)) {
+            level = srs_amf0_object_property(info, "level");
+            code = srs_amf0_object_property(info, "code");
+        }
+        logger(LOG_INFO, "rtmp client %s/%s status %s", c->tc_url, c->stream,
+            code && srs_amf0_is_string(code) ? srs_amf0_to_string(code) : "unknown");
+        if (level && srs_amf0_is_string(level) && !strcmp(srs_amf0_to_string(level), "error")) {
+            rtmp_client_fail(c, ECONNREFUSED);
+        }
+    } else if (!strcmp(command, "close")) {
+        rtmp_client_fail(c, 0);
+    }
+
+done:
+    if (name) {
+        srs_amf0_free(name);
+    }
+    if (txn) {
+        srs_amf0_free(txn);
+    }
+    if (arg) {
+        srs_amf0_free(arg);
+    }
+    if (info) {
+        srs_amf0_free(info);
+    }
+    return ret;
+}
+
+// a complete message is in cs->payload, the payload is released or handed over
+static int rtmp_client_on_message(RtmpClient *c, RtmpChunkStream *cs)
+{
+    char *data = cs->payload;
+    int size = cs->length;
+    char buf[16];
+    char *p;
+    int ret = 0;
+
+    cs->payload = NULL;
+    cs->received = 0;
+
+    switch (cs->type) {
+        case RTMP_MSG_AUDIO:
+        case RTMP_MSG_VIDEO:
+        case RTMP_MSG_AMF0_DATA:
+        case RTMP_MSG_AMF3_DATA:
+            rtmp_client_deliver(c, cs->type == RTMP_MSG_AMF3_DATA ? RTMP_MSG_AMF0_DATA : cs->type,
+                cs->timestamp, data, size);
+            return 0;
+        case RTMP_MSG_AGGREGATE:
+            cs->payload = data;
+            ret = rtmp_client_on_aggregate(c, cs);
+            cs->payload = NULL;
+            break;
+        case RTMP_MSG_SET_CHUNK_SIZE:
+            if (size >= 4) {
+                c->in_chunk_size = rtmp_read_be(data, 4) & 0x7fffffff;
+                if (c->in_chunk_size < 1) {
+                    logger(LOG_ERROR, "invalid rtmp chunk size %d", c->in_chunk_size);
+                    ret = -1;
+                }
+            }
+            break;
+        case RTMP_MSG_ABORT:
+            if (size >= 4) {
+                int csid = rtmp_read_be(data, 4);
+                RtmpChunkStream *s;
+                for (s = c->chunk_streams; s; s = s->next) {
+                    if (s->csid == csid && s->payload) {
+                        srs_rtmp_free_packet(s->payload);
+                        s->payload = NULL;
+                        s->received = 0;
+                    }
+                }
+            }
+            break;
+        case RTMP_MSG_WINDOW_ACK_SIZE:
+            if (size >= 4) {
+                c->ack_window = rtmp_read_be(data, 4);
+            }
+            break;
+        case RTMP_MSG_SET_PEER_BANDWIDTH:
+            if (size >= 4) {
+                p = rtmp_write_be(buf, rtmp_read_be(data, 4), 4);
+                ret = rtmp_client_queue_message(c, RTMP_CID_CONTROL, RTMP_MSG_WINDOW_ACK_SIZE, 0, buf, p - buf);
+            }
+            break;
+        case RTMP_MSG_USER_CONTROL:
+            if (size >= 6 && rtmp_read_be(data, 2) == RTMP_UC_PING_REQUEST) {
+                p = rtmp_write_be(buf, RTMP_UC_PING_RESPONSE, 2);
+                memcpy(p, data + 2, 4);
+                ret = rtmp_client_queue_message(c, RTMP_CID_CONTROL, RTMP_MSG_USER_CONTROL, 0, buf, 6);
+            }
+            break;
+        case RTMP_MSG_AMF3_COMMAND:
+            // amf0 after the format byte
+            if (size > 1) {
+                ret = rtmp_client_on_command(c, data + 1, size - 1);
+            }
+            break;
+        case RTMP_MSG_AMF0_COMMAND:
+            ret = rtmp_client_on_command(c, data, size);
+            break;
+        default:
+            break;
+    }
+    srs_rtmp_free_packet(data);
+    return ret;
+}
+
+static RtmpChunkStream *rtmp_client_chunk_stream(RtmpClient *c, int csid)
+{
+    RtmpChunkStream *cs;
+
+    for (cs = c->chunk_streams; cs; cs = cs->next) {
+        if (cs->csid == csid) {
+            return cs;
+        }
+    }
+    cs = calloc(1, sizeof(RtmpChunkStream));
+    if (!cs) {
+        logger(LOG_ERROR, "alloc rtmp chunk stream failed");
+        return NULL;
+    }
+    cs->csid = csid;
+    cs->next = c->chunk_streams;
+    c->chunk_streams = cs;
+    return cs;
+}
+
+// payload of current chunk is done, return -1 on error
+static int rtmp_client_end_chunk(RtmpClient *c)
+{
+    RtmpChunkStream *cs = c->chunk;
+
+    c->chunk = NULL;
+    if (cs->received < cs->length) {
+        return 0;
+    }
+    return rtmp_client_on_message(c, cs);
+}
+
+/**
+ * parse one chunk header from the input buffer, return 0 if more bytes
+ * are required, 1 when parsed, or -1 on error.
+ */
+static int rtmp_client_parse_header(RtmpClient *c)
+{
+    const char *p = c->in.data + c->in.pos;
+    int avail = c->in.size - c->in.pos;
+    static const int header_sizes[] = {11, 7, 3, 0};
+    RtmpChunkStream *cs;
+    int fmt;
+    int csid;
+    int pos;
+    u_int32_t timestamp = 0;
+    int first_chunk;
+
+    if (avail < 1) {
+        return 0;
+    }
+    fmt = ((u_int8_t)p[0] >> 6) & 0x03;
+    csid = p[0] & 0x3f;
+    pos = 1;
+    if (csid == 0) {
+        if (avail < 2) {
+            return 0;
+        }
+        csid = 64 + (u_int8_t)p[1];
+        pos = 2;
+    } else if (csid == 1) {
+        if (avail < 3) {
+            return 0;
+        }
+        csid = 64 + (u_int8_t)p[1] + (u_int8_t)p[2] * 256;
+        pos = 3;
+    }
+    if (avail < pos + header_sizes[fmt]) {
+        return 0;
+    }
+
+    cs = rtmp_client_chunk_stream(c, csid);
+    if (!cs) {
+        return -1;
+    }
+    first_chunk = (cs->payload == NULL);
+    if (cs->msg_count == 0 && fmt != 0) {
+        // a fresh chunk stream always starts by a full header, but some
+        // servers send fmt 1 for protocol control
+        if (fmt != 1) {
+            logger(LOG_ERROR, "rtmp chunk stream %d starts with fmt %d", csid, fmt);
+            return -1;
+        }
+    }
+
+    if (fmt <= 2) {
+        timestamp = rtmp_read_be(p + pos, 3);
+        if (fmt <= 1) {
+            cs->length = rtmp_read_be(p + pos + 3, 3);
+            cs->type = (u_int8_t)p[pos + 6];
+        }
+        if (fmt == 0) {
+            cs->stream_id = rtmp_read_be(p + pos + 7, 1) | (rtmp_read_be(p + pos + 8, 1) << 8) |
+                (rtmp_read_be(p + pos + 9, 1) << 16) | (rtmp_read_be(p + pos + 10, 1) << 24);
+        }
+        pos += header_sizes[fmt];
+        cs->has_ext_timestamp = (timestamp == 0xffffff);
+        if (cs->has_ext_timestamp) {
+            if (avail < pos + 4) {
+                return 0;
+            }
+            cs->ext_timestamp = rtmp_read_be(p + pos, 4);
+            timestamp = cs->ext_timestamp;
+            pos += 4;
+        }
+        if (fmt == 0) {
+            cs->timestamp = timestamp;
+            cs->delta = 0;
+        } else {
+            cs->delta = timestamp;
+            cs->timestamp += timestamp;
+        }
+    } else {
+        // the extended timestamp may be repeated by type 3 chunks
+        if (cs->has_ext_timestamp) {
+            if (avail < pos + 4) {
+                return 0;
+            }
+            if (rtmp_read_be(p + pos, 4) == cs->ext_timestamp) {
+                pos += 4;
+            }
+        }
+        if (first_chunk) {
+            cs->timestamp += cs->delta;
+        }
+    }
+    cs->timestamp &= 0x7fffffff;
+
+    if (!first_chunk && fmt <= 1 && cs->received > 0) {
+        logger(LOG_WARN, "rtmp chunk stream %d message restarted, drop %d bytes", csid, cs->received);
+        srs_rtmp_free_packet(cs->payload);
+        cs->payload = NULL;
+        cs->received = 0;
+        first_chunk = 1;
+    }
+    if (first_chunk) {
+        cs->msg_count++;
+        // at least one byte, empty messages are valid
+        cs->payload = srs_rtmp_alloc_packet(cs->length > 0 ? cs->length : 1);
+        if (!cs->payload) {
+            return -1;
+        }
+        cs->received = 0;
+    }
+
+    c->in.pos += pos;
+    c->chunk = cs;
+    c->chunk_left = cs->length - cs->received;
+    if (c->chunk_left > c->in_chunk_size) {
+        c->chunk_left = c->in_chunk_size;
+    }
+    return 1;
+}
+
+// consume the input buffer, return -1 on error
+static int rtmp_client_parse(RtmpClient *c)
+{
+    while (c->state != RTMP_CLIENT_STATE_CLOSED) {
+        if (c->state == RTMP_CLIENT_STATE_HANDSHAKE) {
+            // s0, s1 and s2, then c2 echoes s1
+            if (c->in.size - c->in.pos < 1 + RTMP_HANDSHAKE_SIZE * 2) {
+                return 0;
+            }
+            if (c->in.data[c->in.pos] != 0x03) {
+                logger(LOG_ERROR, "rtmp handshake version %d not supported", c->in.data[c->in.pos]);
+                return -1;
+            }
+            if (rtmp_buffer_reserve(&c->out, RTMP_HANDSHAKE_SIZE) < 0) {
+                return -1;
+            }
+            memcpy(c->out.data + c->out.size, c->in.data + c->in.pos + 1, RTMP_HANDSHAKE_SIZE);
+            c->out.size += RTMP_HANDSHAKE_SIZE;
+            c->in.pos += 1 + RTMP_HANDSHAKE_SIZE * 2;
+
+            c->state = RTMP_CLIENT_STATE_CONNECT_APP;
+            c->deadline = rtmp_now_ms() + c->timeout_ms;
+            c->startup.handshake_us = rtmp_client_phase_end(c);
+            if (rtmp_client_send_connect(c) < 0) {
+                return -1;
+            }
+            if (c->pipeline) {
+                c->stream_id = RTMP_PIPELINE_STREAM_ID;
+                if (rtmp_client_send_create_stream(c) < 0 || rtmp_client_send_play(c) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        if (c->chunk) {
+            int n = c->in.size - c->in.pos;
+            if (n == 0) {
+                return 0;
+            }
+            if (n > c->chunk_left) {
+                n = c->chunk_left;
+            }
+            memcpy(c->chunk->payload + c->chunk->received, c->in.data + c->in.pos, n);
+            c->chunk->received += n;
+            c->chunk_left -= n;
+            c->in.pos += n;
+            if (c->chunk_left == 0 && rtmp_client_end_chunk(c) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        int ret = rtmp_client_parse_header(c);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (c->chunk_left == 0 && rtmp_client_end_chunk(c) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// count a read syscall, and grow the read size to the bitrate of the window
+static void rtmp_client_on_read(RtmpClient *c, ssize_t n)
+{
+    int64_t now = rtmp_now_ms();
+    int64_t required;
+    int size;
+
+    c->nb_reads++;
+    c->last_read_bytes = n;
+    c->window_bytes += n;
+    if (!c->window_start) {
+        c->window_start = now;
+        return;
+    }
+    if (now - c->window_start < RTMP_CLIENT_ADAPTIVE_WINDOW_MS) {
+        return;
+    }
+    c->bitrate = c->window_bytes * 1000 / (now - c->window_start);
+    required = c->window_bytes * RTMP_CLIENT_ADAPTIVE_BUFFER_MS / (now - c->window_start);
+    c->window_start = now;
+    c->window_bytes = 0;
+    if (c->recv_max <= 0) {
+        return;
+    }
+
+    // in power of two to resize less
+    size = c->read_size;
+    while (size < required && size < c->recv_max) {
+        size *= 2;
+    }
+    if (size > c->recv_max) {
+        size = c->recv_max;
+    }
+    if (size > c->read_size) {
+        logger(LOG_INFO, "rtmp client %s/%s grow read size from %d to %d for %lld bytes in %dms",
+            c->tc_url, c->stream, c->read_size, size, required, RTMP_CLIENT_ADAPTIVE_BUFFER_MS);
+        c->read_size = size;
+    }
+}
+
+static void rtmp_client_on_readable(RtmpClient *c)
+{
+    int i;
+
+    for (i = 0; i < RTMP_CLIENT_MAX_READS && c->state != RTMP_CLIENT_STATE_CLOSED; i++) {
+        ssize_t n;
+
+        if (c->chunk && c->chunk_left >= RTMP_CLIENT_DIRECT_READ_MIN && c->in.pos == c->in.size) {
+            // the rest of chunk from socket to its position in message
+            n = read(c->fd, c->chunk->payload + c->chunk->received, c->chunk_left);
+            if (n > 0) {
+                c->chunk->received += n;
+                c->chunk_left -= n;
+                if (c->chunk_left == 0 && rtmp_client_end_chunk(c) < 0) {
+                    rtmp_client_fail(c, EPROTO);
+                    return;
+                }
+            }
+        } else {
+            if (c->in.pos == c->in.size) {
+                c->in.pos = c->in.size = 0;
+            }
+            if (rtmp_buffer_reserve(&c->in, c->read_size / 2) < 0) {
+                rtmp_client_fail(c, ENOMEM);
+                return;
+            }
+            n = read(c->fd, c->in.data + c->in.size, c->in.capacity - c->in.size);
+            if (n > 0) {
+                c->in.size += n;
+                if (rtmp_client_parse(c) < 0) {
+                    rtmp_client_fail(c, EPROTO);
+                    return;
+                }
+            }
+        }
+
+        if (n == 0) {
+            rtmp_client_fail(c, 0);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                rtmp_client_fail(c, errno);
+                return;
+            }
+            break;
+        }
+
+        c->in_bytes += n;
+        c->deadline = rtmp_now_ms() + c->timeout_ms;
+        rtmp_client_on_read(c, n);
+    }
+
+    if (c->state == RTMP_CLIENT_STATE_CLOSED) {
+        return;
+    }
+    // acknowledge when a window of bytes is received
+    if (c->ack_window > 0 && c->in_bytes - c->in_acked >= c->ack_window) {
+        char buf[4];
+        rtmp_write_be(buf, (u_int32_t)c->in_bytes, 4);
+        c->in_acked = c->in_bytes;
+        if (rtmp_client_queue_message(c, RTMP_CID_CONTROL, RTMP_MSG_ACK, 0, buf, 4) < 0) {
+            rtmp_client_fail(c, ENOMEM);
+            return;
+        }
+    }
+    rtmp_client_flush(c);
+}
+
+static void rtmp_client_on_writable(RtmpClient *c)
+{
+    if (c->state == RTMP_CLIENT_STATE_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        char *p;
+        int i;
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            rtmp_client_fail(c, err ? err : errno);
+            return;
+        }
+        c->startup.connect_us = rtmp_client_phase_end(c);
+
+        // c0 and c1 of simple handshake, time, zero and random
+        if (rtmp_buffer_reserve(&c->out, 1 + RTMP_HANDSHAKE_SIZE) < 0) {
+            rtmp_client_fail(c, ENOMEM);
+            return;
+        }
+        p = c->out.data + c->out.size;
+        *p++ = 0x03;
+        p = rtmp_write_be(p, (u_int32_t)time(NULL), 4);
+        p = rtmp_write_be(p, 0, 4);
+        for (i = 8; i < RTMP_HANDSHAKE_SIZE; i++) {
+            *p++ = (char)rand();
+        }
+        c->out.size = p - c->out.data;
+        c->state = RTMP_CLIENT_STATE_HANDSHAKE;
+        c->deadline = rtmp_now_ms() + c->timeout_ms;
+    }
+    rtmp_client_flush(c);
+}
+
+RtmpPoller *rtmp_poller_create()
+{
+    RtmpPoller *poller = calloc(1, sizeof(RtmpPoller));
+    if (!poller) {
+        return NULL;
+    }
+    poller->epfd = epoll_create(1024);
+    if (poller->epfd < 0) {
+        logger(LOG_ERROR, "create rtmp poller failed, errno %d", errno);
+        free(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+void rtmp_poller_destroy(RtmpPoller *poller)
+{
+    if (!poller) {
+        return;
+    }
+    // clients are destroyed by their owners
+    while (poller->clients) {
+        RtmpClient *c = poller->clients;
+        rtmp_client_close_fd(c);
+        poller->clients = c->next;
+        c->prev = c->next = NULL;
+        c->poller = NULL;
+    }
+    close(poller->epfd);
+    free(poller);
+}
+
+int rtmp_poller_run(RtmpPoller *poller, int timeout_ms)
+{
+    struct epoll_event events[64];
+    int64_t now = rtmp_now_ms();
+    RtmpClient *c;
+    int n;
+    int i;
+
+    // wake up for the nearest deadline
+    for (c = poller->clients; c; c = c->next) {
+        if (c->state != RTMP_CLIENT_STATE_CLOSED && c->deadline - now < timeout_ms) {
+            timeout_ms = c->deadline > now ? (int)(c->deadline - now) : 0;
+        }
+    }
+
+    n = epoll_wait(poller->epfd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        logger(LOG_ERROR, "rtmp poller wait failed, errno %d", errno);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        c = events[i].data.ptr;
+        if (c->state == RTMP_CLIENT_STATE_CLOSED) {
+            continue;
+        }
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            rtmp_client_on_writable(c);
+        }
+        if (c->state != RTMP_CLIENT_STATE_CLOSED && c->state != RTMP_CLIENT_STATE_CONNECTING &&
+            (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            rtmp_client_on_readable(c);
+        }
+    }
+
+    now = rtmp_now_ms();
+    for (c = poller->clients; c; c = c->next) {
+        if (c->state != RTMP_CLIENT_STATE_CLOSED && now >= c->deadline) {
+            rtmp_client_fail(c, ETIMEDOUT);
+        }
+    }
+    return 0;
+}
+
+static void rtmp_client_queue_tag(void *opaque, char type, u_int32_t timestamp, char *data, int size);
+
+RtmpClient *rtmp_client_create(const char *url, RtmpTagCallback on_tag, RtmpCloseCallback on_close, void *opaque)
+{
+    RtmpClient *c;
+    const char *host;
+    const char *path;
+    const char *stream;
+    const char *colon;
+
+    if (strncmp(url, "rtmp://", 7)) {
+        logger(LOG_ERROR, "invalid rtmp url %s", url);
+        return NULL;
+    }
+    host = url + 7;
+    path = strchr(host, '/');
+    stream = strrchr(url, '/');
+    if (!path || stream == path) {
+        logger(LOG_ERROR, "no app or stream in rtmp url %s", url);
+        return NULL;
+    }
+
+    c = calloc(1, sizeof(RtmpClient));
+    if (!c) {
+        return NULL;
+    }
+    c->fd = -1;
+    c->timeout_ms = RTMP_CLIENT_TIMEOUT_MS;
+    c->in_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+    c->read_size = RTMP_CLIENT_BUFFER_SIZE;
+    c->on_tag = on_tag;
+    c->on_close = on_close;
+    c->opaque = opaque;
+    if (!on_tag) {
+        c->on_tag = rtmp_client_queue_tag;
+        c->opaque = c;
+    }
+
+    // same as srs_rtmp_create, app is the path before the last slash
+    colon = memchr(host, ':', path - host);
+    snprintf(c->host, sizeof(c->host), "%.*s", (int)((colon ? colon : path) - host), host);
+    c->port = colon ? atoi(colon + 1) : RTMP_DEFAULT_PORT;
+    snprintf(c->app, sizeof(c->app), "%.*s", (int)(stream - path - 1), path + 1);
+    snprintf(c->stream, sizeof(c->stream), "%s", stream + 1);
+    snprintf(c->tc_url, sizeof(c->tc_url), "rtmp://%s:%d/%s", c->host, c->port, c->app);
+    return c;
+}
+
+void rtmp_client_set_timeout(RtmpClient *client, int timeout_ms)
+{
+    client->timeout_ms = timeout_ms;
+}
+
+void rtmp_client_set_server_ip(RtmpClient *client, const char *ip)
+{
+    snprintf(client->server_ip, sizeof(client->server_ip), "%s", ip ? ip : "");
+}
+
+void rtmp_client_set_pipeline(RtmpClient *client, int pipeline)
+{
+    client->pipeline = pipeline;
+}
+
+void rtmp_client_set_recv_buffer(RtmpClient *client, int max_size)
+{
+    client->recv_max = max_size > RTMP_CLIENT_BUFFER_SIZE ? max_size : 0;
+}
+
+void rtmp_client_set_merge_read(RtmpClient *client, int sleep_ms)
+{
+    client->merge_read_ms = sleep_ms;
+}
+
+void rtmp_client_set_interrupt(RtmpClient *client, RtmpInterruptCallback interrupt, void *opaque)
+{
+    client->interrupt = interrupt;
+    client->interrupt_opaque = opaque;
+}
+
+int rtmp_client_start(RtmpClient *c, RtmpPoller *poller)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char port[16];
+    int on = 1;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (c->server_ip[0]) {
+        hints.ai_flags = AI_NUMERICHOST;
+    }
+    snprintf(port, sizeof(port), "%d", c->port);
+    c->phase_start = rtmp_now_us();
+    ret = getaddrinfo(c->server_ip[0] ? c->server_ip : c->host, port, &hints, &res);
+    if (ret != 0 || !res) {
+        logger(LOG_ERROR, "resolve rtmp host %s failed, %s", c->host, gai_strerror(ret));
+        return -1;
+    }
+    c->startup.dns_us = rtmp_client_phase_end(c);
+    inet_ntop(AF_INET, &((struct sockaddr_in *)res->ai_addr)->sin_addr, c->server_ip, sizeof(c->server_ip));
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    ret = connect(c->fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (ret < 0 && errno != EINPROGRESS) {
+        logger(LOG_ERROR, "connect rtmp %s:%d failed, errno %d", c->host, c->port, errno);
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    c->poller = poller;
+    c->state = RTMP_CLIENT_STATE_CONNECTING;
+    c->deadline = rtmp_now_ms() + c->timeout_ms;
+    c->next = poller->clients;
+    if (poller->clients) {
+        poller->clients->prev = c;
+    }
+    poller->clients = c;
+
+    rtmp_client_update_events(c);
+    return c->state == RTMP_CLIENT_STATE_CLOSED ? -1 : 0;
+}
+
+int rtmp_client_state(RtmpClient *client)
+{
+    return client->state;
+}
+
+const char *rtmp_client_server_ip(RtmpClient *client)
+{
+    return client->server_ip;
+}
+
+const RtmpClientStartup *rtmp_client_startup(RtmpClient *client)
+{
+    return &client->startup;
+}
+
+void rtmp_client_recv_stats(RtmpClient *client, RtmpClientRecvStats *stats)
+{
+    stats->nb_reads = client->nb_reads;
+    stats->nb_bytes = client->in_bytes;
+    stats->nb_moved = client->in.moved;
+    stats->buffer_size = client->in.capacity;
+}
+
+void rtmp_client_destroy(RtmpClient *c)
+{
+    RtmpPoller *own;
+
+    if (!c) {
+        return;
+    }
+    own = c->own_poller ? c->poller : NULL;
+    rtmp_client_close_fd(c);
+    if (c->poller) {
+        if (c->prev) {
+            c->prev->next = c->next;
+        } else {
+            c->poller->clients = c->next;
+        }
+        if (c->next) {
+            c->next->prev = c->prev;
+        }
+    }
+    while (c->chunk_streams) {
+        RtmpChunkStream *cs = c->chunk_streams;
+        c->chunk_streams = cs->next;
+        srs_rtmp_free_packet(cs->payload);
+        free(cs);
+    }
+    while (c->tags_count > 0) {
+        srs_rtmp_free_packet(c->tags[c->tags_head].data);
+        c->tags_head = (c->tags_head + 1) & (c->tags_capacity - 1);
+        c->tags_count--;
+    }
+    free(c->tags);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+    if (own) {
+        rtmp_poller_destroy(own);
+    }
+}
+
+// tags of the blocking wrapper are queued until read
+static void rtmp_client_queue_tag(void *opaque, char type, u_int32_t timestamp, char *data, int size)
+{
+    RtmpClient *c = opaque;
+    RtmpTag *tag;
+
+    if (c->tags_count == c->tags_capacity) {
+        int capacity = c->tags_capacity ? c->tags_capacity * 2 : RTMP_CLIENT_TAG_QUEUE_SIZE;
+        RtmpTag *tags = malloc(capacity * sizeof(RtmpTag));
+        int i;
+
+        if (!tags) {
+            srs_rtmp_free_packet(data);
+            rtmp_client_fail(c, ENOMEM);
+            return;
+        }
+        // unwrap the ring in order
+        for (i = 0; i < c->tags_count; i++) {
+            tags[i] = c->tags[(c->tags_head + i) & (c->tags_capacity - 1)];
+        }
+        free(c->tags);
+        c->tags = tags;
+        c->tags_head = 0;
+        c->tags_capacity = capacity;
+    }
+    tag = &c->tags[(c->tags_head + c->tags_count) & (c->tags_capacity - 1)];
+    tag->type = type;
+    tag->timestamp = timestamp;
+    tag->data = data;
+    tag->size = size;
+    c->tags_count++;
+}
+
+int rtmp_client_play(RtmpClient *c)
+{
+    RtmpPoller *poller = rtmp_poller_create();
+
+    if (!poller) {
+        return -1;
+    }
+    if (rtmp_client_start(c, poller) < 0) {
+        rtmp_poller_destroy(poller);
+        return -1;
+    }
+    c->own_poller = 1;
+
+    while (c->state < RTMP_CLIENT_STATE_PLAY) {
+        if (c->interrupt && c->interrupt(c->interrupt_opaque)) {
+            logger(LOG_WARN, "rtmp client play %s/%s interrupted", c->tc_url, c->stream);
+            return -1;
+        }
+        // the deadline of the phase still closes the client on timeout
+        if (rtmp_poller_run(poller, c->interrupt ? RTMP_CLIENT_INTERRUPT_MS : c->timeout_ms) < 0) {
+            break;
+        }
+    }
+    if (c->state == RTMP_CLIENT_STATE_CLOSED || c->state < RTMP_CLIENT_STATE_PLAY) {
+        logger(LOG_ERROR, "rtmp client play %s/%s failed, error %d", c->tc_url, c->stream, c->error);
+        return -1;
+    }
+    return 0;
+}
+
+int rtmp_client_read_packet(RtmpClient *c, char *type, u_int32_t *timestamp, char **data, int *size)
+{
+    RtmpTag *tag;
+
+    while (!c->tags_count && c->state != RTMP_CLIENT_STATE_CLOSED) {
+        // a small read is merged with the data arriving in the sleep
+        if (c->merge_read_ms > 0 && c->bitrate > 0 && c->last_read_bytes > 0 &&
+            c->last_read_bytes < RTMP_CLIENT_MR_SMALL_BYTES) {
+            int64_t sleep_ms = RTMP_CLIENT_MR_TARGET_BYTES * 1000 / c->bitrate;
+            if (sleep_ms > c->merge_read_ms) {
+                sleep_ms = c->merge_read_ms;
+            }
+            c->last_read_bytes = 0;
+            if (sleep_ms > 0) {
+                usleep(sleep_ms * 1000);
+            }
+        }
+        if (rtmp_poller_run(c->poller, c->timeout_ms) < 0) {
+            return -1;
+        }
+    }
+    if (!c->tags_count) {
+        return -1;
+    }
+
+    tag = &c->tags[c->tags_head];
+    c->tags_head = (c->tags_head + 1) & (c->tags_capacity - 1);
+    c->tags_count--;
+    *type = tag->type;
+    *timestamp = tag->timestamp;
+    *data = tag->data;
+    *size = tag->size;
+    return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef RTMP_CLIENT_H_
+#define RTMP_CLIENT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RTMP_CLIENT_STATE_INIT (0)
+#define RTMP_CLIENT_STATE_CONNECTING (1)
+#define RTMP_CLIENT_STATE_HANDSHAKE (2)
+#define RTMP_CLIENT_STATE_CONNECT_APP (3)
+#define RTMP_CLIENT_STATE_CREATE_STREAM (4)
+// play is sent, no media yet
+#define RTMP_CLIENT_STATE_PLAY (5)
+#define RTMP_CLIENT_STATE_PLAYING (6)
+#define RTMP_CLIENT_STATE_CLOSED (7)
+
+// timeout of every phase and of receiving while playing
+#define RTMP_CLIENT_TIMEOUT_MS 5000
+// rtmp_client_play checks the interrupt callback at least this often
+#define RTMP_CLIENT_INTERRUPT_MS 100
+// reads per readiness, so one busy stream does not starve the others
+#define RTMP_CLIENT_MAX_READS 16
+#define RTMP_CLIENT_BUFFER_SIZE 65536
+// initial tags queued by the blocking wrapper, doubled when full
+#define RTMP_CLIENT_TAG_QUEUE_SIZE 64
+// the rest of a chunk is read into the message directly when at least this large
+#define RTMP_CLIENT_DIRECT_READ_MIN 4096
+// the adaptive read size holds this of the bitrate observed in each window
+#define RTMP_CLIENT_ADAPTIVE_BUFFER_MS 500
+#define RTMP_CLIENT_ADAPTIVE_WINDOW_MS 1000
+// a read less than this is merged with the data arriving in a sleep
+#define RTMP_CLIENT_MR_SMALL_BYTES 4096
+// sleep to get about this size at next read, at the observed bitrate
+#define RTMP_CLIENT_MR_TARGET_BYTES 65536
+
+typedef struct RtmpClient RtmpClient;
+typedef struct RtmpPoller RtmpPoller;
+
+// time of the startup phases in us
+typedef struct {
+    int64_t dns_us;
+    int64_t connect_us;
+    int64_t handshake_us;
+    // connect app, and createStream and play when pipelined
+    int64_t connect_app_us;
+    int64_t play_us;
+} RtmpClientStartup;
+
+typedef struct {
+    // read syscalls and the bytes got by them
+    int64_t nb_reads;
+    int64_t nb_bytes;
+    // residual bytes moved to make space in the input buffer
+    int64_t nb_moved;
+    int buffer_size;
+} RtmpClientRecvStats;
+
+/**
+ * a complete flv tag of the stream, type is SRS_RTMP_TYPE_*.
+ * data is owned by the callback, and must be freed by srs_rtmp_free_packet.
+ */
+typedef void (*RtmpTagCallback)(void *opaque, char type, u_int32_t timestamp, char *data, int size);
+
+/**
+ * the session is closed, error is an errno value or 0 when closed by peer.
+ * the client stays closed until rtmp_client_destroy, which must not be
+ * called from the callbacks.
+ */
+typedef void (*RtmpCloseCallback)(void *opaque, int error);
+
+// return nonzero to give up waiting
+typedef int (*RtmpInterruptCallback)(void *opaque);
+
+RtmpPoller *rtmp_poller_create();
+
+void rtmp_poller_destroy(RtmpPoller *poller);
+
+/**
+ * wait at most timeout_ms for readiness, then drive the clients ready and
+ * close the clients timed out. return -1 on error.
+ */
+int rtmp_poller_run(RtmpPoller *poller, int timeout_ms);
+
+/**
+ * create a client playing url, rtmp://host[:port]/app/stream.
+ * tags are queued for rtmp_client_read_packet when on_tag is NULL.
+ */
+RtmpClient *rtmp_client_create(const char *url, RtmpTagCallback on_tag, RtmpCloseCallback on_close, void *opaque);
+
+void rtmp_client_set_timeout(RtmpClient *client, int timeout_ms);
+
+/**
+ * connect to ip instead of resolving the host of url.
+ */
+void rtmp_client_set_server_ip(RtmpClient *client, const char *ip);
+
+/**
+ * send createStream and play right after connect, without waiting for
+ * the results. play is sent again if the stream id is not the expected.
+ */
+void rtmp_client_set_pipeline(RtmpClient *client, int pipeline);
+
+/**
+ * grow the reads to hold RTMP_CLIENT_ADAPTIVE_BUFFER_MS of the bitrate,
+ * at most max_size bytes. 0 for the fixed default.
+ */
+void rtmp_client_set_recv_buffer(RtmpClient *client, int max_size);
+
+/**
+ * a small read of rtmp_client_read_packet sleeps for the time to get
+ * RTMP_CLIENT_MR_TARGET_BYTES at the bitrate, at most sleep_ms. 0 to disable.
+ */
+void rtmp_client_set_merge_read(RtmpClient *client, int sleep_ms);
+
+/**
+ * rtmp_client_play fails when interrupt returns nonzero.
+ */
+void rtmp_client_set_interrupt(RtmpClient *client, RtmpInterruptCallback interrupt, void *opaque);
+
+/**
+ * resolve and start connecting, the handshake, connect, createStream and
+ * play are driven by rtmp_poller_run of poller.
+ */
+int rtmp_client_start(RtmpClient *client, RtmpPoller *poller);
+
+int rtmp_client_state(RtmpClient *client);
+
+// the address connected to, empty before rtmp_client_start
+const char *rtmp_client_server_ip(RtmpClient *client);
+
+const RtmpClientStartup *rtmp_client_startup(RtmpClient *client);
+
+void rtmp_client_recv_stats(RtmpClient *client, RtmpClientRecvStats *stats);
+
+void rtmp_client_destroy(RtmpClient *client);
+
+/**
+ * blocking drive of a client created without on_tag, with the semantics
+ * of srs_rtmp_handshake, connect_app and play_stream: return when play is
+ * sent, -1 on error.
+ */
+int rtmp_client_play(RtmpClient *client);
+
+/**
+ * blocking wrapper of srs_rtmp_read_packet, return 0 or -1 on error.
+ * data must be freed by srs_rtmp_free_packet.
+ */
+int rtmp_client_read_packet(RtmpClient *client, char *type, u_int32_t *timestamp, char **data, int *size);
+
+#endif
@@ -7,6 +7,8 @@
 
 #define MAX_WAIT_KEYFRAME_COUNT 1000
 #define MAX_WRITE_FAIL_COUNT 20
+// max analyze duration of probing streams, in us
+#define SEG_MAX_ANALYZE_DURATION 3000000
 
 #define COUNT_IF(count, limit) (count)++; if((count) >= (limit))
 
@@ -31,15 +33,133 @@ static int interrupt_callback(void *p) {
 
 static int chunk_begin(SegHandler *sh, int reinit, int got_pkt);
 
+static const char *seg_output_format_name(SegHandler *sh)
+{
+    if (sh->params.seg_format == SEG_FORMAT_FMP4) {
+        return "mp4";
+    }
+    return "mpegts";
+}
+
+/**
+ * the segment file is closed already, so the trailer (mfra) of mp4
+ * muxer is dropped into a dynamic buffer, just to free muxer resources.
+ */
+static void fmp4_write_trailer(SegHandler *sh)
+{
+    uint8_t *buf = NULL;
+    int ret = avio_open_dyn_buf(&sh->oc->pb);
+    if (ret < 0) {
+        av_error("avio_open_dyn_buf", ret);
+        return;
+    }
+    av_write_trailer(sh->oc);
+    avio_close_dyn_buf(sh->oc->pb, &buf);
+    sh->oc->pb = NULL;
+    av_free(buf);
+}
+
+/**
+ * mp4 muxer can not change codec configuration after header written,
+ * so create a new output context with the same streams for the new
+ * init segment.
+ */
+static int fmp4_output_reinit(SegHandler *sh)
+{
+    AVFormatContext *oc = NULL;
+    unsigned int i;
+    int ret;
+
+    ret = avformat_alloc_output_context2(&oc, NULL, seg_output_format_name(sh), NULL);
+    if (ret < 0) {
+        av_error("avformat_alloc_output_context2", ret);
+        return -1;
+    }
+    oc->interrupt_callback = sh->oc->interrupt_callback;
+    oc->opaque = sh;
+    oc->max_delay = sh->oc->max_delay;
+
+    for (i = 0; i < sh->oc->nb_streams; i++) {
+        AVStream *old_stream = sh->oc->streams[i];
+        AVStream *out_stream = avformat_new_stream(oc, old_stream->codec->codec);
+        if (out_stream == NULL) {
+            logger(LOG_ERROR, "avformat_new_stream fail, out of memory");
+            avformat_free_context(oc);
+            return -1;
+        }
+        avcodec_copy_context(out_stream->codec, old_stream->codec);
+        out_stream->codec->codec_tag = old_stream->codec->codec_tag;
+        out_stream->time_base = old_stream->time_base;
+    }
+    for (i = 0; i < MAX_STREAMS; i++) {
+        if (sh->streams[i].out_stream) {
+            sh->streams[i].out_stream = oc->streams[sh->streams[i].out_stream->index];
+        }
+    }
+
+    fmp4_write_trailer(sh);
+    avformat_free_context(sh->oc);
+    sh->oc = oc;
+    return 0;
+}
+
+static int fmp4_write_init(SegHandler *sh)
+{
+    int ret = 0;
+    AVDictionary *options = NULL;
+
+    if (sh->init_index > 0 && fmp4_output_reinit(sh) < 0) {
+        return -1;
+    }
+
+    snprintf(sh->init_file, sizeof(sh->init_file), "%s-init-%u.mp4", sh->params.name, sh->init_index);
+    ret = avio_open2(&sh->oc->pb, sh->init_file, AVIO_FLAG_WRITE, NULL, NULL);
+    if (ret < 0) {
+        av_error("avio_open2", ret);
+        return -1;
+    }
+
+    // ftyp and moov only, fragments are cut by av_write_frame(oc, NULL)
+    // at chunk and segment end, with tfdt and moof relative offsets.
+    ret = av_dict_set(&options, "movflags", "+frag_custom+empty_moov+default_base_moof+dash", 0);
+    if (ret < 0) {
+        av_error("av_dict_set", ret);
+        avio_closep(&sh->oc->pb);
+        return -1;
+    }
+    ret = avformat_write_header(sh->oc, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        av_error("avformat write header", ret);
+        avio_closep(&sh->oc->pb);
+        return -1;
+    }
+    avio_flush(sh->oc->pb);
+    avio_closep(&sh->oc->pb);
+
+    logger(LOG_INFO, "new init segment: %s", sh->init_file);
+    sh->init_index++;
+    sh->init_dirty = 0;
+    return 0;
+}
+
 static int seg_file_begin(SegHandler *sh, int got_pkt) 
 {
     int ret = 0;
+    const char *ext = "ts";
+
+    if (sh->params.seg_format == SEG_FORMAT_FMP4) {
+        ext = "m4s";
+        if (sh->init_dirty && fmp4_write_init(sh) < 0) {
+            return -1;
+        }
+    }
 
     if (sh->params.align) {
-        snprintf(sh->file, sizeof(sh->file), "%s-%u-%u.ts", sh->params.name, sh->index, sh->seg_index);
+        snprintf(sh->file, sizeof(sh->file), "%s-%u-%u.%s", sh->params.name, sh->index, sh->seg_index, ext);
         sh->seg_index ++;
     } else {
-        snprintf(sh->file, sizeof(sh->file), "%s-%u.ts", sh->params.name, sh->index);
+        snprintf(sh->file, sizeof(sh->file), "%s-%u.%s", sh->params.name, sh->index, ext);
     }
 
     AVDictionary *pb_options = NULL;
@@ -50,32 +170,34 @@ static int seg_file_begin(SegHandler *sh, int got_pkt)
     }
 
     AVDictionary *options = NULL;
-    if (sh->params.workaround_hevcaud) {
-        ret = av_dict_set(&options, "hevc_no_aud", "1", 0);
-        if(ret < 0) {
-            av_error("av_dict_set", ret);
-            return -1;
+    if (sh->params.seg_format == SEG_FORMAT_TS) {
+        if (sh->params.workaround_hevcaud) {
+            ret = av_dict_set(&options, "hevc_no_aud", "1", 0);
+            if(ret < 0) {
+                av_error("av_dict_set", ret);
+                return -1;
+            }
         }
-    }
-    if (sh->params.workaround_h264aud) {
-        ret = av_dict_set(&options, "h264_no_aud", "1", 0);
-        if(ret < 0) {
-            av_error("av_dict_set", ret);
-            return -1;
+        if (sh->params.workaround_h264aud) {
+            ret = av_dict_set(&options, "h264_no_aud", "1", 0);
+            if(ret < 0) {
+                av_error("av_dict_set", ret);
+                return -1;
+            }
         }
-    }
-    if (sh->params.copyts) {
-        ret = av_dict_set(&options, "mpegts_copyts", "1", 0);
-        if(ret < 0) {
-            av_error("av_dict_set", ret);
+        if (sh->params.copyts) {
+            ret = av_dict_set(&options, "mpegts_copyts", "1", 0);
+            if(ret < 0) {
+                av_error("av_dict_set", ret);
+                return -1;
+            }
+        }
+        ret = avformat_write_header(sh->oc, &options);
+        if (ret < 0) {
+            av_error("avformat write header", ret);
             return -1;
         }
     }
-    ret = avformat_write_header(sh->oc, &options);
-    if (ret < 0) {
-        av_error("avformat write header", ret);
-        return -1;
-    }
     memset(&sh->seg_data, 0, sizeof(sh->seg_data));
 
     if(sh->params.is_lhls) {
@@ -92,7 +214,7 @@ static int seg_file_begin(SegHandler *sh, int got_pkt)
     if(pb_options) {
         av_dict_free(&pb_options);
     }
-    logger(LOG_INFO, "new ts: %s", sh->file);
+    logger(LOG_INFO, "new %s: %s", ext, sh->file);
     return 0;
 }
 
@@ -123,8 +245,13 @@ static void do_judge_discontinuity_on_seg_end(SegHandler *sh)
 
 static void seg_file_end(SegHandler *sh, int last) 
 {
+    uint64_t stage_start = stage_hist_begin();
     int i;
-    if (last || (sh->flags & NF_NO_VIDEO)) {
+    if (sh->params.seg_format == SEG_FORMAT_FMP4) {
+        // flush the last moof/mdat into this segment, trailer is dropped.
+        av_interleaved_write_frame(sh->oc, NULL);
+        av_write_frame(sh->oc, NULL);
+    } else if (last || (sh->flags & NF_NO_VIDEO)) {
         av_write_trailer(sh->oc);
     } else if(sh->is_base_missing || sh->params.output_noninterleaved) {
         logger(LOG_WARN, "flush all av frames in interleave buffer");
@@ -143,17 +270,37 @@ static void seg_file_end(SegHandler *sh, int last)
         }
         avio_closep(&sh->oc->pb);
     }
+    if (last && sh->params.seg_format == SEG_FORMAT_FMP4) {
+        fmp4_write_trailer(sh);
+    }
 
     if(sh->params.do_judge_discontinuity) {
         do_judge_discontinuity_on_seg_end(sh);
     }
+    if (sh->input_reconnected) {
+        sh->discontinuity_before = 1;
+        sh->input_reconnected = 0;
+    }
 
     logger(LOG_INFO, "seg cut[%d]: duration: %lld", sh->index, sh->duration);
+    latency_on_publish(&sh->seg_data.latency, &g_metrics.segment_latency);
+    if (sh->params.is_lhls) {
+        // the last chunk is published with the segment
+        latency_on_publish(&sh->chunk_data.latency, &g_metrics.chunk_latency);
+    }
+    uint64_t notify_start = stage_hist_begin();
+    int64_t notify_time = av_gettime_relative();
     sh->params.notify(sh, last);
+    metrics_set(&g_metrics.notify_latency_us, av_gettime_relative() - notify_time);
+    stage_hist_end(notify_start, STAGE_NOTIFY, STAGE_STREAM_OTHER);
+    metrics_add(&g_metrics.segments, 1);
+    sh->discontinuity_before = 0;
     memset(&sh->seg_data, 0, sizeof(sh->seg_data));
+    memset(&sh->chunk_data, 0, sizeof(sh->chunk_data));
 
     sh->index++;
     sh->duration = 0;
+    metrics_set(&g_metrics.segment_duration_us, 0);
     sh->count = 0;
     sh->wait_keyframe_count = 0;
     sh->write_fail_count = 0;
@@ -174,7 +321,8 @@ static void seg_file_end(SegHandler *sh, int last)
         if(desc) {
             if(desc->update_type == METAKEY_UPDATE_SEG_FIRST ||
                 desc->update_type == METAKEY_UPDATE_SEG_LAST) {
-                AVDictionaryEntry *entry = av_dict_get(sh->ic->metadata, desc->key, 0, AV_DICT_MATCH_CASE);
+                // no input when reconnect failed
+                AVDictionaryEntry *entry = sh->ic ? av_dict_get(sh->ic->metadata, desc->key, 0, AV_DICT_MATCH_CASE) : NULL;
                 info->status = METAKEY_VAL_STAT_INIT;
                 if (entry) {
                     // delete key to detect the first one in next loop.
@@ -183,6 +331,7 @@ static void seg_file_end(SegHandler *sh, int last)
             }
         }
     }
+    stage_hist_end(stage_start, STAGE_FILE_END, STAGE_STREAM_OTHER);
 }
 
 static int chunk_begin(SegHandler *sh, int reinit, int got_pkt)
@@ -202,9 +351,13 @@ static int chunk_begin(SegHandler *sh, int reinit, int got_pkt)
 
 static void chunk_end(SegHandler *sh) 
 {
+    uint64_t stage_start = stage_hist_begin();
+
     av_interleaved_write_frame(sh->oc, NULL);
 
-    if (sh->params.llhls_notify_independent) {
+    // for fmp4, each chunk is a moof/mdat fragment
+    if (sh->params.llhls_notify_independent ||
+        sh->params.seg_format == SEG_FORMAT_FMP4) {
         av_write_frame(sh->oc, NULL);
     }
 
@@ -213,10 +366,17 @@ static void chunk_end(SegHandler *sh)
         sh->chunk_end = avio_tell(sh->oc->pb);
     }
     logger(LOG_INFO, "chunk[%lld]: duration = %lld", sh->chunk_index, sh->chunk_duration);
+    latency_on_publish(&sh->chunk_data.latency, &g_metrics.chunk_latency);
+    uint64_t notify_start = stage_hist_begin();
+    int64_t notify_time = av_gettime_relative();
     sh->params.chunk_notify(sh);
+    metrics_set(&g_metrics.notify_latency_us, av_gettime_relative() - notify_time);
+    stage_hist_end(notify_start, STAGE_NOTIFY, STAGE_STREAM_OTHER);
+    metrics_add(&g_metrics.chunks, 1);
     memset(&sh->chunk_data, 0, sizeof(sh->chunk_data));
 
     sh->chunk_index++;
+    stage_hist_end(stage_start, STAGE_FILE_END, STAGE_STREAM_OTHER);
 }
 
 static void copy_streams(SegHandler *sh, enum AVMediaType type, int base)
@@ -246,6 +406,11 @@ static void copy_streams(SegHandler *sh, enum AVMediaType type, int base)
             AVStream *out_stream = avformat_new_stream(sh->oc, in_stream->codec->codec);
             avcodec_copy_context(out_stream->codec, in_stream->codec);
             out_stream->codec->codec_tag = 0;
+            if (sh->params.seg_format == SEG_FORMAT_FMP4 &&
+                in_stream->codec->codec_id == AV_CODEC_ID_HEVC) {
+                // hvc1 is required by apple devices
+                out_stream->codec->codec_tag = MKTAG('h', 'v', 'c', '1');
+            }
             if (sh->oc->oformat->flags & AVFMT_GLOBALHEADER) {
                 out_stream->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
             }
@@ -288,6 +453,9 @@ void seg_init(SegHandler *sh, const SegParams *sp)
     sh->chunk_duration = 0;
     sh->chunk_start = 0;
     sh->chunk_end = 0;
+    sh->init_file[0] = '\0';
+    sh->init_index = 0;
+    sh->init_dirty = 1;
     sh->count = 0;
     sh->wait_keyframe_count = 0;
     sh->write_fail_count = 0;
@@ -300,6 +468,11 @@ void seg_init(SegHandler *sh, const SegParams *sp)
     memset(&sh->statis, 0, sizeof(SegStatis));
     sh->statis.first_frame_pts = AV_NOPTS_VALUE;
 
+    stage_hist_init(sp->stage_hist);
+    if (sp->packet_trace) {
+        pkt_trace_open(sp->packet_trace, sp->packet_trace_records);
+    }
+
     int i;
     for(i = 0; i < MAX_STREAMS; i++) {
         sh->streams[i].in_stream = NULL;
@@ -341,6 +514,9 @@ void seg_init(SegHandler *sh, const SegParams *sp)
     }
 
     sh->insert_discontinuity = 0;
+    sh->input_offset = 0;
+    sh->input_rebase = 0;
+    sh->input_reconnected = 0;
     sh->curr_chunk_flag = CURR_CHUNK_FLAG_NONE;
     sh->stream_flags = STREAM_FLAGS_NONE;
 
@@ -381,6 +557,8 @@ void seg_init(SegHandler *sh, const SegParams *sp)
 
 void seg_uninit(SegHandler *sh, SegParams *sp)
 {
+    stage_hist_uninit();
+    pkt_trace_close();
     if (sp->custom_metakey) {
         av_free(&sp->custom_metakey);
     }
@@ -400,7 +578,7 @@ static void ff_logger(void *avcl, int level, const char *fmt, va_list vl)
     } else {
         mylv = LOG_DEBUG;
     }
-    if (mylv > logger_level()) {
+    if (!logger_enabled(mylv)) {
         return;
     }
     char line[1024] = {0};
@@ -447,10 +625,207 @@ static void try_update_metakey(SegHandler *sh)
     }
 }
 
+// the stream of type is probed, with the parameters to output
+static int has_probed_stream(SegHandler *sh, enum AVMediaType type)
+{
+    int i;
+    for (i = 0; i < sh->ic->nb_streams; i++) {
+        AVCodecContext *codec = sh->ic->streams[i]->codec;
+        if (codec->codec_type != type) {
+            continue;
+        }
+        if (type == AVMEDIA_TYPE_VIDEO) {
+            return codec->width > 0 && codec->height > 0;
+        }
+        return codec->sample_rate > 0 && codec->channels > 0;
+    }
+    return 0;
+}
+
+/**
+ * the streams of onMetaData are probed once their sequence headers and
+ * first frames are read, the flv demuxer stops as soon as both streams
+ * are found and the frame rate is taken from onMetaData, so probing is
+ * bounded by fast_start_ms rather than SEG_MAX_ANALYZE_DURATION.
+ * probe again in the full duration if a stream of onMetaData is missing.
+ */
+static int fast_find_stream_info(SegHandler *sh, const FlvMetadata *meta)
+{
+    AVFormatContext *ic = sh->ic;
+    int ret;
+
+    ic->max_analyze_duration = (int64_t)sh->params.fast_start_ms * 1000;
+    ic->fps_probe_size = 0;
+    ret = avformat_find_stream_info(ic, NULL);
+    ic->max_analyze_duration = SEG_MAX_ANALYZE_DURATION;
+    ic->fps_probe_size = -1;
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (((sh->flags & NF_NO_VIDEO) && !has_probed_stream(sh, AVMEDIA_TYPE_VIDEO)) ||
+        ((sh->flags & NF_NO_AUDIO) && !has_probed_stream(sh, AVMEDIA_TYPE_AUDIO))) {
+        logger(LOG_WARN, "fast start missed streams of onMetaData, videocodecid[%d] audiocodecid[%d], probe again",
+            meta->videocodecid, meta->audiocodecid);
+        return avformat_find_stream_info(ic, NULL);
+    }
+    logger(LOG_INFO, "fast start probed streams of onMetaData");
+    return ret;
+}
+
+/**
+ * open and probe the input of sh into sh->ic, meta is the onMetaData
+ * probed by ourselves. sh->ic is NULL on error.
+ */
+static int seg_open_input(SegHandler *sh, FlvMetadata *meta)
+{
+    int64_t start = av_gettime();
+    AVDictionary *options = NULL;
+    int i_metakey;
+    int ret;
+
+    AVFormatContext *ic = avformat_alloc_context();
+    if (ic == NULL) {
+        logger(LOG_ERROR, "avformat_alloc_context fail");
+        return EC_MEM;
+    }
+    sh->ic = ic;
+    ic->interrupt_callback.callback = interrupt_callback;
+    ic->interrupt_callback.opaque = sh;
+
+    // avoid too long time for analyzing
+    // set max analyze duration 3s
+    ic->max_analyze_duration = SEG_MAX_ANALYZE_DURATION;
+
+    av_dict_set(&options, "rtsp_transport", "tcp", 0);
+    if (sh->metakey_info[0].desc && sh->params.custom_metakey) {
+        av_dict_set(&options, "custom_metakey", sh->params.custom_metakey, 0);
+    }
+
+    ret = avformat_open_input(&sh->ic, sh->params.url, NULL, &options);
+    if (options) {
+        av_dict_free(&options);
+    }
+    if (ret < 0) {
+        av_error("avformat_open_input", ret);
+        return EC_OPEN_FAIL;
+    }
+
+    // probe flv metadata by ourselves and set flags initial
+    for (i_metakey = 0; i_metakey < sh->n_metakey; i_metakey++) {
+        const MetaKeyDesc *desc = sh->metakey_info[i_metakey].desc;
+        if (!desc) {
+            break;
+        }
+        logger(LOG_INFO, "detect customized metakey %s, type %d, update type %d",
+            desc->key, desc->type, desc->update_type);
+    }
+    meta->cyclebasetime = 0;
+    meta->filename_basetime = 0;
+    ret = probe_flv_metadata(ic->pb, sh, meta);
+    if(ret < 0) {
+        logger(LOG_ERROR, "probe_flv_metadata fail");
+    } else {
+        if (sh->params.test_vcid == 1 && meta->videocodecid == 0) {
+            logger(LOG_WARN, "set videocodecid for test");
+            meta->videocodecid = FLV_CODECID_H264;
+            meta->width = 1280;
+            meta->height = 720;
+        }
+        logger(LOG_INFO, "onMetaData: videocodecid[%d] audiocodecid[%d] width[%d] height[%d] cyclebasetime[%d] abs_base_time[%d] live_publish_timestamp[%d]",
+                meta->videocodecid, meta->audiocodecid, meta->width, meta->height, meta->cyclebasetime,
+                meta->filename_basetime, meta->live_publish_timestamp);
+        // only videocodecid, width and height > 0, consider the stream has video frame
+        if (meta->videocodecid > 0 && meta->width > 0 && meta->height > 0) {
+            sh->flags |= NF_NO_VIDEO;
+        }
+        if (meta->audiocodecid > 0) {
+            sh->flags |= NF_NO_AUDIO;
+        }
+    }
+
+    // probe by ffmpeg
+    if (sh->params.fast_start_ms > 0 && (sh->flags & (NF_NO_VIDEO | NF_NO_AUDIO))) {
+        ret = fast_find_stream_info(sh, meta);
+    } else {
+        ret = avformat_find_stream_info(ic, NULL);
+    }
+    if (ret < 0) {
+        av_error("avformat_find_stream_info", ret);
+        avformat_close_input(&sh->ic);
+        return EC_STREAM_ERR;
+    }
+    logger(LOG_INFO, "probe streams in %lld ms", (av_gettime() - start) / 1000);
+    return EC_OK;
+}
+
+/**
+ * reopen the input after a read error, with bounded backoff. the output
+ * goes on: the open segment is closed if it has frames, the next one is
+ * marked discontinuous, and timestamps continue from the last frame.
+ */
+static int seg_reconnect_input(SegHandler *sh)
+{
+    enum AVCodecID codec_ids[MAX_STREAMS];
+    FlvMetadata flvmeta = {0};
+    int64_t start = av_gettime_relative();
+    int backoff_ms = 0;
+    int flags = sh->flags;
+    int ret = EC_READ_FAIL;
+    int i;
+
+    // the new input must have the same streams
+    for (i = 0; i < MAX_STREAMS; i++) {
+        AVStream *in_stream = sh->streams[i].in_stream;
+        codec_ids[i] = in_stream ? in_stream->codec->codec_id : AV_CODEC_ID_NONE;
+        sh->streams[i].in_stream = NULL;
+    }
+    avformat_close_input(&sh->ic);
+
+    while (seg_reconnect_wait(sh, start, &backoff_ms) == 0) {
+        logger(LOG_WARN, "reconnect input %s", sh->params.url);
+        sh->actived = av_gettime_relative();
+        ret = seg_open_input(sh, &flvmeta);
+        if (ret == EC_OK) {
+            break;
+        }
+    }
+    // flags probed are of the streams, which do not change
+    sh->flags = flags;
+    if (ret != EC_OK) {
+        logger(LOG_ERROR, "reconnect input fail in %lld ms", (av_gettime_relative() - start) / 1000);
+        return ret;
+    }
+
+    if (rebind_input_streams(sh, codec_ids) < 0) {
+        return EC_STREAM_ERR;
+    }
+    sh->statis.reconnects++;
+    logger(LOG_WARN, "input reconnected in %lld ms, %lld times",
+        (av_gettime_relative() - start) / 1000, sh->statis.reconnects);
+
+    // restart bsf for the sequence headers of the new input
+    if (sh->bsfc != NULL) {
+        av_bitstream_filter_close(sh->bsfc);
+        sh->bsfc = NULL;
+    }
+    sh->input_rebase = 1;
+
+    if (sh->count > 0) {
+        seg_file_end(sh, 0);
+        if (seg_file_begin(sh, 1) < 0) {
+            return EC_OUTPUT_FAIL;
+        }
+        sh->begin = -1;
+        sh->chunk_begin = -1;
+    }
+    sh->input_reconnected = 1;
+    return EC_OK;
+}
+
 int seg_run(SegHandler *sh) 
 {
     int ret = EC_OK;
-    int i_metakey;
 
     av_register_all();
     av_log_set_callback(ff_logger);
@@ -461,22 +836,10 @@ int seg_run(SegHandler *sh)
     AVFormatContext *ic = NULL;
     AVFormatContext *oc = NULL;
 
-    do {
-        ic = avformat_alloc_context();
-        if (ic == NULL) {
-            logger(LOG_ERROR, "avformat_alloc_context fail");
-            ret = EC_MEM;
-            break;
-        }
-        sh->ic = ic;
-        ic->interrupt_callback.callback = interrupt_callback;
-        ic->interrupt_callback.opaque = sh;
+    sh->statis.start_time = av_gettime();
 
-        // avoid too long time for analyzing
-        // set max analyze duration 3s
-        ic->max_analyze_duration = 3000000;
-
-        ret = avformat_alloc_output_context2(&oc, NULL, "mpegts", NULL);
+    do {
+        ret = avformat_alloc_output_context2(&oc, NULL, seg_output_format_name(sh), NULL);
         if (ret < 0) {
             av_error("avformat_alloc_output_context2", ret);
             ret = EC_MEM;
@@ -491,70 +854,18 @@ int seg_run(SegHandler *sh)
         // set output muxer delay 0.7s
         oc->max_delay = 700000;
 
-        AVDictionary *options = NULL;
-        av_dict_set(&options, "rtsp_transport", "tcp", 0);
-        if (sh->metakey_info[0].desc && sh->params.custom_metakey) {
-            av_dict_set(&options, "custom_metakey", sh->params.custom_metakey, 0);
-        }
-
-        ret = avformat_open_input(&ic, sh->params.url, NULL, &options);
-        if (ret < 0) {
-            av_error("avformat_open_input", ret);
-            ret = EC_OPEN_FAIL;
-            break;
-        }
-
-        if (options) {
-            av_dict_free(&options);
-        }
-
-        // probe flv metadata by ourselves and set flags initial
-        for (i_metakey = 0; i_metakey < sh->n_metakey; i_metakey++) {
-            const MetaKeyDesc *desc = sh->metakey_info[i_metakey].desc;
-            if (!desc) {
-                break;
-            }
-            logger(LOG_INFO, "detect customized metakey %s, type %d, update type %d",
-                desc->key, desc->type, desc->update_type);
-        }
         FlvMetadata flvmeta = {0};
-        flvmeta.cyclebasetime = 0;
-        flvmeta.filename_basetime = 0;
-        ret = probe_flv_metadata(ic->pb, sh, &flvmeta);
-        if(ret < 0) {
-            logger(LOG_ERROR, "probe_flv_metadata fail");
-        } else {
-            if (sh->params.test_vcid == 1 && flvmeta.videocodecid == 0) {
-                logger(LOG_WARN, "set videocodecid for test");
-                flvmeta.videocodecid = FLV_CODECID_H264;
-                flvmeta.width = 1280;
-                flvmeta.height = 720;
-            }
-            logger(LOG_INFO, "onMetaData: videocodecid[%d] audiocodecid[%d] width[%d] height[%d] cyclebasetime[%d] abs_base_time[%d] live_publish_timestamp[%d]",
-                    flvmeta.videocodecid, flvmeta.audiocodecid, flvmeta.width, flvmeta.height, flvmeta.cyclebasetime,
-                    flvmeta.filename_basetime, flvmeta.live_publish_timestamp);
-            // only videocodecid, width and height > 0, consider the stream has video frame
-            if (flvmeta.videocodecid > 0 && flvmeta.width > 0 && flvmeta.height > 0) {
-                sh->flags |= NF_NO_VIDEO;
-            }
-            if (flvmeta.audiocodecid > 0) {
-                sh->flags |= NF_NO_AUDIO;
-            }
-
-            sh->next_cycle_base_time = flvmeta.cyclebasetime;
-            sh->cycle_base_time = flvmeta.cyclebasetime;
-            sh->next_filename_base_time = flvmeta.filename_basetime;
-            sh->filename_base_time = flvmeta.filename_basetime;
-            sh->live_publish_timestamp = flvmeta.live_publish_timestamp;
-        }
-
-        // probe by ffmpeg
-        ret = avformat_find_stream_info(ic, NULL);
-        if (ret < 0) {
-            av_error("avformat_find_stream_info", ret);
-            ret = EC_STREAM_ERR;
+        ret = seg_open_input(sh, &flvmeta);
+        if (ret != EC_OK) {
             break;
         }
+        ic = sh->ic;
+
+        sh->next_cycle_base_time = flvmeta.cyclebasetime;
+        sh->cycle_base_time = flvmeta.cyclebasetime;
+        sh->next_filename_base_time = flvmeta.filename_basetime;
+        sh->filename_base_time = flvmeta.filename_basetime;
+        sh->live_publish_timestamp = flvmeta.live_publish_timestamp;
 
         // check metadata
         int i;
@@ -660,6 +971,15 @@ int seg_run(SegHandler *sh)
         av_init_packet(&pkt);
 
         while (1) {
+            uint64_t stage_start;
+            int stage_stream;
+            int stage_index;
+            int stage_chunk_index;
+            SegTraceInput trace_in;
+            SegTraceOutput trace_out;
+            int trace_flags;
+            int new_init;
+
             if(sh->seg_cache_ctx.stage != SEG_CACHECTX_STAGE_FLUSH && sh->seg_cache_ctx.need_seg) {
                 logger(LOG_WARN, "unexpected! cache ctx stage %d but need seg, force clear", sh->seg_cache_ctx.stage);
                 sh->seg_cache_ctx.need_seg = 0;
@@ -667,10 +987,19 @@ int seg_run(SegHandler *sh)
 
             if (sh->seg_cache_ctx.stage != SEG_CACHECTX_STAGE_FLUSH) {
                 // read in
+                stage_start = stage_hist_begin();
                 if(read_input_frame(sh, &pkt) < 0) {
                     ret = EC_READ_FAIL;
+                    if (sh->params.reconnect_ms > 0 && !sh->interrupt) {
+                        ret = seg_reconnect_input(sh);
+                        if (ret == EC_OK) {
+                            continue;
+                        }
+                    }
                     break;
                 }
+                stage_hist_end(stage_start, STAGE_READ, get_stage_stream(sh, &pkt));
+                seg_trace_input(&trace_in, &pkt);
 
                 if(sh->seg_start_dts < 0) {
                     AVStream * istream_tmp = get_input_stream(sh, &pkt);
@@ -721,6 +1050,7 @@ int seg_run(SegHandler *sh)
                 }
                 if (sh->params.only_audio) {
                     if (sh->ic->streams[pkt.stream_index]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+                        seg_trace_packet(sh, &trace_in, &pkt, PKT_TRACE_SKIP, 0);
                         av_packet_unref(&pkt);
                         continue;
                     }
@@ -728,6 +1058,7 @@ int seg_run(SegHandler *sh)
 
                 if (sh->params.only_video) {
                     if (sh->ic->streams[pkt.stream_index]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+                        seg_trace_packet(sh, &trace_in, &pkt, PKT_TRACE_SKIP, 0);
                         av_packet_unref(&pkt);
                         continue;
                     }
@@ -751,6 +1082,7 @@ int seg_run(SegHandler *sh)
                     seg_cachectx_clear_caches(sh);
                     continue;
                 }
+                seg_trace_input(&trace_in, &pkt);
             }
 
             if (sh->seg_cache_ctx.stage == SEG_CACHECTX_STAGE_CACHE ||
@@ -760,6 +1092,7 @@ int seg_run(SegHandler *sh)
                     max_caches = EXTSEG_MAX_CACHES;
                 }
                 // cache a copy
+                seg_trace_packet(sh, &trace_in, &pkt, PKT_TRACE_CACHE, 0);
                 int cache_ret = seg_cachectx_cache_pkt(sh, &pkt, max_caches);
                 av_packet_unref(&pkt);
                 if (cache_ret < 0) {
@@ -778,6 +1111,18 @@ int seg_run(SegHandler *sh)
 
             statis_on_frame_input(sh, &pkt);
 
+            // packets cutting a segment or chunk are timed as file end
+            stage_stream = get_stage_stream(sh, &pkt);
+            stage_index = sh->index;
+            stage_chunk_index = sh->chunk_index;
+            stage_start = stage_hist_begin();
+
+            // new codec configuration goes to a new init segment
+            new_init = (sh->flags & NF_NEWEXTRADATA) && sh->params.seg_format == SEG_FORMAT_FMP4;
+            if (new_init) {
+                sh->init_dirty = 1;
+            }
+
             // check frame dts
             if (check_input_timestamp(sh, &pkt)) {
                 av_packet_unref(&pkt);
@@ -785,6 +1130,19 @@ int seg_run(SegHandler *sh)
                 break;
             }
 
+            // as after reconnect, the segment maps the new init from its first sample
+            if (new_init && sh->count > 0) {
+                logger(LOG_WARN, "extradata changed, cut segment %d for a new init segment", sh->index);
+                seg_file_end(sh, 0);
+                if (seg_file_begin(sh, 1) < 0) {
+                    av_packet_unref(&pkt);
+                    ret = EC_OUTPUT_FAIL;
+                    break;
+                }
+                sh->begin = -1;
+                sh->chunk_begin = -1;
+            }
+
             // calculate duration and check file rotate
             if (check_duration(sh, &pkt) < 0) {
                 seg_file_end(sh, 0);
@@ -805,15 +1163,19 @@ int seg_run(SegHandler *sh)
             }
 
             check_timestamp_rollback(sh, &pkt);
+            trace_flags = (stage_index != sh->index ? PKT_TRACE_FLAG_CUT : 0) |
+                (stage_chunk_index != sh->chunk_index ? PKT_TRACE_FLAG_CHUNK : 0);
 
             // discard frame if ext_seqhead conflicts
             if (check_ext_seqhead(sh, &pkt)) {
+                seg_trace_packet(sh, &trace_in, &pkt, PKT_TRACE_SKIP, trace_flags);
                 av_packet_unref(&pkt);
                 continue;
             }
 
             // wait until meet the first keyframe in base stream
             if (meet_first_keyframe(sh, &pkt) < 0) {
+                seg_trace_packet(sh, &trace_in, &pkt, PKT_TRACE_SKIP, trace_flags);
                 av_packet_unref(&pkt);
                 COUNT_IF(sh->wait_keyframe_count, MAX_WAIT_KEYFRAME_COUNT)
                 {
@@ -827,10 +1189,17 @@ int seg_run(SegHandler *sh)
             // frame count++
             frame_count_increase(sh, &pkt);
 
+            if (stage_index == sh->index && stage_chunk_index == sh->chunk_index) {
+                stage_hist_end(stage_start, STAGE_CHECK, stage_stream);
+            }
+
             // do stream filters
             {
+                stage_start = stage_hist_begin();
                 int bsf_ret = do_stream_filters(sh, &pkt);
+                stage_hist_end(stage_start, STAGE_FILTER, stage_stream);
                 if(bsf_ret) {
+                    seg_trace_packet(sh, &trace_in, &pkt, PKT_TRACE_SKIP, trace_flags);
                     av_packet_unref(&pkt);
                     continue;
                 } else if(bsf_ret < 0) {
@@ -841,13 +1210,15 @@ int seg_run(SegHandler *sh)
             }
 
             // calculate output timestamp and set
+            stage_start = stage_hist_begin();
             set_output_timestamp(sh, &pkt);
+            stage_hist_end(stage_start, STAGE_TIMESTAMP, stage_stream);
 
             // rewrite stream index
             set_output_stream_index(sh, &pkt);
 
-            if(sh->params.is_lhls && sh->params.llhls_notify_independent &&
-                !(sh->curr_chunk_flag & CURR_CHUNK_FLAG_GOT_FIRST_PKT)) {
+            // key in head marks the chunk as an independent ll-hls part
+            if(sh->params.is_lhls && !(sh->curr_chunk_flag & CURR_CHUNK_FLAG_GOT_FIRST_PKT)) {
                 AVStream *istream = get_input_stream(sh, &pkt);
                 uint8_t * side_data;
 
@@ -857,17 +1228,28 @@ int seg_run(SegHandler *sh)
                     sh->curr_chunk_flag |= CURR_CHUNK_FLAG_KEY_IN_HEAD;
                 }
 
-                // side_data = av_packet_new_side_data(&pkt, AV_PKT_DATA_MPEGTS_RESEND_HEADER, 1);
-                side_data = av_packet_new_side_data(&pkt, AV_PKT_DATA_MPEGTS_STREAM_ID, 1);
-                if(!side_data) {
-                    logger(LOG_ERROR, "failed to alloc side data AV_PKT_DATA_MPEGTS_RESEND_HEADER, out of memory");
-                    ret = EC_MEM;
-                    break;
+                // an independent ts part starts with pat/pmt, which the
+                // muxer resends on the side data
+                if(sh->params.llhls_notify_independent ||
+                   (sh->params.seg_format != SEG_FORMAT_FMP4 &&
+                    (sh->curr_chunk_flag & CURR_CHUNK_FLAG_KEY_IN_HEAD))) {
+                    // side_data = av_packet_new_side_data(&pkt, AV_PKT_DATA_MPEGTS_RESEND_HEADER, 1);
+                    side_data = av_packet_new_side_data(&pkt, AV_PKT_DATA_MPEGTS_STREAM_ID, 1);
+                    if(!side_data) {
+                        logger(LOG_ERROR, "failed to alloc side data AV_PKT_DATA_MPEGTS_RESEND_HEADER, out of memory");
+                        ret = EC_MEM;
+                        break;
+                    }
                 }
             }
 
-            //write out
-            if (write_output_frame(sh, &pkt) < 0) {
+            //write out, the muxer takes the packet so it is traced after from a copy
+            seg_trace_output(&trace_out, &pkt);
+            stage_start = stage_hist_begin();
+            int write_ret = write_output_frame(sh, &pkt);
+            stage_hist_end(stage_start, STAGE_WRITE, stage_stream);
+            seg_trace_write(sh, &trace_in, &trace_out, write_ret, trace_flags);
+            if (write_ret < 0) {
                 av_packet_unref(&pkt);
                 COUNT_IF(sh->write_fail_count, MAX_WRITE_FAIL_COUNT)
                 {
@@ -885,6 +1267,8 @@ int seg_run(SegHandler *sh)
 
             // do statis
             statis_on_frame_output(sh);
+            // cached packets are accounted with the arrival of the last read
+            latency_on_write(sh, sh->arrival_time);
 
             av_packet_unref(&pkt);
         }
@@ -901,8 +1285,10 @@ int seg_run(SegHandler *sh)
     if (sh->bsfc != NULL) {
         av_bitstream_filter_close(sh->bsfc);
     }
-    avformat_close_input(&ic);
-    avformat_free_context(oc);
+    // input context may be reopened on reconnect
+    avformat_close_input(&sh->ic);
+    // output context may be recreated for fmp4 init segment
+    avformat_free_context(sh->oc);
 
     logger(LOG_INFO, "seg run end.");
     if (sh->interrupt) {
@@ -2,6 +2,7 @@
 #define SEG_H_
 
 #include "flv_amf_common.h"
+#include "standby_input.h"
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
 #include <libavutil/time.h>
@@ -79,6 +80,9 @@ typedef struct {
 #define OUTPUT_NONINTERLEAVED_NIL (1)
 #define OUTPUT_NONINTERLEAVED_CLR (2)
 
+#define SEG_FORMAT_TS (0)
+#define SEG_FORMAT_FMP4 (1)
+
 #define FLV_SEG_FLAGS_NONE (0)
 #define FLV_SEG_FLAGS_ALIGN_DTS (1)
 #define FLV_SEG_FLAGS_INTERLEAVE_PKTS (1 << 1)
@@ -101,8 +105,13 @@ typedef struct {
     int align;
     int seq_sync;
     int flv_meta;
+    int is_flv;
     int is_hds;
     int is_rptp;
+    // flv path muxes mpegts by srs_librtmp instead of libavformat
+    int is_native_ts;
+    // flv path with several sinks, this one does not feed the m3u8
+    int no_playlist;
     int start_number;
     int only_audio;
     int only_video;
@@ -116,6 +125,8 @@ typedef struct {
     int workaround_h264aud;
     int copyts;
     int is_lhls;
+    // output container of seg_run, SEG_FORMAT_TS or SEG_FORMAT_FMP4
+    int seg_format;
     // when both audio and video ext changed, force seg and notify discontinue
     int seg_on_ext;
     // for lhls and llhls, segment chunk by dts rather than pts, 
@@ -124,12 +135,40 @@ typedef struct {
     // llhls notify independent chunks
     int llhls_notify_independent;
     int flv_seg_flags;
+    // bound of probing streams in ms when the flv metadata tells the streams, 0 to disable
+    int fast_start_ms;
+    // max rtmp recv buffer, which grows to the bitrate, 0 for fixed default
+    int rtmp_recv_buffer;
+    // max sleep of rtmp merged read in ms, 0 to disable
+    int rtmp_merge_read_ms;
+    // file caching the resolved rtmp and http-flv hosts across restarts, NULL to disable
+    const char *rtmp_dns_cache;
+    // send rtmp connect, createStream and play without waiting for responses
+    int rtmp_pipeline;
+    // time to reconnect the input in ms after read error, 0 to exit
+    int reconnect_ms;
+    // rtmp url read concurrently with url, which takes over at its keyframe when url fails
+    const char *backup_url;
+    // the active input fails over when it stalls or lags this long, 0 for default
+    int failover_ms;
     // fixed gop duration, use fixed gop mode if larger than zero.
     int probe_gop;
     // chunk duration range
     int chunk_duration_lower_ms;
     int chunk_duration_higher_ms;
     int do_judge_discontinuity;
+    // live m3u8 window size in slices, 0 for default
+    int m3u8_window;
+    // M3U8_TARGET_* rounding of target duration
+    int m3u8_target_round;
+    // export period of the stage latency histograms in s, 0 to disable
+    int stage_hist;
+    // binary per packet trace file, NULL for none
+    const char *packet_trace;
+    // records kept in the trace, 0 for default
+    int packet_trace_records;
+    // master playlist shared by the aligned renditions, NULL for none
+    const char *master_playlist;
     const char *custom_metakey;
     MetaKeyDesc metakey_desc[MAX_N_METAKEYS];
 } SegParams;
@@ -159,22 +198,59 @@ typedef struct {
     int64_t timestamp;
 } StreamStatis;
 
+// rfc6381 codec tag, such as avc1.64001f
+#define SEG_CODEC_TAG_SIZE 32
+
+// output properties of the rendition advertised by master playlist
+typedef struct {
+    int video_width;
+    int video_height;
+    char video_codec[SEG_CODEC_TAG_SIZE];
+    char audio_codec[SEG_CODEC_TAG_SIZE];
+} SegRendition;
+
+// time of the input startup phases in us
+typedef struct {
+    int64_t dns_us;
+    int64_t connect_us;
+    int64_t handshake_us;
+    // connect app, and createStream and play when pipelined
+    int64_t connect_app_us;
+    // play, or the http-flv request until the flv header
+    int64_t play_us;
+} SegStartup;
+
 typedef struct {
     char live_streamid[1024];
     char via[1024];
     char vcodec[1024];
     char acodec[1024];
+    int64_t start_time;
     int64_t connected_time;
     int64_t first_frame_time;
+    // the first packet written to output
+    int64_t first_write_time;
     int64_t first_frame_pts;
+    SegStartup startup;
+    int64_t reconnects;
+    StandbyStats standby;
     int64_t last_keyframe_count;
     int64_t gop;
     StreamStatis vss;
     StreamStatis ass;
     enum AVMediaType last_pkt_type;
     int last_pkt_size;
+    SegRendition rendition;
 } SegStatis;
 
+// monotonic times in us of the packets written to a segment or chunk, 0 if none
+typedef struct {
+    int64_t first_arrival;
+    int64_t last_arrival;
+    // the file end made it available
+    int64_t publish_time;
+} SegLatency;
+
 typedef struct {
     int video_width;
     int video_height;
@@ -182,6 +258,7 @@ typedef struct {
     int input_audio_frames;
     int output_video_frames;
     int output_audio_frames;
+    SegLatency latency;
 } SegData;
 
 typedef struct {
@@ -189,6 +266,7 @@ typedef struct {
     int input_audio_frames;
     int output_video_frames;
     int output_audio_frames;
+    SegLatency latency;
 } ChunkData;
 
 typedef struct AVPktCache {
@@ -238,6 +316,10 @@ typedef struct SegHandler {
     SegParams params;
     char file[1024];
     char hds_abst_file[1024];
+    // fmp4 init segment, rewritten when codec configuration changes
+    char init_file[1024];
+    int init_index;
+    int init_dirty;
     AVFormatContext *ic;
     AVFormatContext *oc;
     AVBitStreamFilterContext *bsfc;
@@ -297,6 +379,15 @@ typedef struct SegHandler {
     SegCacheContext seg_cache_ctx;
     int insert_discontinuity;
 
+    // shift of input timestamps in us, which continue across reconnects
+    int64_t input_offset;
+    // input_offset is set by the next packet
+    int8_t input_rebase;
+    // the input reconnected in current segment, which is discontinuous
+    int8_t input_reconnected;
+    // monotonic time in us the last input packet was read
+    int64_t arrival_time;
+
     int8_t curr_chunk_flag;
 
     int8_t probe_gop_flag;
@@ -4,7 +4,11 @@
 #include "adts.h"
 #include <libavutil/intreadwrite.h>
 
-#define TRACE_FRAME frame_trace_log(sh, pkt, __FUNCTION__)
+#define TRACE_FRAME do { \
+        if (logger_enabled(LOG_VERB)) { \
+            frame_trace_log(sh, pkt, __FUNCTION__); \
+        } \
+    } while (0)
 
 static void copy_extradata(AVCodecContext *codec, uint8_t *side_data, 
     int side_size) 
@@ -27,6 +31,22 @@ static void copy_extradata_new(AVCodecParameters *codec, uint8_t *side_data, int
     codec->extradata_size = side_size;
 }
 
+// end of the output timeline in us, 0 if nothing is output
+static int64_t input_timeline_end(SegHandler *sh)
+{
+    int64_t end = 0;
+    int i;
+
+    for (i = 0; i < MAX_STREAMS; i++) {
+        StreamInfo *si = &sh->streams[i];
+        if (si->in_stream && si->odts >= 0) {
+            int64_t dts = si->odts + FFMAX(si->duration, 1);
+            end = FFMAX(end, av_rescale_q(dts, si->in_stream->time_base, AV_TIME_BASE_Q));
+        }
+    }
+    return end;
+}
+
 int read_input_frame(SegHandler *sh, AVPacket *pkt) 
 {
     int ret = av_read_frame(sh->ic, pkt);
@@ -34,10 +54,30 @@ int read_input_frame(SegHandler *sh, AVPacket *pkt)
         av_error("av_read_frame", ret);
         return -1;
     }
+    sh->arrival_time = av_gettime_relative();
 
     AVStream *istream = get_input_stream(sh, pkt);
     AVStream *ostream = get_output_stream(sh, pkt);
 
+    // the first packet after reconnect follows the last one output
+    if (sh->input_rebase && istream && pkt->dts != AV_NOPTS_VALUE) {
+        int64_t end = input_timeline_end(sh);
+        if (end > 0) {
+            sh->input_offset = end - av_rescale_q(pkt->dts, istream->time_base, AV_TIME_BASE_Q);
+        }
+        sh->input_rebase = 0;
+        logger(LOG_WARN, "input timestamps shift %lld us after reconnect", sh->input_offset);
+    }
+    if (sh->input_offset && istream) {
+        int64_t offset = av_rescale_q(sh->input_offset, AV_TIME_BASE_Q, istream->time_base);
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            pkt->dts += offset;
+        }
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            pkt->pts += offset;
+        }
+    }
+
     // patch for hevc if not annexb mode
     if (istream && istream->codec->codec_id == AV_CODEC_ID_HEVC) {
         if (!hevc_patch_is_annexb(pkt)) {
@@ -65,6 +105,7 @@ int read_input_frame(SegHandler *sh, AVPacket *pkt)
         if (sh->is_base_missing) {
             logger(LOG_WARN, "base stream is back");
             sh->is_base_missing = 0;
+            metrics_set(&g_metrics.base_missing, 0);
             // reset output dts
             StreamInfo * stream = get_stream_info(sh, pkt);
             stream->odts = -1;
@@ -77,6 +118,7 @@ int read_input_frame(SegHandler *sh, AVPacket *pkt)
             if(!sh->is_base_missing) {
                 logger(LOG_WARN, "base stream is missing");
                 sh->is_base_missing = 1;
+                metrics_set(&g_metrics.base_missing, 1);
             }
         }
     }
@@ -101,6 +143,65 @@ int read_input_frame(SegHandler *sh, AVPacket *pkt)
     return 0;
 }
 
+int rebind_input_streams(SegHandler *sh, const enum AVCodecID *codec_ids)
+{
+    unsigned int i;
+
+    for (i = 0; i < MAX_STREAMS; i++) {
+        AVStream *in_stream;
+        AVStream *out_stream = sh->streams[i].out_stream;
+        if (codec_ids[i] == AV_CODEC_ID_NONE) {
+            continue;
+        }
+        if (i >= sh->ic->nb_streams || sh->ic->streams[i]->codec->codec_id != codec_ids[i]) {
+            logger(LOG_ERROR, "stream[%d] codec[%x] changed after reconnect", i, codec_ids[i]);
+            return -1;
+        }
+        in_stream = sh->ic->streams[i];
+        sh->streams[i].in_stream = in_stream;
+        if (!out_stream || in_stream->codec->extradata_size <= 0) {
+            continue;
+        }
+
+        // filters restart from the sequence header of the new input
+        if (sh->params.seg_format == SEG_FORMAT_FMP4 &&
+            (in_stream->codec->extradata_size != out_stream->codec->extradata_size ||
+             memcmp(in_stream->codec->extradata, out_stream->codec->extradata, in_stream->codec->extradata_size))) {
+            logger(LOG_WARN, "stream[%d] extradata changed after reconnect", i);
+            sh->init_dirty = 1;
+        }
+        copy_extradata(out_stream->codec, in_stream->codec->extradata, in_stream->codec->extradata_size);
+    }
+    return 0;
+}
+
+int seg_reconnect_wait(SegHandler *sh, int64_t start, int *backoff_ms)
+{
+    int64_t deadline = start + (int64_t)sh->params.reconnect_ms * 1000;
+    int64_t wait = (int64_t)*backoff_ms * 1000;
+    int64_t now = av_gettime_relative();
+
+    if (sh->interrupt || now >= deadline) {
+        return -1;
+    }
+    if (now + wait > deadline) {
+        wait = deadline - now;
+    }
+    // wake up for interrupt
+    while (wait > 0 && !sh->interrupt) {
+        int64_t step = FFMIN(wait, 100000);
+        av_usleep(step);
+        wait -= step;
+    }
+    if (sh->interrupt) {
+        return -1;
+    }
+
+    // the first attempt is at once
+    *backoff_ms = *backoff_ms ? FFMIN(*backoff_ms * 2, SEG_RECONNECT_MAX_BACKOFF_MS) : SEG_RECONNECT_MIN_BACKOFF_MS;
+    return 0;
+}
+
 int check_input_timestamp(SegHandler *sh, AVPacket *pkt)
 {
     TRACE_FRAME;
@@ -128,6 +229,7 @@ int check_input_timestamp(SegHandler *sh, AVPacket *pkt)
                 logger(LOG_WARN, "stream[%d] DST current[%lld] < previous[%lld]", istream->index, pkt->dts, stream->idts);
             }
             sh->flags |= NF_DTS_WARN;
+            metrics_add(&g_metrics.timestamp_warnings, 1);
             duration = 1;
         }
         int64_t composition_time = pkt->pts - pkt->dts;
@@ -138,6 +240,7 @@ int check_input_timestamp(SegHandler *sh, AVPacket *pkt)
     if (pkt->pts < pkt->dts) {
         logger(LOG_WARN, "stream[%d] PTS < DTS, force adjust", istream->index);
         sh->flags |= NF_PTS_WARN;
+        metrics_add(&g_metrics.timestamp_warnings, 1);
         pkt->pts = pkt->dts;
     }
 
@@ -224,6 +327,7 @@ int check_duration(SegHandler *sh, AVPacket *pkt)
         } 
         logger(LOG_DEBUG, "pts = %lld, begin = %lld", pts, sh->begin);
         sh->duration = pts - sh->begin;
+        metrics_set(&g_metrics.segment_duration_us, sh->duration);
 
         // need_seg = 1 have ensured key video frame is met beforehands
         if (sh->seg_cache_ctx.need_seg) {
@@ -508,6 +612,11 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
     AVStream *istream = get_input_stream(sh, pkt);
     AVStream *ostream = get_output_stream(sh, pkt);
 
+    // mp4 keeps avcc/hvcc nalus and raw aac as flv does, no annexb nor adts
+    if (sh->params.seg_format == SEG_FORMAT_FMP4) {
+        return 0;
+    }
+
     if (istream->codec->codec_id = AV_CODEC_ID_H264) {
         // strip AUD first (if AUD exists)
         strip_AVCC_AUD(pkt);
@@ -525,6 +634,7 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
             if (sh->bsfc == NULL) {
                 logger(LOG_ERROR, "av_bitstream_filter init h264_mp4toannexb fails");
                 sh->flags |= NF_FILTER_ERROR;
+                metrics_add(&g_metrics.filter_errors, 1);
             }
             sh->bsf_error_count = 0;
         }
@@ -533,6 +643,7 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
             if(ret < 0) {
                 av_error("av_apply_bitstream_filters", ret);
                 sh->flags |= NF_FILTER_ERROR;
+                metrics_add(&g_metrics.filter_errors, 1);
             }
             AVCodecParameters *codecpar = ostream->codecpar;
             AVCodecContext *codec = ostream->codec;
@@ -546,6 +657,7 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
         // if h264 is not in annex-b mode lasts X times, return fail
         if (pkt->size < 5 || (AV_RB32(pkt->data) != 0x0000001 && AV_RB24(pkt->data) != 0x000001)) {
             sh->flags |= NF_FILTER_ERROR;
+            metrics_add(&g_metrics.filter_errors, 1);
             sh->bsf_error_count++;
             if(sh->bsf_error_count > MAX_BSF_ERROR_COUNT) {
                 logger(LOG_ERROR, "bsf error too many times");
@@ -573,6 +685,7 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
             if (sh->bsfc == NULL) {
                 logger(LOG_ERROR, "av_bitstream_filter_init hevc_mp4toannexb fail");
                 sh->flags |= NF_FILTER_ERROR;
+                metrics_add(&g_metrics.filter_errors, 1);
             }
             sh->bsf_error_count = 0;
         }
@@ -581,6 +694,7 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
             if (ret < 0) {
                 av_error("av_apply_bitstream_filters", ret);
                 sh->flags |= NF_FILTER_ERROR;
+                metrics_add(&g_metrics.filter_errors, 1);
             }
             AVCodecParameters *codecpar = ostream->codecpar;
             AVCodecContext * codec = ostream->codec;
@@ -596,6 +710,7 @@ int do_stream_filters(SegHandler *sh, AVPacket *pkt)
         if (pkt->size < 5 || (AV_RB32(pkt->data) != 0x0000001 && AV_RB24(pkt->data) != 0x000001)) {
             logger(LOG_WARN, "output frame is not in annex-b mode");
             sh->flags |= NF_FILTER_ERROR;
+            metrics_add(&g_metrics.filter_errors, 1);
             sh->bsf_error_count ++;
             if (sh->bsf_error_count > MAX_BSF_ERROR_COUNT) {
                 logger(LOG_ERROR, "bsf error too many times");
@@ -722,8 +837,16 @@ int write_output_frame(SegHandler *sh, AVPacket *pkt)
     if (ret < 0) {
         av_error("av_interleaved_write_frame", ret);
         sh->flags |= NF_WRITE_ERROR;
+        metrics_add(&g_metrics.write_errors, 1);
         return -1;
     }
+
+    if (sh->statis.first_write_time == 0) {
+        sh->statis.first_write_time = av_gettime();
+        logger(LOG_INFO, "first packet written %lld ms after start, %lld ms after connected",
+            (sh->statis.first_write_time - sh->statis.start_time) / 1000,
+            (sh->statis.first_write_time - sh->statis.connected_time) / 1000);
+    }
     return 0;
 }
 
@@ -752,24 +875,276 @@ void statis_on_connected(SegHandler *sh)
             snprintf(statis->vcodec, sizeof(statis->vcodec) - 1, "%s %dx%d %g",
                     avcodec_get_name(codec->codec_id), codec->width, codec->height, framerate);
             logger(LOG_INFO, "VIDEO: %s", framerate);
+            statis->rendition.video_width = codec->width;
+            statis->rendition.video_height = codec->height;
+            seg_codec_tag(codec->codec_id, codec->extradata, codec->extradata_size,
+                statis->rendition.video_codec, sizeof(statis->rendition.video_codec));
         } else if (codec->codec_type == AVMEDIA_TYPE_AUDIO) {
             snprintf(statis->acodec, sizeof(statis->acodec) - 1, "%s %d %d",
                     avcodec_get_name(codec->codec_id), codec->sample_rate, codec->channels);
             logger(LOG_INFO, "AUDIO: %s", statis->acodec);
+            seg_codec_tag(codec->codec_id, codec->extradata, codec->extradata_size,
+                statis->rendition.audio_codec, sizeof(statis->rendition.audio_codec));
         }
     }
     FETCH_METADATA(sh, live_streamid);
     FETCH_METADATA(sh, via);
 }
 
+static void h264_codec_tag(const uint8_t *extradata, int size, char *buf, int buf_size)
+{
+    int i;
+
+    // avcC carries profile, compatibility and level of the sps
+    if (size >= 4 && extradata[0] == 1) {
+        snprintf(buf, buf_size, "avc1.%02x%02x%02x", extradata[1], extradata[2], extradata[3]);
+        return;
+    }
+    for (i = 0; i + 6 < size; i++) {
+        if (extradata[i] == 0 && extradata[i + 1] == 0 && extradata[i + 2] == 1 &&
+            (extradata[i + 3] & 0x1f) == 7) {
+            snprintf(buf, buf_size, "avc1.%02x%02x%02x", extradata[i + 4], extradata[i + 5], extradata[i + 6]);
+            return;
+        }
+    }
+    snprintf(buf, buf_size, "avc1");
+}
+
+static void hevc_codec_tag(const uint8_t *extradata, int size, char *buf, int buf_size)
+{
+    static const char *profile_spaces[] = {"", "A", "B", "C"};
+    uint32_t compat;
+    uint32_t reversed = 0;
+    int nb_constraints = 6;
+    int n;
+    int i;
+
+    if (size < 13 || extradata[0] != 1) {
+        snprintf(buf, buf_size, "hvc1");
+        return;
+    }
+
+    // general_profile_compatibility_flags are written in reverse bit order
+    compat = AV_RB32(extradata + 2);
+    for (i = 0; i < 32; i++) {
+        reversed = (reversed << 1) | ((compat >> i) & 1);
+    }
+    n = snprintf(buf, buf_size, "hvc1.%s%d.%X.%c%d",
+        profile_spaces[extradata[1] >> 6], extradata[1] & 0x1f, reversed,
+        (extradata[1] & 0x20) ? 'H' : 'L', extradata[12]);
+
+    // trailing zero bytes of constraint flags are omitted
+    while (nb_constraints > 1 && extradata[6 + nb_constraints - 1] == 0) {
+        nb_constraints--;
+    }
+    for (i = 0; i < nb_constraints && n < buf_size; i++) {
+        n += snprintf(buf + n, buf_size - n, ".%X", extradata[6 + i]);
+    }
+}
+
+void seg_codec_tag(enum AVCodecID codec_id, const uint8_t *extradata, int size, char *buf, int buf_size)
+{
+    buf[0] = '\0';
+    if (!extradata) {
+        size = 0;
+    }
+
+    switch (codec_id) {
+        case AV_CODEC_ID_H264:
+            h264_codec_tag(extradata, size, buf, buf_size);
+            break;
+        case AV_CODEC_ID_HEVC:
+            hevc_codec_tag(extradata, size, buf, buf_size);
+            break;
+        case AV_CODEC_ID_AAC: {
+            int aot = 2;
+            if (size >= 2) {
+                aot = extradata[0] >> 3;
+                if (aot == 31) {
+                    aot = 32 + (((extradata[0] & 0x7) << 3) | (extradata[1] >> 5));
+                }
+            }
+            snprintf(buf, buf_size, "mp4a.40.%d", aot);
+            break;
+        }
+        case AV_CODEC_ID_MP3:
+            snprintf(buf, buf_size, "mp4a.40.34");
+            break;
+        default:
+            break;
+    }
+}
+
+static StreamStatis *statis_stream(SegStatis *statis, enum AVMediaType type)
+{
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        return &statis->vss;
+    } else if (type == AVMEDIA_TYPE_AUDIO) {
+        return &statis->ass;
+    }
+    return NULL;
+}
+
+static MetricsStream *metrics_stream(enum AVMediaType type)
+{
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        return &g_metrics.streams[METRICS_STREAM_VIDEO];
+    } else if (type == AVMEDIA_TYPE_AUDIO) {
+        return &g_metrics.streams[METRICS_STREAM_AUDIO];
+    }
+    return &g_metrics.streams[METRICS_STREAM_OTHER];
+}
+
+void statis_on_input(SegHandler *sh, enum AVMediaType type, int size, int64_t timestamp, int keyframe)
+{
+    SegStatis *statis = &sh->statis;
+    StreamStatis *ss = statis_stream(statis, type);
+    MetricsStream *ms = metrics_stream(type);
+
+    statis->last_pkt_type = type;
+    statis->last_pkt_size = size;
+    metrics_add(&ms->packets_in, 1);
+    metrics_add(&ms->bytes_in, size);
+    if (!ss) {
+        return;
+    }
+    ss->in_frames++;
+    ss->in_bytes += size;
+    if (timestamp != AV_NOPTS_VALUE) {
+        ss->timestamp = timestamp;
+    }
+
+    if (type == AVMEDIA_TYPE_VIDEO && keyframe) {
+        if (statis->last_keyframe_count > 0) {
+            statis->gop = ss->in_frames - statis->last_keyframe_count;
+        }
+        statis->last_keyframe_count = ss->in_frames;
+    }
+    if (statis->first_frame_time == 0) {
+        statis->first_frame_time = av_gettime();
+        statis->first_frame_pts = timestamp;
+    }
+}
+
 void statis_on_frame_input(SegHandler *sh, const AVPacket *pkt) 
 {
+    AVStream *istream = get_input_stream(sh, pkt);
 
+    if (!istream) {
+        return;
+    }
+    statis_on_input(sh, istream->codec->codec_type, pkt->size,
+        pkt->dts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(pkt->dts, istream->time_base, AV_TIME_BASE_Q),
+        pkt->flags & AV_PKT_FLAG_KEY);
 }
 
 void statis_on_frame_output(SegHandler *sh) 
 {
+    SegStatis *statis = &sh->statis;
+    StreamStatis *ss = statis_stream(statis, statis->last_pkt_type);
+    MetricsStream *ms = metrics_stream(statis->last_pkt_type);
+
+    metrics_add(&ms->packets_out, 1);
+    metrics_add(&ms->bytes_out, statis->last_pkt_size);
+    if (ss) {
+        ss->out_frames++;
+        ss->out_bytes += statis->last_pkt_size;
+    }
+    // the flv path writes no AVPacket
+    if (statis->first_write_time == 0) {
+        statis->first_write_time = av_gettime();
+    }
+}
 
+static void latency_on_arrival(SegLatency *latency, int64_t arrival)
+{
+    if (latency->first_arrival == 0) {
+        latency->first_arrival = arrival;
+    }
+    latency->last_arrival = arrival;
+}
+
+void latency_on_write(SegHandler *sh, int64_t arrival)
+{
+    if (arrival > 0) {
+        latency_on_arrival(&sh->seg_data.latency, arrival);
+        latency_on_arrival(&sh->chunk_data.latency, arrival);
+    }
+}
+
+void latency_on_publish(SegLatency *latency, MetricsLatency *metrics)
+{
+    int64_t us;
+
+    latency->publish_time = av_gettime_relative();
+    if (latency->first_arrival == 0 || !metrics) {
+        return;
+    }
+    us = latency->publish_time - latency->first_arrival;
+    metrics_set(&metrics->last_us, us);
+    metrics_add(&metrics->sum_us, us);
+    metrics_add(&metrics->count, 1);
+}
+
+static int64_t trace_ts(int64_t ts, AVRational time_base)
+{
+    return ts == AV_NOPTS_VALUE ? PKT_TRACE_NOTS : av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+}
+
+// out timestamps are recorded unless out_ts is 0
+static void seg_trace_record(SegHandler *sh, const SegTraceInput *in, const SegTraceOutput *out,
+                             int out_ts, int event, int flags)
+{
+    PktTraceRecord *r = pkt_trace_alloc();
+    AVStream *istream;
+
+    if (!r) {
+        return;
+    }
+    istream = in->stream_index < (int)sh->ic->nb_streams ? sh->ic->streams[in->stream_index] : NULL;
+
+    r->in_dts = istream ? trace_ts(in->dts, istream->time_base) : PKT_TRACE_NOTS;
+    r->in_pts = istream ? trace_ts(in->pts, istream->time_base) : PKT_TRACE_NOTS;
+    if (out_ts && out->stream_index < (int)sh->oc->nb_streams) {
+        AVStream *ostream = sh->oc->streams[out->stream_index];
+        r->out_dts = trace_ts(out->dts, ostream->time_base);
+        r->out_pts = trace_ts(out->pts, ostream->time_base);
+    } else {
+        r->out_dts = PKT_TRACE_NOTS;
+        r->out_pts = PKT_TRACE_NOTS;
+    }
+    r->size = out->size;
+    r->seg_index = sh->index;
+    r->chunk_index = sh->chunk_index;
+    r->seg_flags = sh->flags;
+    r->stream = in->stream_index;
+    if (istream && istream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        r->type = PKT_TRACE_TYPE_VIDEO;
+    } else if (istream && istream->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+        r->type = PKT_TRACE_TYPE_AUDIO;
+    } else {
+        r->type = PKT_TRACE_TYPE_OTHER;
+    }
+    r->event = event;
+    r->flags = flags | ((out->flags & AV_PKT_FLAG_KEY) ? PKT_TRACE_FLAG_KEY : 0);
+    r->reserved = 0;
+    pkt_trace_commit(r);
+}
+
+void seg_trace_packet(SegHandler *sh, const SegTraceInput *in, const AVPacket *pkt, int event, int flags)
+{
+    SegTraceOutput out;
+
+    if (!g_pkt_trace.records) {
+        return;
+    }
+    seg_trace_output(&out, pkt);
+    seg_trace_record(sh, in, &out, 0, event, flags);
+}
+
+void seg_trace_write(SegHandler *sh, const SegTraceInput *in, const SegTraceOutput *out, int ret, int flags)
+{
+    seg_trace_record(sh, in, out, 1, ret < 0 ? PKT_TRACE_FAIL : PKT_TRACE_WRITE, flags);
 }
 
 static void set_will_flush(SegCacheContext *ctx) 
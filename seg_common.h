@@ -3,12 +3,31 @@
 
 #include "seg.h"
 #include "log.h"
+#include "stage_hist.h"
+#include "metrics.h"
+#include "packet_trace.h"
 
 #define PASSEDTIME_LIMIT 60000000 // 60s
 #define IDTSOFFSET_DIFF 100000 // 100ms
 
+// backoff between input reconnect attempts
+#define SEG_RECONNECT_MIN_BACKOFF_MS 50
+#define SEG_RECONNECT_MAX_BACKOFF_MS 2000
+
 int read_input_frame(SegHandler *sh, AVPacket *pkt);
 int check_input_timestamp(SegHandler *sh, AVPacket *pkt);
+
+/**
+ * bind the streams of the input reopened, which must have the codecs of
+ * codec_ids by index, AV_CODEC_ID_NONE for the streams not used.
+ */
+int rebind_input_streams(SegHandler *sh, const enum AVCodecID *codec_ids);
+
+/**
+ * wait for the next reconnect attempt since start, the backoff doubles
+ * every attempt. return -1 when params.reconnect_ms is used up or interrupted.
+ */
+int seg_reconnect_wait(SegHandler *sh, int64_t start, int *backoff_ms);
 int check_duration(SegHandler *sh, AVPacket *pkt);
 int check_ts_chunk_duration(SegHandler *sh, AVPacket *pkt);
 int check_ext_seqhead(SegHandler *sh, AVPacket *pkt);
@@ -23,9 +42,32 @@ void check_timestamp_rollback(SegHandler *sh, AVPacket *pkt);
 
 void statis_on_connected(SegHandler *sh);
 void statis_on_frame_input(SegHandler *sh, const AVPacket *pkt);
+/**
+ * account a frame read from input, timestamp in us or AV_NOPTS_VALUE.
+ */
+void statis_on_input(SegHandler *sh, enum AVMediaType type, int size, int64_t timestamp, int keyframe);
+/**
+ * account the last frame accounted as input, which is written.
+ */
 void statis_on_frame_output(SegHandler *sh);
 
+/**
+ * account a packet read at arrival, which is written to the open segment and chunk.
+ */
+void latency_on_write(SegHandler *sh, int64_t arrival);
+/**
+ * stamp latency as available now and record it to metrics, unless NULL.
+ */
+void latency_on_publish(SegLatency *latency, MetricsLatency *metrics);
+
 int check_align(SegHandler *sh, int64_t pts);
+
+/**
+ * rfc6381 tag of codec_id for the CODECS attribute, extradata is avcC, hvcC,
+ * annexb parameter sets or AudioSpecificConfig, and may be NULL.
+ * buf is left empty if the codec has no tag.
+ */
+void seg_codec_tag(enum AVCodecID codec_id, const uint8_t *extradata, int size, char *buf, int buf_size);
 int check_ext_seqhead_changed(SegHandler *sh, AVPacket *pkt);
 
 void seg_cachectx_update_status(SegHandler *sh, AVPacket *pkt);
@@ -56,6 +98,62 @@ inline static AVStream *get_output_stream(SegHandler *sh, const AVPacket *pkt)
     return sh->streams[pkt->stream_index].out_stream;
 }
 
+// input of the packet being processed, for the packet trace
+typedef struct {
+    int stream_index;
+    int64_t dts;
+    int64_t pts;
+} SegTraceInput;
+
+inline static void seg_trace_input(SegTraceInput *in, const AVPacket *pkt)
+{
+    in->stream_index = pkt->stream_index;
+    in->dts = pkt->dts;
+    in->pts = pkt->pts;
+}
+
+// the packet handed to the muxer, which takes it
+typedef struct {
+    int stream_index;
+    int64_t dts;
+    int64_t pts;
+    int size;
+    int flags;
+} SegTraceOutput;
+
+inline static void seg_trace_output(SegTraceOutput *out, const AVPacket *pkt)
+{
+    out->stream_index = pkt->stream_index;
+    out->dts = pkt->dts;
+    out->pts = pkt->pts;
+    out->size = pkt->size;
+    out->flags = pkt->flags;
+}
+
+/**
+ * record what became of a packet not written, event is PKT_TRACE_*.
+ */
+void seg_trace_packet(SegHandler *sh, const SegTraceInput *in, const AVPacket *pkt, int event, int flags);
+
+/**
+ * record the write of out, PKT_TRACE_WRITE or PKT_TRACE_FAIL by the
+ * result of the muxer, with the output timestamps of either.
+ */
+void seg_trace_write(SegHandler *sh, const SegTraceInput *in, const SegTraceOutput *out, int ret, int flags);
+
+// stream of the stage latency histograms
+inline static int get_stage_stream(SegHandler *sh, const AVPacket *pkt)
+{
+    AVStream *istream = pkt->stream_index < MAX_STREAMS ? get_input_stream(sh, pkt) : NULL;
+
+    if (istream && istream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        return STAGE_STREAM_VIDEO;
+    } else if (istream && istream->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+        return STAGE_STREAM_AUDIO;
+    }
+    return STAGE_STREAM_OTHER;
+}
+
 inline static int is_base_stream(SegHandler *sh, const AVPacket *pkt) 
 {
     return (pkt->stream_index == sh->base_stream_index);
@@ -399,6 +399,19 @@ public:
 #undef SRS_PERF_FAST_FLV_ENCODER
 #define SRS_PERF_FAST_FLV_ENCODER
 
+/**
+ * the payloads of received messages are allocated once at the message size
+ * from a pool of power of two size classes, and recycled when freed.
+ * @remark payloads larger than the max class are not pooled.
+ * @remark set SRS_PERF_PAYLOAD_POOL_CACHED to 0 to disable recycle.
+ */
+#define SRS_PERF_PAYLOAD_POOL_MIN_SHIFT 8
+#define SRS_PERF_PAYLOAD_POOL_MAX_SHIFT 22
+// max cached payloads of each class,
+#define SRS_PERF_PAYLOAD_POOL_CACHED 16
+// and max cached bytes of each class, at least one payload is cached.
+#define SRS_PERF_PAYLOAD_POOL_CLASS_BYTES 2097152
+
 #ifdef SRS_AUTO_MEM_WATCH
 
 #include <string>
@@ -1319,6 +1332,24 @@ public:
     void initialize_video(int size, u_int32_t time, int stream);
 };
 
+/**
+ * alloc payload of size bytes from the payload pool.
+ * @remark the payload must be freed by srs_payload_free, never delete[] or free().
+ */
+extern char* srs_payload_alloc(int size);
+/**
+ * return payload to the pool, NULL is ignored.
+ * @remark a viewed payload is returned when all its views are freed.
+ */
+extern void srs_payload_free(char* payload);
+/**
+ * create a view of the size bytes at data in payload, which shares the
+ * memory of payload and is freed by srs_payload_free as well.
+ * @remark the 8 bytes ahead of data are overwritten, which must be in
+ *       payload and never in other views, see srs_rtmp_on_aggregate.
+ */
+extern char* srs_payload_view(char* payload, char* data);
+
 /**
  * message is raw data RTMP message, bytes oriented,
  * protcol always recv RTMP message, and can send RTMP message or RTMP packet.
@@ -1351,6 +1382,7 @@ public:
 public:
     /**
      * alloc the payload to specified size of bytes.
+     * @remark the payload is from srs_payload_alloc.
      */
     virtual void create_payload(int size);
 };
@@ -12551,6 +12583,148 @@ void SrsMessageHeader::initialize_video(int size, u_int32_t time, int stream)
     perfer_cid = RTMP_CID_Video;
 }
 
+#include <pthread.h>
+
+#define SRS_PAYLOAD_POOL_CLASSES (SRS_PERF_PAYLOAD_POOL_MAX_SHIFT - SRS_PERF_PAYLOAD_POOL_MIN_SHIFT + 1)
+
+// ahead of each payload, keeps the payload 16 bytes aligned.
+// @remark the last 8 bytes are a SrsPayloadTag.
+union SrsPayloadBlock
+{
+    struct {
+        // next free block in pool
+        SrsPayloadBlock* next;
+    } info;
+    char align[16];
+};
+
+// size class of a view, @see srs_payload_view
+#define SRS_PAYLOAD_VIEW -2
+
+// the 8 bytes ahead of both payload and view, maybe unaligned for view.
+struct SrsPayloadTag
+{
+    // the references of payload, or the bytes from viewed payload to view.
+    int32_t value;
+    // -1 when not pooled, or SRS_PAYLOAD_VIEW
+    int32_t size_class;
+};
+
+static SrsPayloadTag srs_payload_get_tag(char* payload)
+{
+    SrsPayloadTag tag;
+    memcpy(&tag, payload - sizeof(SrsPayloadTag), sizeof(SrsPayloadTag));
+    return tag;
+}
+
+static void srs_payload_set_tag(char* payload, int32_t value, int32_t size_class)
+{
+    SrsPayloadTag tag;
+    tag.value = value;
+    tag.size_class = size_class;
+    memcpy(payload - sizeof(SrsPayloadTag), &tag, sizeof(SrsPayloadTag));
+}
+
+// the refs of a payload, which is aligned.
+static int32_t* srs_payload_refs(char* payload)
+{
+    return (int32_t*)(payload - sizeof(SrsPayloadTag));
+}
+
+static SrsPayloadBlock* _srs_payload_pool[SRS_PAYLOAD_POOL_CLASSES];
+static int _srs_payload_pool_count[SRS_PAYLOAD_POOL_CLASSES];
+static pthread_mutex_t _srs_payload_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char* srs_payload_alloc(int size)
+{
+    int size_class = 0;
+    while (size_class < SRS_PAYLOAD_POOL_CLASSES && (1 << (size_class + SRS_PERF_PAYLOAD_POOL_MIN_SHIFT)) < size) {
+        size_class++;
+    }
+    
+    SrsPayloadBlock* block = NULL;
+    if (size_class < SRS_PAYLOAD_POOL_CLASSES) {
+        pthread_mutex_lock(&_srs_payload_pool_lock);
+        if ((block = _srs_payload_pool[size_class]) != NULL) {
+            _srs_payload_pool[size_class] = block->info.next;
+            _srs_payload_pool_count[size_class]--;
+        }
+        pthread_mutex_unlock(&_srs_payload_pool_lock);
+        
+        if (!block) {
+            block = (SrsPayloadBlock*)malloc(sizeof(SrsPayloadBlock) + (1 << (size_class + SRS_PERF_PAYLOAD_POOL_MIN_SHIFT)));
+        }
+    } else {
+        size_class = -1;
+        block = (SrsPayloadBlock*)malloc(sizeof(SrsPayloadBlock) + size);
+    }
+    
+    if (!block) {
+        srs_error("alloc payload failed. size=%d", size);
+        return NULL;
+    }
+    block->info.next = NULL;
+    srs_payload_set_tag((char*)(block + 1), 1, size_class);
+    
+    return (char*)(block + 1);
+}
+
+char* srs_payload_view(char* payload, char* data)
+{
+    SrsPayloadTag tag = srs_payload_get_tag(payload);
+    
+    // view of view is a view of the payload viewed.
+    if (tag.size_class == SRS_PAYLOAD_VIEW) {
+        payload -= tag.value;
+    }
+    srs_assert(data - payload >= (int)sizeof(SrsPayloadTag));
+    
+    __sync_add_and_fetch(srs_payload_refs(payload), 1);
+    srs_payload_set_tag(data, (int32_t)(data - payload), SRS_PAYLOAD_VIEW);
+    
+    return data;
+}
+
+void srs_payload_free(char* payload)
+{
+    if (!payload) {
+        return;
+    }
+    
+    SrsPayloadTag tag = srs_payload_get_tag(payload);
+    if (tag.size_class == SRS_PAYLOAD_VIEW) {
+        payload -= tag.value;
+        tag = srs_payload_get_tag(payload);
+    }
+    
+    // the views are alive.
+    if (__sync_sub_and_fetch(srs_payload_refs(payload), 1) > 0) {
+        return;
+    }
+    
+    SrsPayloadBlock* block = (SrsPayloadBlock*)payload - 1;
+    int size_class = tag.size_class;
+    
+    if (size_class >= 0) {
+        int shift = size_class + SRS_PERF_PAYLOAD_POOL_MIN_SHIFT;
+        int max_cached = srs_max(1, srs_min(SRS_PERF_PAYLOAD_POOL_CACHED, SRS_PERF_PAYLOAD_POOL_CLASS_BYTES >> shift));
+        if (SRS_PERF_PAYLOAD_POOL_CACHED <= 0) {
+            max_cached = 0;
+        }
+        
+        pthread_mutex_lock(&_srs_payload_pool_lock);
+        if (_srs_payload_pool_count[size_class] < max_cached) {
+            block->info.next = _srs_payload_pool[size_class];
+            _srs_payload_pool[size_class] = block;
+            _srs_payload_pool_count[size_class]++;
+            block = NULL;
+        }
+        pthread_mutex_unlock(&_srs_payload_pool_lock);
+    }
+    
+    free(block);
+}
+
 SrsCommonMessage::SrsCommonMessage()
 {
     payload = NULL;
@@ -12562,14 +12736,14 @@ SrsCommonMessage::~SrsCommonMessage()
 #ifdef SRS_AUTO_MEM_WATCH
     srs_memory_unwatch(payload);
 #endif
-    srs_freepa(payload);
+    srs_payload_free(payload);
 }
 
 void SrsCommonMessage::create_payload(int size)
 {
-    srs_freepa(payload);
+    srs_payload_free(payload);
     
-    payload = new char[size];
+    payload = srs_payload_alloc(size);
     srs_verbose("create payload for RTMP message. size=%d", size);
     
 #ifdef SRS_AUTO_MEM_WATCH
@@ -12612,13 +12786,20 @@ int SrsSharedPtrMessage::create(SrsCommonMessage* msg)
 {
     int ret = ERROR_SUCCESS;
     
-    if ((ret = create(&msg->header, msg->payload, msg->size)) != ERROR_SUCCESS) {
+    // the payload of msg is pooled while shared ptr frees by delete[],
+    // so the shared ptr owns a copy.
+    char* payload = NULL;
+    if (msg->size > 0) {
+        payload = new char[msg->size];
+        memcpy(payload, msg->payload, msg->size);
+    }
+    
+    if ((ret = create(&msg->header, payload, msg->size)) != ERROR_SUCCESS) {
+        srs_freepa(payload);
         return ret;
     }
     
-    // to prevent double free of payload:
-    // initialize already attach the payload of msg,
-    // detach the payload to transfer the owner to shared ptr.
+    srs_payload_free(msg->payload);
     msg->payload = NULL;
     msg->size = 0;
     
@@ -21741,9 +21922,14 @@ int SrsProtocol::read_message_payload(SrsChunkStream* chunk, SrsCommonMessage**
     srs_verbose("chunk payload size is %d, message_size=%d, received_size=%d, in_chunk_size=%d", 
         payload_size, chunk->header.payload_length, chunk->msg->size, in_chunk_size);
 
-    // create msg payload if not initialized
+    // create msg payload at the message size once if not initialized
     if (!chunk->msg->payload) {
         chunk->msg->create_payload(chunk->header.payload_length);
+        if (!chunk->msg->payload) {
+            ret = ERROR_SYSTEM_ASSERT_FAILED;
+            srs_error("alloc payload failed. size=%d, ret=%d", chunk->header.payload_length, ret);
+            return ret;
+        }
     }
     
     // read payload to buffer
@@ -32050,7 +32236,12 @@ int srs_rtmp_on_aggregate(Context* context, SrsCommonMessage* msg)
 
         if (data_size > 0) {
             o.size = data_size;
-            o.payload = new char[o.size];
+            o.payload = srs_payload_alloc(o.size);
+            if (!o.payload) {
+                ret = ERROR_RTMP_AGGREGATE;
+                srs_error("alloc aggregate message data failed. ret=%d", ret);
+                return ret;
+            }
             stream->read_bytes(o.payload, o.size);
         }
         
@@ -32167,6 +32358,21 @@ int srs_rtmp_read_packet(srs_rtmp_t rtmp, char* type, u_int32_t* timestamp, char
     return ret;
 }
 
+char* srs_rtmp_alloc_packet(int size)
+{
+    return srs_payload_alloc(size);
+}
+
+void srs_rtmp_free_packet(char* data)
+{
+    srs_payload_free(data);
+}
+
+char* srs_rtmp_view_packet(char* packet, char* data)
+{
+    return srs_payload_view(packet, data);
+}
+
 int srs_rtmp_write_packet(srs_rtmp_t rtmp, char type, u_int32_t timestamp, char* data, int size)
 {
     int ret = ERROR_SUCCESS;
@@ -32833,6 +33039,240 @@ srs_bool srs_flv_is_keyframe(char* data, int32_t size)
     return SrsFlvCodec::video_is_keyframe(data, (int)size);
 }
 
+/**
+* the ts file writer for srs-librtmp, buffers the 188B ts packets
+* encoded by SrsTsContext and writes them to file in large blocks.
+* @remark the SrsTSMuxer closes and reopens its writer when initialize,
+*       so open/close only apply to the buffer, use open_file/close_file
+*       to manage the underlayer file.
+*/
+class SrsTsFileWriter : public SrsFileWriter
+{
+private:
+    std::string path;
+    int fd;
+    char* buf;
+    int nb_buf;
+    int64_t nb_flushed;
+public:
+    SrsTsFileWriter();
+    virtual ~SrsTsFileWriter();
+public:
+    virtual int open_file(std::string p);
+    virtual void close_file();
+    virtual int flush();
+private:
+    // write all count bytes to fd, retry on EINTR and short writes.
+    virtual int write_fully(const char* p, size_t count);
+public:
+    virtual int open(std::string p);
+    virtual void close();
+    virtual bool is_open();
+    virtual int64_t tellg();
+    virtual int write(void* data, size_t count, ssize_t* pnwrite);
+};
+
+// 64KB, about 348 ts packets.
+#define SRS_TS_WRITER_BUFFER_SIZE (SRS_TS_PACKET_SIZE * 348)
+
+SrsTsFileWriter::SrsTsFileWriter()
+{
+    fd = -1;
+    buf = new char[SRS_TS_WRITER_BUFFER_SIZE];
+    nb_buf = 0;
+    nb_flushed = 0;
+}
+
+SrsTsFileWriter::~SrsTsFileWriter()
+{
+    close_file();
+    srs_freepa(buf);
+}
+
+int SrsTsFileWriter::open_file(string p)
+{
+    int ret = ERROR_SUCCESS;
+    
+    if (fd > 0) {
+        ret = ERROR_SYSTEM_FILE_ALREADY_OPENED;
+        srs_error("file %s already opened. ret=%d", path.c_str(), ret);
+        return ret;
+    }
+    
+    int flags = O_CREAT|O_WRONLY|O_TRUNC;
+    mode_t mode = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH;
+
+    if ((fd = ::open(p.c_str(), flags, mode)) < 0) {
+        ret = ERROR_SYSTEM_FILE_OPENE;
+        srs_error("open file %s failed. ret=%d", p.c_str(), ret);
+        return ret;
+    }
+    
+    path = p;
+    nb_buf = 0;
+    nb_flushed = 0;
+    
+    return ret;
+}
+
+void SrsTsFileWriter::close_file()
+{
+    if (fd < 0) {
+        return;
+    }
+    
+    flush();
+    
+    if (::close(fd) < 0) {
+        srs_error("close file %s failed. ret=%d", path.c_str(), ERROR_SYSTEM_FILE_CLOSE);
+    }
+    fd = -1;
+}
+
+int SrsTsFileWriter::flush()
+{
+    int ret = write_fully(buf, nb_buf);
+    
+    // on error, drop the buffered data, the segment is broken anyway.
+    nb_buf = 0;
+    
+    return ret;
+}
+
+int SrsTsFileWriter::write_fully(const char* p, size_t count)
+{
+    int ret = ERROR_SUCCESS;
+    
+    while (count > 0) {
+        ssize_t nwrite;
+        if ((nwrite = ::write(fd, p, count)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = ERROR_SYSTEM_FILE_WRITE;
+            srs_error("write to file %s failed. ret=%d", path.c_str(), ret);
+            return ret;
+        }
+        p += nwrite;
+        count -= nwrite;
+        nb_flushed += nwrite;
+    }
+    
+    return ret;
+}
+
+int SrsTsFileWriter::open(string /*p*/)
+{
+    return ERROR_SUCCESS;
+}
+
+void SrsTsFileWriter::close()
+{
+    flush();
+}
+
+bool SrsTsFileWriter::is_open()
+{
+    return fd > 0;
+}
+
+int64_t SrsTsFileWriter::tellg()
+{
+    return nb_flushed + nb_buf;
+}
+
+int SrsTsFileWriter::write(void* data, size_t count, ssize_t* pnwrite)
+{
+    int ret = ERROR_SUCCESS;
+    
+    if (nb_buf + (int)count > SRS_TS_WRITER_BUFFER_SIZE) {
+        if ((ret = flush()) != ERROR_SUCCESS) {
+            return ret;
+        }
+    }
+    
+    // larger than the buffer, write directly.
+    if ((int)count > SRS_TS_WRITER_BUFFER_SIZE) {
+        if ((ret = write_fully((const char*)data, count)) != ERROR_SUCCESS) {
+            return ret;
+        }
+    } else {
+        memcpy(buf + nb_buf, data, count);
+        nb_buf += (int)count;
+    }
+    
+    if (pnwrite != NULL) {
+        *pnwrite = (ssize_t)count;
+    }
+    
+    return ret;
+}
+
+struct TsContext
+{
+    // the writer must be freed after the encoder,
+    // for the muxer of encoder will flush it when closed.
+    SrsTsFileWriter writer;
+    SrsTsEncoder enc;
+};
+
+srs_ts_t srs_ts_open_write(const char* file)
+{
+    int ret = ERROR_SUCCESS;
+    
+    TsContext* ts = new TsContext();
+    
+    if ((ret = ts->writer.open_file(file)) != ERROR_SUCCESS) {
+        srs_freep(ts);
+        return NULL;
+    }
+    
+    if ((ret = ts->enc.initialize(&ts->writer)) != ERROR_SUCCESS) {
+        srs_freep(ts);
+        return NULL;
+    }
+    
+    return ts;
+}
+
+void srs_ts_close(srs_ts_t ts)
+{
+    TsContext* context = (TsContext*)ts;
+    srs_freep(context);
+}
+
+int srs_ts_write_tag(srs_ts_t ts, char type, int32_t time, char* data, int size)
+{
+    int ret = ERROR_SUCCESS;
+    
+    TsContext* context = (TsContext*)ts;
+
+    if (!context->writer.is_open()) {
+        return ERROR_SYSTEM_IO_INVALID;
+    }
+    
+    if (type == SRS_RTMP_TYPE_AUDIO) {
+        return context->enc.write_audio(time, data, size);
+    } else if (type == SRS_RTMP_TYPE_VIDEO) {
+        return context->enc.write_video(time, data, size);
+    }
+    
+    // ignore the script data, not muxed into ts.
+    return ret;
+}
+
+int srs_ts_flush(srs_ts_t ts)
+{
+    TsContext* context = (TsContext*)ts;
+    return context->writer.flush();
+}
+
+int64_t srs_ts_tellg(srs_ts_t ts)
+{
+    TsContext* context = (TsContext*)ts;
+    return context->writer.tellg();
+}
+
 srs_amf0_t srs_amf0_parse(char* data, int size, int* nparsed)
 {
     int ret = ERROR_SUCCESS;
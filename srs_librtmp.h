@@ -262,7 +262,7 @@ extern int srs_rtmp_bandwidth_check(srs_rtmp_t rtmp,
 * @param size, size of packet.
 * @return the error code. 0 for success; otherwise, error.
 *
-* @remark: for read, user must free the data.
+* @remark: for read, user must free the data by srs_rtmp_free_packet.
 * @remark: for write, user should never free the data, even if error.
 * @example /trunk/research/librtmp/srs_play.c
 * @example /trunk/research/librtmp/srs_publish.c
@@ -276,6 +276,22 @@ extern int srs_rtmp_write_packet(srs_rtmp_t rtmp,
     char type, u_int32_t timestamp, char* data, int size
 );
 
+/**
+* the data read by srs_rtmp_read_packet is from a pool of payloads,
+* which must be returned by srs_rtmp_free_packet, never free() or delete[].
+* srs_rtmp_alloc_packet allocs from the pool, for data freed the same way.
+*/
+extern char* srs_rtmp_alloc_packet(int size);
+extern void srs_rtmp_free_packet(char* data);
+/**
+* a packet of the size bytes at data in packet, which shares the memory of
+* packet and is freed by srs_rtmp_free_packet as well, for example a tag of
+* an aggregate message. packet is freed when it and all its views are freed.
+* @remark the 8 bytes ahead of data are overwritten, which must be in packet
+*       and never in other views, for example the flv tag header of data.
+*/
+extern char* srs_rtmp_view_packet(char* packet, char* data);
+
 /**
 * whether type is script data and the data is onMetaData.
 */
@@ -580,6 +596,34 @@ extern srs_bool srs_flv_is_keyframe(char* data, int32_t size);
 extern const char* srs_flv_get_audio_codec_name(char* data, int32_t size);
 extern const char* srs_flv_get_video_codec_name(char* data, int32_t size);
 
+/*************************************************************
+**************************************************************
+* ts codec
+* convert the flv tags to mpegts by SrsTsEncoder, h.264 and aac/mp3 only.
+**************************************************************
+*************************************************************/
+typedef void* srs_ts_t;
+/* open ts file to write, the PAT/PMT is written before the first frame. */
+extern srs_ts_t srs_ts_open_write(const char* file);
+/* flush the buffered ts packets and close the file. */
+extern void srs_ts_close(srs_ts_t ts);
+/**
+* write the flv tag to ts file.
+* @param type, the flv tag type, the script tag is ignored.
+* @param time, the dts of tag in ms.
+* @remark the sequence header must be written before the frames,
+*       for it's the only source of sps/pps and adts info.
+*
+* @return 0, success; otherswise, failed.
+*/
+extern int srs_ts_write_tag(srs_ts_t ts,
+    char type, int32_t time, char* data, int size
+);
+/* write the buffered ts packets to file. */
+extern int srs_ts_flush(srs_ts_t ts);
+/* the bytes written to ts file, including the buffered packets. */
+extern int64_t srs_ts_tellg(srs_ts_t ts);
+
 /*************************************************************
 **************************************************************
 * amf0 codec
@@ -0,0 +1,205 @@
+#include "stage_hist.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ticks are calibrated against the monotonic clock for this long at init
+#define STAGE_HIST_CALIBRATE_NS 10000000
+// begin and end pairs timed to estimate the overhead of a record
+#define STAGE_HIST_CALIBRATE_LOOPS 4096
+
+typedef struct {
+    uint32_t counts[STAGE_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} StageHist;
+
+static const char *stage_names[STAGE_MAX] = {
+    "read", "check", "filter", "timestamp", "write", "file_end", "notify"
+};
+
+static const char *stage_stream_names[STAGE_STREAM_MAX] = {
+    "video", "audio", "other"
+};
+
+int g_stage_hist_enabled = 0;
+
+static StageHist *g_hists;
+static double g_ticks_per_ns;
+static uint64_t g_base_ticks;
+static int64_t g_base_ns;
+static uint64_t g_period_ticks;
+static uint64_t g_next_export;
+static uint64_t g_window_start;
+static uint64_t g_records;
+static uint64_t g_record_ticks;
+static int g_period_s;
+
+static int64_t stage_hist_mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int stage_hist_bucket(uint64_t v)
+{
+    int shift;
+
+    if (v < STAGE_HIST_SUB) {
+        return (int)v;
+    }
+    shift = 63 - __builtin_clzll(v) - STAGE_HIST_SUB_BITS;
+    return (shift + 1) * STAGE_HIST_SUB + (int)((v >> shift) & (STAGE_HIST_SUB - 1));
+}
+
+// the highest value of bucket b
+static uint64_t stage_hist_bucket_value(int b)
+{
+    int shift;
+
+    if (b < STAGE_HIST_SUB) {
+        return b;
+    }
+    shift = b / STAGE_HIST_SUB - 1;
+    return (((uint64_t)STAGE_HIST_SUB + b % STAGE_HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void stage_hist_add(StageHist *h, uint64_t ticks)
+{
+    h->counts[stage_hist_bucket(ticks)]++;
+    h->count++;
+    h->sum += ticks;
+    if (ticks > h->max) {
+        h->max = ticks;
+    }
+}
+
+static uint64_t stage_hist_percentile(StageHist *h, double q)
+{
+    uint64_t target = (uint64_t)(q * h->count + 0.5);
+    uint64_t n = 0;
+    int b;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (b = 0; b < STAGE_HIST_BUCKETS; b++) {
+        n += h->counts[b];
+        if (n >= target) {
+            uint64_t v = stage_hist_bucket_value(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static double stage_hist_us(uint64_t ticks)
+{
+    return ticks / g_ticks_per_ns / 1000;
+}
+
+static void stage_hist_export(uint64_t now)
+{
+    int64_t elapsed_ns = stage_hist_mono_ns() - g_base_ns;
+    uint64_t window = now - g_window_start;
+    int i;
+
+    // refine the rate over the whole run
+    if (elapsed_ns > STAGE_HIST_CALIBRATE_NS && now > g_base_ticks) {
+        g_ticks_per_ns = (double)(now - g_base_ticks) / elapsed_ns;
+        g_period_ticks = (uint64_t)(g_period_s * 1e9 * g_ticks_per_ns);
+    }
+
+    logger(LOG_INFO, "stage latency in %.1f s, %llu records, overhead %.3f%%",
+        stage_hist_us(window) / 1000000, g_records,
+        window ? 100.0 * g_records * g_record_ticks / window : 0.0);
+    for (i = 0; i < STAGE_MAX * STAGE_STREAM_MAX; i++) {
+        StageHist *h = &g_hists[i];
+        if (!h->count) {
+            continue;
+        }
+        logger(LOG_INFO, "stage latency[%s] %s: count %llu, mean %.2f, p50 %.2f, p90 %.2f, p99 %.2f, p999 %.2f, max %.2f us",
+            stage_stream_names[i % STAGE_STREAM_MAX], stage_names[i / STAGE_STREAM_MAX], h->count,
+            stage_hist_us(h->sum / h->count), stage_hist_us(stage_hist_percentile(h, 0.5)),
+            stage_hist_us(stage_hist_percentile(h, 0.9)), stage_hist_us(stage_hist_percentile(h, 0.99)),
+            stage_hist_us(stage_hist_percentile(h, 0.999)), stage_hist_us(h->max));
+    }
+
+    memset(g_hists, 0, sizeof(StageHist) * STAGE_MAX * STAGE_STREAM_MAX);
+    g_records = 0;
+    g_window_start = now;
+    g_next_export = now + g_period_ticks;
+}
+
+void stage_hist_init(int period_s)
+{
+    StageHist *scratch;
+    uint64_t start;
+    int i;
+
+    if (period_s <= 0 || g_stage_hist_enabled) {
+        return;
+    }
+    g_hists = calloc(STAGE_MAX * STAGE_STREAM_MAX, sizeof(StageHist));
+    scratch = calloc(1, sizeof(StageHist));
+    if (!g_hists || !scratch) {
+        logger(LOG_ERROR, "alloc stage latency histograms failed");
+        free(g_hists);
+        free(scratch);
+        g_hists = NULL;
+        return;
+    }
+
+    g_base_ns = stage_hist_mono_ns();
+    g_base_ticks = stage_hist_now();
+    while (stage_hist_mono_ns() - g_base_ns < STAGE_HIST_CALIBRATE_NS) {
+    }
+    g_ticks_per_ns = (double)(stage_hist_now() - g_base_ticks) / (stage_hist_mono_ns() - g_base_ns);
+    if (g_ticks_per_ns <= 0) {
+        g_ticks_per_ns = 1;
+    }
+
+    start = stage_hist_now();
+    for (i = 0; i < STAGE_HIST_CALIBRATE_LOOPS; i++) {
+        uint64_t t = stage_hist_now();
+        stage_hist_add(scratch, stage_hist_now() - t);
+    }
+    g_record_ticks = (stage_hist_now() - start) / STAGE_HIST_CALIBRATE_LOOPS;
+    free(scratch);
+
+    g_period_s = period_s;
+    g_period_ticks = (uint64_t)(period_s * 1e9 * g_ticks_per_ns);
+    g_window_start = stage_hist_now();
+    g_next_export = g_window_start + g_period_ticks;
+    g_records = 0;
+    g_stage_hist_enabled = 1;
+    logger(LOG_INFO, "stage latency every %d s, %.3f ticks per ns, %.1f ns per record",
+        period_s, g_ticks_per_ns, g_record_ticks / g_ticks_per_ns);
+}
+
+void stage_hist_uninit()
+{
+    if (!g_stage_hist_enabled) {
+        return;
+    }
+    if (g_records) {
+        stage_hist_export(stage_hist_now());
+    }
+    g_stage_hist_enabled = 0;
+    free(g_hists);
+    g_hists = NULL;
+}
+
+void stage_hist_record(int stage, int stream, uint64_t ticks, uint64_t now)
+{
+    stage_hist_add(&g_hists[stage * STAGE_STREAM_MAX + stream], ticks);
+    g_records++;
+
+    // read is not nested in other stages, so the export is timed by none
+    if (stage == STAGE_READ && now >= g_next_export) {
+        stage_hist_export(now);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef STAGE_HIST_H_
+#define STAGE_HIST_H_
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// stages of the packet pipeline
+enum {
+    STAGE_READ = 0,
+    STAGE_CHECK,
+    STAGE_FILTER,
+    STAGE_TIMESTAMP,
+    STAGE_WRITE,
+    // segment or chunk end, notify included
+    STAGE_FILE_END,
+    STAGE_NOTIFY,
+    STAGE_MAX
+};
+
+enum {
+    STAGE_STREAM_VIDEO = 0,
+    STAGE_STREAM_AUDIO,
+    // data streams, and stages of the segment
+    STAGE_STREAM_OTHER,
+    STAGE_STREAM_MAX
+};
+
+// log-linear buckets, 2^STAGE_HIST_SUB_BITS per power of two, ~6% precision
+#define STAGE_HIST_SUB_BITS 4
+#define STAGE_HIST_SUB (1 << STAGE_HIST_SUB_BITS)
+#define STAGE_HIST_BUCKETS ((64 - STAGE_HIST_SUB_BITS + 1) * STAGE_HIST_SUB)
+
+extern int g_stage_hist_enabled;
+
+// cycle counter, ticks are calibrated to time at export
+static inline uint64_t stage_hist_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * export the histograms every period_s seconds to log, 0 to disable.
+ */
+void stage_hist_init(int period_s);
+
+/**
+ * export what is left.
+ */
+void stage_hist_uninit();
+
+void stage_hist_record(int stage, int stream, uint64_t ticks, uint64_t now);
+
+/**
+ * start of a stage, 0 when disabled.
+ */
+static inline uint64_t stage_hist_begin()
+{
+    return g_stage_hist_enabled ? stage_hist_now() : 0;
+}
+
+static inline void stage_hist_end(uint64_t start, int stage, int stream)
+{
+    if (start) {
+        uint64_t now = stage_hist_now();
+        stage_hist_record(stage, stream, now - start, now);
+    }
+}
+
+#endif
@@ -0,0 +1,537 @@
+#include "standby_input.h"
+#include "rtmp_client.h"
+#include "srs_librtmp.h"
+#include "log.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STANDBY_TRACK_AUDIO 0
+#define STANDBY_TRACK_VIDEO 1
+// timestamp step after the last tag when switching without synced timestamps
+#define STANDBY_DEFAULT_STEP_MS 40
+
+typedef struct StandbyTag {
+    char type;
+    u_int32_t timestamp;
+    char *data;
+    int size;
+    struct StandbyTag *next;
+} StandbyTag;
+
+typedef struct {
+    struct StandbyInput *si;
+    int index;
+    char *url;
+    RtmpClient *client;
+
+    // tags are read from this input, otherwise the queue starts at a keyframe
+    int delivering;
+    StandbyTag *tags;
+    StandbyTag *tags_end;
+    int has_video;
+    // the latest sequence headers, replayed when switching to this input
+    char *seqhead[2];
+    int seqhead_size[2];
+
+    // health
+    int64_t last_arrival;
+    int has_base;
+    // min of arrival time minus timestamp
+    int64_t base_delay;
+    int64_t lag_ms;
+    int64_t last_ts[2];
+    // time of the last discontinuity, 0 for none
+    int64_t jump_time;
+
+    int64_t retry_time;
+    int backoff_ms;
+} StandbyPeer;
+
+struct StandbyInput {
+    RtmpPoller *poller;
+    StandbyPeer peers[STANDBY_N_INPUTS];
+    int active;
+    int failover_ms;
+    int timeout_ms;
+
+    // added to timestamps of the active input
+    int64_t offset;
+    // the latest timestamps read, -1 for none
+    int64_t last_ts;
+    int64_t video_ts;
+    int64_t video_step;
+    int64_t last_read;
+
+    StandbyStats *stats;
+    StandbyStats own_stats;
+};
+
+static int64_t standby_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int standby_track(char type)
+{
+    if (type == SRS_RTMP_TYPE_AUDIO) {
+        return STANDBY_TRACK_AUDIO;
+    } else if (type == SRS_RTMP_TYPE_VIDEO) {
+        return STANDBY_TRACK_VIDEO;
+    }
+    return -1;
+}
+
+// avc and hevc share the packet type of sequence header
+static int standby_is_seqhead(char type, char *data, int size)
+{
+    if (type == SRS_RTMP_TYPE_VIDEO) {
+        return size > 1 && srs_flv_is_keyframe(data, size) && data[1] == 0;
+    } else if (type == SRS_RTMP_TYPE_AUDIO) {
+        return srs_utils_flv_audio_aac_packet_type(data, size) == 0;
+    }
+    return 0;
+}
+
+// a keyframe, or any audio frame of audio only streams
+static int standby_is_switch_point(StandbyPeer *p, char type, char *data, int size)
+{
+    if (standby_is_seqhead(type, data, size)) {
+        return 0;
+    }
+    return type == SRS_RTMP_TYPE_VIDEO ? srs_flv_is_keyframe(data, size) :
+        (type == SRS_RTMP_TYPE_AUDIO && !p->has_video);
+}
+
+static int standby_peer_closed(StandbyPeer *p)
+{
+    return !p->client || rtmp_client_state(p->client) == RTMP_CLIENT_STATE_CLOSED;
+}
+
+static int standby_peer_healthy(StandbyPeer *p, int64_t now)
+{
+    int failover_ms = p->si->failover_ms;
+
+    return !standby_peer_closed(p) && now - p->last_arrival <= failover_ms &&
+        p->lag_ms <= failover_ms && (!p->jump_time || now - p->jump_time >= failover_ms);
+}
+
+static const char *standby_peer_fault(StandbyPeer *p, int64_t now)
+{
+    if (standby_peer_closed(p)) {
+        return "closed";
+    } else if (now - p->last_arrival > p->si->failover_ms) {
+        return "stalled";
+    } else if (p->lag_ms > p->si->failover_ms) {
+        return "lagging";
+    }
+    return "discontinuous";
+}
+
+static void standby_peer_clear(StandbyPeer *p)
+{
+    while (p->tags) {
+        StandbyTag *tag = p->tags;
+        p->tags = tag->next;
+        srs_rtmp_free_packet(tag->data);
+        free(tag);
+    }
+    p->tags_end = NULL;
+}
+
+static void standby_peer_push(StandbyPeer *p, StandbyTag *tag, int front)
+{
+    if (front) {
+        tag->next = p->tags;
+        p->tags = tag;
+        if (!p->tags_end) {
+            p->tags_end = tag;
+        }
+        return;
+    }
+    tag->next = NULL;
+    if (p->tags_end) {
+        p->tags_end->next = tag;
+    } else {
+        p->tags = tag;
+    }
+    p->tags_end = tag;
+}
+
+static void standby_peer_update_health(StandbyPeer *p, int track, u_int32_t timestamp, int64_t now)
+{
+    int64_t delay = now - timestamp;
+
+    if (p->last_ts[track] >= 0) {
+        int64_t delta = (int64_t)timestamp - p->last_ts[track];
+        if (delta < 0 || delta > STANDBY_MAX_TS_JUMP_MS) {
+            logger(LOG_WARN, "standby input %d timestamp jumps %lld ms of track %d",
+                p->index, delta, track);
+            p->jump_time = now;
+            p->has_base = 0;
+            p->si->stats->discontinuities[p->index]++;
+        }
+    }
+    p->last_ts[track] = timestamp;
+
+    if (!p->has_base || delay < p->base_delay) {
+        p->base_delay = delay;
+        p->has_base = 1;
+    }
+    p->lag_ms = delay - p->base_delay;
+    p->si->stats->lag_ms[p->index] = p->lag_ms;
+    metrics_set(&g_metrics.standby_lag_ms[p->index], p->lag_ms);
+}
+
+static void standby_on_tag(void *opaque, char type, u_int32_t timestamp, char *data, int size)
+{
+    StandbyPeer *p = opaque;
+    int64_t now = standby_now_ms();
+    int track = standby_track(type);
+    int is_seqhead = standby_is_seqhead(type, data, size);
+    StandbyTag *tag;
+
+    p->last_arrival = now;
+    p->backoff_ms = 0;
+    if (track >= 0 && !is_seqhead) {
+        standby_peer_update_health(p, track, timestamp, now);
+    }
+    if (track == STANDBY_TRACK_VIDEO) {
+        p->has_video = 1;
+    }
+    if (is_seqhead) {
+        char *copy = realloc(p->seqhead[track], size);
+        if (copy) {
+            memcpy(copy, data, size);
+            p->seqhead[track] = copy;
+            p->seqhead_size[track] = size;
+        }
+    }
+
+    // the standby keeps its current gop, audio only streams switch at any frame
+    if (!p->delivering) {
+        if (standby_is_switch_point(p, type, data, size)) {
+            standby_peer_clear(p);
+        } else if (!p->tags || is_seqhead) {
+            srs_rtmp_free_packet(data);
+            return;
+        }
+    }
+
+    tag = malloc(sizeof(StandbyTag));
+    if (!tag) {
+        srs_rtmp_free_packet(data);
+        return;
+    }
+    tag->type = type;
+    tag->timestamp = timestamp;
+    tag->data = data;
+    tag->size = size;
+    standby_peer_push(p, tag, 0);
+}
+
+static void standby_on_close(void *opaque, int error)
+{
+    StandbyPeer *p = opaque;
+
+    p->backoff_ms = p->backoff_ms ? p->backoff_ms * 2 : STANDBY_RETRY_MIN_MS;
+    if (p->backoff_ms > STANDBY_RETRY_MAX_MS) {
+        p->backoff_ms = STANDBY_RETRY_MAX_MS;
+    }
+    p->retry_time = standby_now_ms() + p->backoff_ms;
+    logger(LOG_WARN, "standby input %d %s closed, error %d, retry in %d ms",
+        p->index, p->url, error, p->backoff_ms);
+}
+
+static int standby_peer_start(StandbyPeer *p)
+{
+    p->has_base = 0;
+    p->lag_ms = 0;
+    p->last_ts[0] = p->last_ts[1] = -1;
+    p->jump_time = 0;
+    p->last_arrival = standby_now_ms();
+
+    p->client = rtmp_client_create(p->url, standby_on_tag, standby_on_close, p);
+    if (p->client) {
+        rtmp_client_set_timeout(p->client, p->si->timeout_ms);
+        if (rtmp_client_start(p->client, p->si->poller) == 0) {
+            return 0;
+        }
+        rtmp_client_destroy(p->client);
+        p->client = NULL;
+    }
+    standby_on_close(p, 0);
+    return -1;
+}
+
+// restart the closed inputs whose queue is drained
+static void standby_input_retry(StandbyInput *si, int64_t now)
+{
+    int i;
+
+    for (i = 0; i < STANDBY_N_INPUTS; i++) {
+        StandbyPeer *p = &si->peers[i];
+        if (!standby_peer_closed(p) || now < p->retry_time || (p->delivering && p->tags)) {
+            continue;
+        }
+        rtmp_client_destroy(p->client);
+        p->client = NULL;
+        standby_peer_clear(p);
+        p->delivering = 0;
+        si->stats->reconnects[i]++;
+        logger(LOG_WARN, "standby input %d reconnect %s", i, p->url);
+        standby_peer_start(p);
+    }
+}
+
+/**
+ * check if the timestamps of p follow those read from the active input,
+ * so p is read from its first switch point after them with the same offset.
+ * its older tags are dropped then, and the queue is empty till that switch
+ * point arrives.
+ */
+static int standby_peer_seek(StandbyInput *si, StandbyPeer *p, int64_t now)
+{
+    // the last timestamp read in the timeline of the inputs
+    int64_t last_ts = si->last_ts - si->offset;
+    // p is ahead by the time the active input stalled or lagged
+    int64_t ahead = now - si->last_read + si->peers[si->active].lag_ms;
+    int64_t newest = p->tags_end->timestamp;
+
+    if (si->last_ts < 0) {
+        return 1;
+    }
+    if (newest < last_ts - STANDBY_SYNC_WINDOW_MS || newest > last_ts + ahead + STANDBY_SYNC_WINDOW_MS) {
+        return 0;
+    }
+    while (p->tags && (p->tags->timestamp <= last_ts ||
+           !standby_is_switch_point(p, p->tags->type, p->tags->data, p->tags->size))) {
+        StandbyTag *tag = p->tags;
+        p->tags = tag->next;
+        srs_rtmp_free_packet(tag->data);
+        free(tag);
+    }
+    if (!p->tags) {
+        p->tags_end = NULL;
+    }
+    return 1;
+}
+
+static void standby_input_switch(StandbyInput *si, StandbyPeer *to, int synced, const char *reason)
+{
+    StandbyPeer *from = &si->peers[si->active];
+    int64_t key = to->tags->timestamp;
+    int i;
+
+    if (from != to) {
+        from->delivering = 0;
+        standby_peer_clear(from);
+    }
+
+    // encoders with synced timestamps switch seamlessly, others continue after the last tag
+    if (!synced) {
+        si->offset = si->last_ts + si->video_step - key;
+    }
+
+    // the sequence headers may differ between encoders
+    for (i = 0; i < 2; i++) {
+        StandbyTag *tag;
+        if (!to->seqhead[i] || !(tag = malloc(sizeof(StandbyTag)))) {
+            continue;
+        }
+        tag->type = i == STANDBY_TRACK_VIDEO ? SRS_RTMP_TYPE_VIDEO : SRS_RTMP_TYPE_AUDIO;
+        tag->timestamp = key;
+        tag->size = to->seqhead_size[i];
+        tag->data = srs_rtmp_alloc_packet(tag->size);
+        if (!tag->data) {
+            free(tag);
+            continue;
+        }
+        memcpy(tag->data, to->seqhead[i], tag->size);
+        standby_peer_push(to, tag, 1);
+    }
+
+    to->delivering = 1;
+    si->active = to->index;
+    si->stats->active = to->index;
+    metrics_set(&g_metrics.standby_active, to->index);
+    if (from != to) {
+        si->stats->switches++;
+        metrics_add(&g_metrics.standby_switches, 1);
+    }
+    logger(LOG_WARN, "standby switch input %d to %d, %s, at %lld offset %lld, lag %lld/%lld ms",
+        from->index, to->index, reason, key, si->offset,
+        si->stats->lag_ms[STANDBY_PRIMARY], si->stats->lag_ms[STANDBY_BACKUP]);
+}
+
+// switch at the keyframe of the other input when the active one fails
+static void standby_input_select(StandbyInput *si, int64_t now)
+{
+    StandbyPeer *cur = &si->peers[si->active];
+    StandbyPeer *other = &si->peers[!si->active];
+    StandbyPeer *to = NULL;
+    const char *reason;
+    int synced;
+
+    if (cur->delivering && standby_peer_healthy(cur, now)) {
+        return;
+    }
+    if (!other->delivering && other->tags && standby_peer_healthy(other, now)) {
+        to = other;
+        reason = cur->delivering ? standby_peer_fault(cur, now) : "restarted";
+    } else if (!cur->delivering && cur->tags && standby_peer_healthy(cur, now)) {
+        to = cur;
+        reason = "resumed";
+    }
+    if (!to) {
+        return;
+    }
+    synced = standby_peer_seek(si, to, now);
+    if (to->tags) {
+        standby_input_switch(si, to, synced, reason);
+    }
+}
+
+StandbyInput *standby_input_open(const char *primary, const char *backup,
+                                 int failover_ms, int timeout_ms, StandbyStats *stats)
+{
+    StandbyInput *si = calloc(1, sizeof(StandbyInput));
+    int64_t deadline;
+    int i;
+
+    if (!si) {
+        return NULL;
+    }
+    si->failover_ms = failover_ms > 0 ? failover_ms : STANDBY_FAILOVER_MS;
+    si->timeout_ms = timeout_ms > 0 ? timeout_ms : RTMP_CLIENT_TIMEOUT_MS;
+    si->stats = stats ? stats : &si->own_stats;
+    si->active = STANDBY_PRIMARY;
+    si->stats->active = si->active;
+    metrics_set(&g_metrics.standby, 1);
+    si->last_ts = -1;
+    si->video_ts = -1;
+    si->video_step = STANDBY_DEFAULT_STEP_MS;
+
+    si->poller = rtmp_poller_create();
+    if (!si->poller) {
+        free(si);
+        return NULL;
+    }
+    for (i = 0; i < STANDBY_N_INPUTS; i++) {
+        StandbyPeer *p = &si->peers[i];
+        p->si = si;
+        p->index = i;
+        p->url = strdup(i == STANDBY_PRIMARY ? primary : backup);
+        if (!p->url) {
+            goto fail;
+        }
+    }
+    // the primary is read from the start, the backup buffers from its keyframe
+    si->peers[STANDBY_PRIMARY].delivering = 1;
+    for (i = 0; i < STANDBY_N_INPUTS; i++) {
+        standby_peer_start(&si->peers[i]);
+    }
+
+    deadline = standby_now_ms() + si->timeout_ms;
+    while (1) {
+        int playing = 0;
+        int closed = 0;
+        for (i = 0; i < STANDBY_N_INPUTS; i++) {
+            if (standby_peer_closed(&si->peers[i])) {
+                closed++;
+            } else if (rtmp_client_state(si->peers[i].client) >= RTMP_CLIENT_STATE_PLAY) {
+                playing++;
+            }
+        }
+        if (playing) {
+            break;
+        }
+        if (closed == STANDBY_N_INPUTS || standby_now_ms() >= deadline) {
+            logger(LOG_ERROR, "open standby inputs %s and %s failed", primary, backup);
+            goto fail;
+        }
+        if (rtmp_poller_run(si->poller, STANDBY_POLL_MS) < 0) {
+            goto fail;
+        }
+    }
+    si->last_read = standby_now_ms();
+    logger(LOG_INFO, "standby inputs %s and %s opened, failover %d ms", primary, backup, si->failover_ms);
+    return si;
+
+fail:
+    standby_input_close(si);
+    return NULL;
+}
+
+int standby_input_read_packet(StandbyInput *si, char *type, u_int32_t *timestamp, char **data, int *size)
+{
+    while (1) {
+        int64_t now = standby_now_ms();
+        StandbyPeer *p;
+
+        standby_input_retry(si, now);
+        standby_input_select(si, now);
+
+        p = &si->peers[si->active];
+        if (p->delivering && p->tags) {
+            StandbyTag *tag = p->tags;
+            int64_t ts = tag->timestamp + si->offset;
+
+            p->tags = tag->next;
+            if (!p->tags) {
+                p->tags_end = NULL;
+            }
+            if (ts < 0) {
+                ts = 0;
+            }
+            if (tag->type == SRS_RTMP_TYPE_VIDEO && !standby_is_seqhead(tag->type, tag->data, tag->size)) {
+                if (si->video_ts >= 0 && ts > si->video_ts) {
+                    si->video_step = ts - si->video_ts;
+                }
+                si->video_ts = ts;
+            }
+            if (ts > si->last_ts) {
+                si->last_ts = ts;
+            }
+            si->last_read = now;
+
+            *type = tag->type;
+            *timestamp = (u_int32_t)ts;
+            *data = tag->data;
+            *size = tag->size;
+            free(tag);
+            return 0;
+        }
+
+        if (now - si->last_read > si->timeout_ms) {
+            logger(LOG_ERROR, "no tags of standby inputs in %lld ms", now - si->last_read);
+            return -1;
+        }
+        if (rtmp_poller_run(si->poller, STANDBY_POLL_MS) < 0) {
+            return -1;
+        }
+    }
+}
+
+void standby_input_close(StandbyInput *si)
+{
+    int i;
+
+    if (!si) {
+        return;
+    }
+    for (i = 0; i < STANDBY_N_INPUTS; i++) {
+        StandbyPeer *p = &si->peers[i];
+        rtmp_client_destroy(p->client);
+        standby_peer_clear(p);
+        free(p->seqhead[0]);
+        free(p->seqhead[1]);
+        free(p->url);
+    }
+    rtmp_poller_destroy(si->poller);
+    free(si);
+}
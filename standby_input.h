@@ -0,0 +1,51 @@
+#ifndef STANDBY_INPUT_H_
+#define STANDBY_INPUT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STANDBY_N_INPUTS 2
+#define STANDBY_PRIMARY 0
+#define STANDBY_BACKUP 1
+
+// an input is unhealthy when it lags, stalls or jumped in the last failover_ms
+#define STANDBY_FAILOVER_MS 2000
+// timestamp gap of a track larger than this is a discontinuity
+#define STANDBY_MAX_TS_JUMP_MS 3000
+// inputs are synced when the newest tag of the standby is this close to the
+// last one read, besides the time the active input stalled or lagged
+#define STANDBY_SYNC_WINDOW_MS 1000
+#define STANDBY_POLL_MS 100
+#define STANDBY_RETRY_MIN_MS 500
+#define STANDBY_RETRY_MAX_MS 5000
+
+typedef struct {
+    // the input being read, STANDBY_PRIMARY or STANDBY_BACKUP
+    int active;
+    int64_t switches;
+    // arrival lag of the latest tag behind the timestamps
+    int64_t lag_ms[STANDBY_N_INPUTS];
+    int64_t discontinuities[STANDBY_N_INPUTS];
+    int64_t reconnects[STANDBY_N_INPUTS];
+} StandbyStats;
+
+typedef struct StandbyInput StandbyInput;
+
+/**
+ * play both rtmp urls, the primary is read while the backup buffers its
+ * current gop. return when one of them plays, NULL on error.
+ * stats is updated in place and may be NULL.
+ */
+StandbyInput *standby_input_open(const char *primary, const char *backup,
+                                 int failover_ms, int timeout_ms, StandbyStats *stats);
+
+/**
+ * read a flv tag of the active input, which switches to the other at its
+ * keyframe when unhealthy. timestamps continue across switches.
+ * semantics are the same as srs_rtmp_read_packet, return 0 or -1 on error.
+ */
+int standby_input_read_packet(StandbyInput *si, char *type, u_int32_t *timestamp, char **data, int *size);
+
+void standby_input_close(StandbyInput *si);
+
+#endif
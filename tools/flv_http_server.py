@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""
+serve an flv file as a live http-flv stream, to test the http input
+without a media server.
+
+  flv_http_server.py [-p port] [-c] [-r] file.flv
+
+the stream is at any path ending in /live.flv, tags are sent at the pace
+of their timestamps unless -r, in chunked transfer encoding with -c. a
+path ending in /redirect answers 302 with an absolute, a root relative
+and a path relative Location to live.flv in turn.
+
+  tools/flv_http_server.py -c test.flv &
+  livestream_segmenter -i http://127.0.0.1:8080/redirect -f -n -p /tmp/lss/test
+"""
+import argparse
+import socketserver
+import struct
+import time
+
+FLV_HEADER_SIZE = 9
+FLV_TAG_HEADER_SIZE = 11
+
+
+def read_tags(path):
+    """return the flv header with the first previous tag size, and the tags
+    with their previous tag size, as (timestamp ms, bytes)"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:3] != b'FLV':
+        raise SystemExit('%s is not flv' % path)
+    pos = struct.unpack('>I', data[5:9])[0] + 4
+    header = data[:pos]
+    tags = []
+    while pos + FLV_TAG_HEADER_SIZE <= len(data):
+        size = struct.unpack('>I', b'\0' + data[pos + 1:pos + 4])[0]
+        ts = struct.unpack('>I', data[pos + 7:pos + 8] + data[pos + 4:pos + 7])[0]
+        end = pos + FLV_TAG_HEADER_SIZE + size + 4
+        if end > len(data):
+            break
+        tags.append((ts, data[pos:end]))
+        pos = end
+    return header, tags
+
+
+class Handler(socketserver.StreamRequestHandler):
+    redirects = 0
+
+    def send_body(self, data):
+        if self.server.chunked:
+            data = b'%x\r\n%s\r\n' % (len(data), data)
+        self.wfile.write(data)
+
+    def handle(self):
+        line = self.rfile.readline().decode('latin-1').split()
+        while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+            pass
+        if len(line) < 2:
+            return
+        path = line[1].split('?')[0]
+
+        if path.endswith('/redirect'):
+            locations = ['http://127.0.0.1:%d/live.flv' % self.server.server_address[1],
+                         '/live.flv', 'live.flv']
+            location = locations[Handler.redirects % len(locations)]
+            Handler.redirects += 1
+            self.wfile.write(b'HTTP/1.1 302 Found\r\nLocation: %s\r\nContent-Length: 0\r\n\r\n'
+                             % location.encode())
+            return
+        if not path.endswith('/live.flv'):
+            self.wfile.write(b'HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n')
+            return
+
+        self.wfile.write(b'HTTP/1.1 200 OK\r\nContent-Type: video/x-flv\r\n%s\r\n'
+                         % (b'Transfer-Encoding: chunked\r\n' if self.server.chunked else b''))
+        try:
+            self.send_body(self.server.header)
+            start = time.time()
+            first = self.server.tags[0][0] if self.server.tags else 0
+            for ts, tag in self.server.tags:
+                if not self.server.rush:
+                    delay = (ts - first) / 1000.0 - (time.time() - start)
+                    if delay > 0:
+                        time.sleep(delay)
+                self.send_body(tag)
+            if self.server.chunked:
+                self.wfile.write(b'0\r\n\r\n')
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description='serve an flv file as http-flv')
+    parser.add_argument('-p', '--port', type=int, default=8080)
+    parser.add_argument('-c', '--chunked', action='store_true', help='chunked transfer encoding')
+    parser.add_argument('-r', '--rush', action='store_true', help='send without pacing')
+    parser.add_argument('file')
+    args = parser.parse_args()
+
+    server = Server(('127.0.0.1', args.port), Handler)
+    server.header, server.tags = read_tags(args.file)
+    server.chunked = args.chunked
+    server.rush = args.rush
+    print('serving %d tags of %s at http://127.0.0.1:%d/live.flv' % (len(server.tags), args.file, args.port))
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,142 @@
+/**
+ * print a packet trace written with the packet_trace custom option,
+ * oldest record first.
+ *
+ *   pkt_trace_dump [-n last] [-s] trace_file
+ */
+#include "../packet_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *event_names[PKT_TRACE_EVENT_MAX] = {
+    "write", "skip", "cache", "fail"
+};
+
+static const char *type_names[] = {
+    "video", "audio", "other"
+};
+
+static void print_ts(int64_t ts)
+{
+    if (ts == PKT_TRACE_NOTS) {
+        printf(" %12s", "-");
+    } else {
+        printf(" %12.3f", ts / 1000.0);
+    }
+}
+
+static void print_record(uint64_t seq, const PktTraceRecord *r)
+{
+    printf("%10llu %12.3f %-5s %-5s %3d %c%c%c%c",
+        (unsigned long long)seq, r->time_us / 1000.0,
+        r->event < PKT_TRACE_EVENT_MAX ? event_names[r->event] : "?",
+        r->type <= PKT_TRACE_TYPE_OTHER ? type_names[r->type] : "?", r->stream,
+        r->flags & PKT_TRACE_FLAG_KEY ? 'K' : '-',
+        r->flags & PKT_TRACE_FLAG_CUT ? 'S' : '-',
+        r->flags & PKT_TRACE_FLAG_CHUNK ? 'C' : '-',
+        r->flags & PKT_TRACE_FLAG_SEQ_HEADER ? 'H' : '-');
+    print_ts(r->in_dts);
+    print_ts(r->in_pts);
+    print_ts(r->out_dts);
+    print_ts(r->out_pts);
+    printf(" %8d %6d %6d %08x\n", r->size, r->seg_index, r->chunk_index, r->seg_flags);
+}
+
+int main(int argc, char *argv[])
+{
+    const PktTraceHeader *header;
+    const PktTraceRecord *records;
+    uint64_t last = 0;
+    uint64_t count, first, i;
+    uint64_t summary[PKT_TRACE_EVENT_MAX][PKT_TRACE_TYPE_OTHER + 1];
+    int show_summary = 0;
+    struct stat st;
+    void *map;
+    int opt;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "n:s")) != -1) {
+        if (opt == 'n') {
+            last = strtoull(optarg, NULL, 10);
+        } else if (opt == 's') {
+            show_summary = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-n last] [-s] trace_file\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-n last] [-s] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (st.st_size < (off_t)sizeof(PktTraceHeader)) {
+        fprintf(stderr, "%s: too short\n", argv[optind]);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    header = map;
+    if (memcmp(header->magic, PKT_TRACE_MAGIC, sizeof(header->magic)) ||
+        header->version != PKT_TRACE_VERSION || header->record_size != sizeof(PktTraceRecord) ||
+        sizeof(PktTraceHeader) + header->capacity * sizeof(PktTraceRecord) > (uint64_t)st.st_size ||
+        header->capacity == 0 || (header->capacity & (header->capacity - 1))) {
+        fprintf(stderr, "%s: not a packet trace of version %d\n", argv[optind], PKT_TRACE_VERSION);
+        return 1;
+    }
+    records = (const PktTraceRecord *)((const char *)map + sizeof(PktTraceHeader));
+
+    // the segmenter may still be writing
+    count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    first = count > header->capacity ? count - header->capacity : 0;
+    if (last > 0 && count - first > last) {
+        first = count - last;
+    }
+
+    printf("# start %lld us, %llu records, %llu kept\n", (long long)header->start_time,
+        (unsigned long long)count, (unsigned long long)(count - first));
+    if (!show_summary) {
+        printf("# %8s %12s %-5s %-5s %3s %4s %12s %12s %12s %12s %8s %6s %6s %8s\n",
+            "seq", "time_ms", "event", "type", "idx", "flag", "in_dts", "in_pts", "out_dts", "out_pts",
+            "size", "seg", "chunk", "nf");
+    }
+    memset(summary, 0, sizeof(summary));
+    for (i = first; i < count; i++) {
+        const PktTraceRecord *r = &records[i & (header->capacity - 1)];
+        if (show_summary) {
+            if (r->event < PKT_TRACE_EVENT_MAX && r->type <= PKT_TRACE_TYPE_OTHER) {
+                summary[r->event][r->type]++;
+            }
+        } else {
+            print_record(i, r);
+        }
+    }
+
+    if (show_summary) {
+        int e, t;
+        for (e = 0; e < PKT_TRACE_EVENT_MAX; e++) {
+            for (t = 0; t <= PKT_TRACE_TYPE_OTHER; t++) {
+                if (summary[e][t]) {
+                    printf("%-5s %-5s %llu\n", event_names[e], type_names[t], (unsigned long long)summary[e][t]);
+                }
+            }
+        }
+    }
+    munmap(map, st.st_size);
+    return 0;
+}